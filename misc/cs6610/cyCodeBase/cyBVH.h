@@ -36,6 +36,15 @@
 #ifndef _CY_BVH_H_INCLUDED_
 #define _CY_BVH_H_INCLUDED_
 
+//-------------------------------------------------------------------------------
+
+#include "cyCore.h"
+#include "cyParallel.h"
+#include "cyMappedFile.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
 //-------------------------------------------------------------------------------
 namespace cy {
 //-------------------------------------------------------------------------------
@@ -48,6 +57,30 @@ namespace cy {
 #define CY_BVH_MAX_ELEMENT_COUNT	(1<<CY_BVH_ELEMENT_COUNT_BITS)	//!< Determines the maximum number of elements in a node (8)
 #endif
 
+#ifndef CY_BVH_MAX_DEPTH
+#define CY_BVH_MAX_DEPTH			64	//!< Determines the maximum depth of the hierarchy, which is also the size of the traversal stack (must be larger than 32)
+#endif
+
+#ifndef CY_BVH_PARALLEL_BUILD_THRESHOLD
+#define CY_BVH_PARALLEL_BUILD_THRESHOLD	4096	//!< Determines the minimum number of elements in a node for building its sub-trees in parallel
+#endif
+
+#ifndef CY_BVH_SAH_BIN_COUNT
+#define CY_BVH_SAH_BIN_COUNT		16	//!< Determines the number of bins per axis used by the binned SAH split
+#endif
+
+#ifndef CY_BVH_SAH_TRAVERSAL_COST
+#define CY_BVH_SAH_TRAVERSAL_COST	1.0f	//!< The cost of traversing a node relative to intersecting an element, used by the SAH split
+#endif
+
+#ifndef CY_BVH_FILE_VERSION
+#define CY_BVH_FILE_VERSION			1	//!< The version of the BVH cache files, which must be incremented when the file layout or the node layout changes
+#endif
+
+#ifndef CY_BVH_REBUILD_COST_RATIO
+#define CY_BVH_REBUILD_COST_RATIO	1.5f	//!< Determines the default SAH cost increase after refitting that requires rebuilding the hierarchy
+#endif
+
 #define _CY_BVH_NODE_DATA_BITS		(sizeof(unsigned int)*8)
 #define _CY_BVH_ELEMENT_COUNT_MASK	((1<<CY_BVH_ELEMENT_COUNT_BITS)-1)
 #define _CY_BVH_LEAF_BIT_MASK		((unsigned int)1<<(_CY_BVH_NODE_DATA_BITS-1))
@@ -56,6 +89,15 @@ namespace cy {
 #define _CY_BVH_ELEMENT_OFFSET_BITS	(_CY_BVH_NODE_DATA_BITS-1-CY_BVH_ELEMENT_COUNT_BITS)
 #define _CY_BVH_ELEMENT_OFFSET_MASK	((1<<_CY_BVH_ELEMENT_OFFSET_BITS)-1)
 
+#if !defined(CY_NO_INTRIN_H) && !defined(CY_NO_EMMINTRIN_H) && !defined(CY_NO_IMMINTRIN_H)
+# if defined(__AVX__)
+#  define _CY_BVH_AVX
+# endif
+# if defined(__SSE__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 1 )
+#  define _CY_BVH_SSE
+# endif
+#endif
+
 //-------------------------------------------------------------------------------
 
 //! Bounding Volume Hierarchy class
@@ -64,8 +106,15 @@ class BVH
 {
 public:
 
+	//! Split methods used by the default implementation of FindSplit
+	enum SplitMethod
+	{
+		SPLIT_MEAN,	//!< Splits the nodes down the middle of the widest axis of their bounding boxes (faster build).
+		SPLIT_SAH,	//!< Splits the nodes using the binned surface area heuristic (faster ray traversal).
+	};
+
 	//!@name Constructor and destructor
-	BVH() : nodes(0), elements(0) {}
+	BVH() : nodes(0), elements(0), numNodes(0), numElements(0), splitMethod(SPLIT_MEAN), buildSAHCost(0) {}
 	virtual ~BVH() { Clear(); }
 
 	/////////////////////////////////////////////////////////////////////////////////
@@ -105,6 +154,73 @@ public:
 	//! Returns the list of element inside the given node (must be a leaf node).
 	unsigned int const * GetNodeElements(unsigned int nodeID) const { return &elements[nodes[nodeID].ElementOffset()]; }
 
+	/////////////////////////////////////////////////////////////////////////////////
+	//@ Ray Traversal Methods
+	/////////////////////////////////////////////////////////////////////////////////
+
+	//! Traverses the hierarchy along the given ray and calls the given element intersection function
+	//! for the elements of the leaf nodes hit by the ray. Child nodes are visited in near-to-far order
+	//! using a fixed-size stack and nodes beyond the closest hit found so far are skipped.
+	//! The ray segment begins at the origin and ends at tMax along the given direction.
+	//! The element intersection function must be in the following form:
+	//!
+	//! bool ElementIntersect( unsigned int elementID, float &tMax )
+	//!
+	//! It must return true and reduce tMax, if the ray hits the element closer than tMax.
+	//! If anyHit is true, the traversal stops at the first hit found, which is useful for shadow rays.
+	//! Returns true if the ray hits an element.
+	template <typename ElementIntersectFunc>
+	bool TraceRay( float const origin[3], float const direction[3], float &tMax, ElementIntersectFunc elementIntersect, bool anyHit=false ) const
+	{
+		if ( nodes == 0 ) return false;
+		float invDir[3];
+		for ( int k=0; k<3; k++ ) invDir[k] = 1.0f / ( std::abs(direction[k]) > 1e-30f ? direction[k] : ( direction[k] < 0 ? -1e-30f : 1e-30f ) );
+
+		struct StackEntry { unsigned int nodeID; float tEntry; };
+		StackEntry stack[CY_BVH_MAX_DEPTH];
+		int stackSize = 0;
+
+		bool hit = false;
+		unsigned int nodeID = GetRootNodeID();
+		float tEntry;
+		if ( ! IntersectNode( nodeID, origin, invDir, tMax, tEntry ) ) return false;
+		for (;;) {
+			if ( IsLeafNode(nodeID) ) {
+				unsigned int const *nodeElements = GetNodeElements(nodeID);
+				unsigned int elemCount = GetNodeElementCount(nodeID);
+				for ( unsigned int i=0; i<elemCount; i++ ) {
+					if ( elementIntersect( nodeElements[i], tMax ) ) {
+						hit = true;
+						if ( anyHit ) return true;
+					}
+				}
+			} else {
+				unsigned int child1, child2;
+				GetChildNodes( nodeID, child1, child2 );
+				float t1, t2;
+				bool hit1 = IntersectNode( child1, origin, invDir, tMax, t1 );
+				bool hit2 = IntersectNode( child2, origin, invDir, tMax, t2 );
+				if ( hit1 && hit2 ) {
+					if ( t2 < t1 ) { unsigned int c=child1; child1=child2; child2=c; float t=t1; t1=t2; t2=t; }
+					assert( stackSize < CY_BVH_MAX_DEPTH );
+					stack[stackSize].nodeID = child2;
+					stack[stackSize].tEntry = t2;
+					stackSize++;
+					nodeID = child1;
+					continue;
+				}
+				if ( hit1 ) { nodeID = child1; continue; }
+				if ( hit2 ) { nodeID = child2; continue; }
+			}
+			// Pop the next node from the stack, skipping the ones that are farther than the closest hit
+			do {
+				if ( stackSize == 0 ) return hit;
+				stackSize--;
+			} while ( stack[stackSize].tEntry > tMax );
+			nodeID = stack[stackSize].nodeID;
+		}
+	}
+
 	/////////////////////////////////////////////////////////////////////////////////
 	//@ Clear and Build Methods
 	/////////////////////////////////////////////////////////////////////////////////
@@ -112,35 +228,173 @@ public:
 	//! Clears the tree structure
 	void Clear()
 	{
-		if (nodes) delete [] nodes;
+		if ( mappedFile.IsOpen() ) {
+			mappedFile.Close();	// the nodes and elements are not allocated, they are in the mapped file data
+		} else {
+			if (nodes) delete [] nodes;
+			if (elements) delete [] elements;
+		}
 		nodes = 0;
-		if (elements) delete [] elements;
 		elements = 0;
+		numNodes = 0;
+		numElements = 0;
+		buildSAHCost = 0;
 	}
 
 	//! Builds the tree structure by recursively splitting the nodes. maxElementsPerNode cannot be larger than 8.
-	void Build( unsigned int numElements, unsigned int maxElementsPerNode=CY_BVH_MAX_ELEMENT_COUNT )
+	//! The split method is used by the default implementation of FindSplit.
+	//! The nodes are written directly into a preallocated array and the sub-trees of large nodes
+	//! are built in parallel, so GetElementBounds, GetElementCenter, and FindSplit can be called
+	//! from multiple threads at the same time (for different elements).
+	void Build( unsigned int numElements, unsigned int maxElementsPerNode=CY_BVH_MAX_ELEMENT_COUNT, SplitMethod method=SPLIT_MEAN )
 	{
 		Clear();
+		splitMethod = method;
 		if ( numElements == 0 ) return;
 		if ( maxElementsPerNode > CY_BVH_MAX_ELEMENT_COUNT ) maxElementsPerNode = CY_BVH_MAX_ELEMENT_COUNT;
+		this->numElements = numElements;
 		elements = new unsigned int[numElements];
 		for ( unsigned int i=0; i<numElements; i++ ) elements[i] = i;
 		Box box;
-		box.Init();
-		for ( unsigned int i=0; i<numElements; i++ ) {
-			Box b;
-			GetElementBounds(i,b.b);
-			box += b;
+		ComputeBounds( box, elements, numElements );
+
+		// A binary tree with at most one leaf node per element cannot have more than 2*numElements-1 nodes.
+		nodes = new Node[ 2*numElements ];
+		std::atomic<unsigned int> nextNodeID( GetRootNodeID()+1 );
+		SplitNode( GetRootNodeID(), 0, numElements, box, maxElementsPerNode, 1, nextNodeID );
+		numNodes = nextNodeID;
+
+		// Release the unused part of the node array. If the sub-trees may have been built in parallel,
+		// the nodes are also placed in depth-first order, as in a serial build, so that the
+		// node array does not depend on the number of threads or their timing.
+		if ( numElements >= 2*CY_BVH_PARALLEL_BUILD_THRESHOLD ) {
+			Node *orderedNodes = new Node[ numNodes ];
+			unsigned int nextOrderedID = GetRootNodeID()+1;
+			OrderNodes( orderedNodes, GetRootNodeID(), GetRootNodeID(), nextOrderedID );
+			delete [] nodes;
+			nodes = orderedNodes;
+		} else if ( numNodes < 2*numElements ) {
+			Node *usedNodes = new Node[ numNodes ];
+			MemCopy( usedNodes, nodes, numNodes );
+			delete [] nodes;
+			nodes = usedNodes;
 		}
-		TempNode *tempRoot = new TempNode( numElements, 0, box );
-		SplitTempNode(tempRoot,maxElementsPerNode);
-		unsigned int numNodes = tempRoot->GetNumNodes();
-		nodes = new Node[ numNodes+1 ];
-		ConvertTempData( 1, tempRoot, 2 );
-		delete tempRoot;
+		buildSAHCost = GetSAHCost();
 	}
 
+	//! Recomputes the bounding boxes of all nodes bottom-up without changing the tree structure.
+	//! This should be called after the elements move, such as the vertices of an animated mesh.
+	//! It is much faster than rebuilding the hierarchy, but the tree quality degrades as the elements
+	//! move away from their original positions, so NeedsRebuild should be checked afterwards.
+	//! The bounding boxes of large sub-trees are computed in parallel.
+	void Refit()
+	{
+		if ( numNodes == 0 ) return;
+		RefitNode( GetRootNodeID(), 0 );
+	}
+
+	//! Returns the ratio of the current SAH cost to the SAH cost right after the last Build call.
+	//! The ratio is one after building the hierarchy and typically increases after refitting it.
+	float GetSAHCostRatio() const { return buildSAHCost > 0 ? GetSAHCost() / buildSAHCost : 1; }
+
+	//! Returns true if the SAH cost has increased by more than the given ratio since the last Build call,
+	//! which means that the refitted hierarchy has become inefficient for ray tracing and must be rebuilt.
+	bool NeedsRebuild( float maxCostRatio=CY_BVH_REBUILD_COST_RATIO ) const { return GetSAHCostRatio() > maxCostRatio; }
+
+	//! Returns the number of nodes in the tree structure.
+	unsigned int GetNodeCount() const { return numNodes > 0 ? numNodes-1 : 0; }
+
+	//! Returns the number of elements in the tree structure.
+	unsigned int GetElementCount() const { return numElements; }
+
+	//! Returns the split method used for building the tree structure.
+	SplitMethod GetSplitMethod() const { return splitMethod; }
+
+	//! Returns the cost of the tree structure using the surface area heuristic (SAH).
+	//! The cost is the expected number of node traversals and element intersections of a random ray
+	//! that hits the root node, where traversing a node costs CY_BVH_SAH_TRAVERSAL_COST
+	//! relative to intersecting an element. Lower values indicate a better tree for ray tracing.
+	float GetSAHCost() const
+	{
+		if ( nodes == nullptr ) return 0;
+		float rootArea = BoxArea( GetNodeBounds(GetRootNodeID()) );
+		if ( rootArea <= 0 ) return 0;
+		return GetSAHCost( GetRootNodeID() ) / rootArea;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//@ Cache File Methods
+	/////////////////////////////////////////////////////////////////////////////////
+
+	//! Saves the tree structure to a binary cache file with the given name.
+	//! The content hash should identify the elements and the build parameters, such that
+	//! the file can be matched to the same elements when it is loaded (see BVHTriMesh::ComputeMeshHash).
+	//! The file keeps the node and element arrays in their in-memory layout, so it can only be loaded
+	//! on systems with the same byte order and compiled with the same BVH configuration macros.
+	//! The data is written to a temporary file that replaces the given file at the end, so that
+	//! other BVH objects that have loaded the previous version of the file are not affected.
+	//! Returns false if the file cannot be written.
+	bool Save( char const *filename, uint64_t contentHash=0 ) const
+	{
+		std::string tempFilename = std::string(filename) + ".tmp";
+		FILE *fp = fopen( tempFilename.c_str(), "wb" );
+		if ( !fp ) return false;
+		FileHeader header;
+		header.Set( numNodes, numElements, splitMethod, buildSAHCost, contentHash );
+		bool ok = fwrite( &header, sizeof(FileHeader), 1, fp ) == 1;
+		if ( numNodes > 0 ) {
+			char const unusedNode[ sizeof(Node) ] = {};
+			ok = ok && fwrite( unusedNode, sizeof(Node), 1, fp ) == 1;
+			ok = ok && fwrite( nodes+1, sizeof(Node), numNodes-1, fp ) == numNodes-1;
+			ok = ok && fwrite( elements, sizeof(unsigned int), numElements, fp ) == numElements;
+		}
+		ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+		if ( ok ) remove( filename );
+#endif
+		ok = ok && rename( tempFilename.c_str(), filename ) == 0;
+		if ( !ok ) remove( tempFilename.c_str() );
+		return ok;
+	}
+
+	//! Loads the tree structure from a binary cache file written by the Save method.
+	//! The file is memory-mapped and the node and element arrays are used directly from the mapped
+	//! memory without copying them, so loading only takes a single pass over the data for checking it.
+	//! The file data is mapped copy-on-write, so that Refit can still modify the node bounds.
+	//! Returns false and clears the tree structure, if the file cannot be opened, if it was written with
+	//! a different file version or BVH configuration, or if its content hash does not match the given hash.
+	//! The node and element arrays are also checked, so that a truncated or corrupted file is rejected,
+	//! instead of leading to out-of-bounds memory accesses when the tree is traversed.
+	bool Load( char const *filename, uint64_t contentHash=0 )
+	{
+		Clear();
+		if ( ! mappedFile.Open( filename, true ) ) return false;
+		size_t fileSize = mappedFile.GetSize();
+		char *data = (char*) mappedFile.GetData();
+		FileHeader const *header = (FileHeader const*) data;
+		if ( fileSize < sizeof(FileHeader) || ! header->IsValid(contentHash) ||
+		     fileSize != sizeof(FileHeader) + size_t(header->numNodes)*sizeof(Node) + size_t(header->numElements)*sizeof(unsigned int) ) {
+			mappedFile.Close();
+			return false;
+		}
+		numNodes     = header->numNodes;
+		numElements  = header->numElements;
+		splitMethod  = (SplitMethod) header->splitMethod;
+		buildSAHCost = header->buildSAHCost;
+		if ( numNodes > 0 ) {
+			nodes    = (Node*) ( data + sizeof(FileHeader) );
+			elements = (unsigned int*) ( data + sizeof(FileHeader) + size_t(numNodes)*sizeof(Node) );
+		}
+		if ( ! IsValidTree() ) {
+			Clear();
+			return false;
+		}
+		return true;
+	}
+
+	//! Returns true if the tree structure is used directly from a memory-mapped cache file.
+	bool IsMapped() const { return mappedFile.IsOpen(); }
+
 	/////////////////////////////////////////////////////////////////////////////////
 
 protected:
@@ -156,14 +410,16 @@ protected:
 	//@ Building method that can be overloaded
 	/////////////////////////////////////////////////////////////////////////////////
 
-	//! Sorts the given elements of a temporary node while building the BVH hierarchy,
+	//! Sorts the given elements of a node while building the BVH hierarchy,
 	//! such that first N elements are to be assigned to the first child and the 
 	//! remaining elements are to be assigned to the second child node, then returns N.
 	//! Returns zero, if the node is not to be split.
-	//! The default implementation splits the temporary node down the middle of the
-	//! widest axis of its bounding box.
+	//! The default implementation uses the split method given to the Build method:
+	//! either splits the node down the middle of the widest axis of its bounding box
+	//! or uses the binned surface area heuristic.
 	virtual unsigned int FindSplit( unsigned int elementCount, unsigned int *elements, float const *box, unsigned int maxElementsPerNode )
 	{
+		if ( splitMethod == SPLIT_SAH ) return SAHSplit(elementCount,elements,box,maxElementsPerNode);
 		return MeanSplit(elementCount,elements,box,maxElementsPerNode);
 	}
 
@@ -179,7 +435,6 @@ private:
 	{
 		float b[6];
 		Box() { Init(); }
-		Box( Box const &box ) { for(int i=0; i<6; i++) b[i]=box.b[i]; }
 		void Init() { b[0]=b[1]=b[2]=1e30f; b[3]=b[4]=b[5]=-1e30f; }
 		void operator += ( Box const &box ) { for(int i=0; i<3; i++) { if(b[i]>box.b[i])b[i]=box.b[i]; if(b[i+3]<box.b[i+3])b[i+3]=box.b[i+3]; } }
 	};
@@ -189,6 +444,8 @@ private:
 	public:
 		void SetLeafNode( Box const &bound, unsigned int elemCount, unsigned int elemOffset ) { box=bound; data=(elemOffset&_CY_BVH_ELEMENT_OFFSET_MASK)|((elemCount-1)<<_CY_BVH_ELEMENT_OFFSET_BITS)|_CY_BVH_LEAF_BIT_MASK; }
 		void SetInternalNode( Box const &bound, unsigned int chilIndex ) { box=bound; data=(chilIndex&_CY_BVH_CHILD_INDEX_MASK); }
+		void SetBounds( Box const &bound ) { box=bound; }
+		Box const &   GetBox       () const { return box; }																	//!< returns the bounding box of the node
 		unsigned int  ChildIndex   () const { return (data&_CY_BVH_CHILD_INDEX_MASK); }									//!< returns the index to the first child (must be internal node)
 		unsigned int  ElementOffset() const { return (data&_CY_BVH_ELEMENT_OFFSET_MASK); }									//!< returns the offset to the first element (must be leaf node)
 		unsigned int  ElementCount () const { return ((data>>_CY_BVH_ELEMENT_OFFSET_BITS)&_CY_BVH_ELEMENT_COUNT_MASK)+1; }	//!< returns the number of elements in this node (must be leaf node)
@@ -199,95 +456,319 @@ private:
 		unsigned int data;	//!< node data bits that keep the leaf node flag and the child node index or element count and element offset.
 	};
 
-	Node         *nodes;	//!< the tree structure that keeps all the node data (nodeData[0] is not used for cache coherency)
-	unsigned int *elements;	//!< indices of all elements in all nodes
-
-	/////////////////////////////////////////////////////////////////////////////////
-	//@ Internal methods for building the BVH tree
-	/////////////////////////////////////////////////////////////////////////////////
+	Node         *nodes;		//!< the tree structure that keeps all the node data (nodeData[0] is not used for cache coherency)
+	unsigned int *elements;		//!< indices of all elements in all nodes
+	unsigned int  numNodes;		//!< the size of the nodes array (including the unused first node)
+	unsigned int  numElements;	//!< the size of the elements array
+	SplitMethod   splitMethod;	//!< the split method used by the default implementation of FindSplit
+	float         buildSAHCost;	//!< the SAH cost of the tree right after it was built
+	MappedFile    mappedFile;	//!< the cache file that keeps the nodes and elements, if the tree is loaded from a file
 
-	//! Temporary node class used for building the hierarchy and then converted to NodeData.
-	class TempNode
+	//! The header of the cache files, followed by the node array (including the unused first node) and the element array.
+	struct FileHeader
 	{
-	public:
-		TempNode( unsigned int count, unsigned int offset, Box const &boundBox) : child1(0), child2(0), elementCount(count), elementOffset(offset), box(boundBox) {}
-		~TempNode() { if ( child1 ) delete child1; if ( child2 ) delete child2; }
+		char     magic[4];			//!< always "CYBV"
+		uint32_t version;			//!< CY_BVH_FILE_VERSION
+		uint32_t nodeSize;			//!< the size of each node in bytes
+		uint32_t elementCountBits;	//!< CY_BVH_ELEMENT_COUNT_BITS
+		uint32_t numNodes;			//!< the size of the node array
+		uint32_t numElements;		//!< the size of the element array
+		uint32_t splitMethod;		//!< the split method used for building the tree
+		float    buildSAHCost;		//!< the SAH cost of the tree right after it was built
+		uint64_t contentHash;		//!< the hash value that identifies the elements and the build parameters
 
-		void Split( unsigned int child1ElementCount, Box const &child1Box, Box const &child2Box )
+		void Set( unsigned int nNodes, unsigned int nElements, SplitMethod method, float sahCost, uint64_t hash )
 		{
-			child1 = new TempNode(child1ElementCount,elementOffset,child1Box);
-			child2 = new TempNode(ElementCount()-child1ElementCount,elementOffset+child1ElementCount,child2Box);
+			magic[0]='C'; magic[1]='Y'; magic[2]='B'; magic[3]='V';
+			version = CY_BVH_FILE_VERSION;
+			nodeSize = sizeof(Node);
+			elementCountBits = CY_BVH_ELEMENT_COUNT_BITS;
+			numNodes = nNodes;
+			numElements = nElements;
+			splitMethod = method;
+			buildSAHCost = sahCost;
+			contentHash = hash;
 		}
-		unsigned int GetNumNodes() const
+		bool IsValid( uint64_t hash ) const
 		{
-			unsigned int n = 1;
-			if ( child1 ) n += child1->GetNumNodes();
-			if ( child2 ) n += child2->GetNumNodes();
-			return n;
-		}
-		bool IsLeafNode() const { return child1==0; }
-		unsigned int ElementCount () const { return elementCount; }
-		unsigned int ElementOffset() const { return elementOffset; }
-		TempNode* GetChild1() { return child1; }
-		TempNode* GetChild2() { return child2; }
-		Box const & GetBounds() const { return box; }
-	private:
-		TempNode		*child1, *child2;
-		Box				box;
-		unsigned int	elementCount;
-		unsigned int	elementOffset;
+			return magic[0]=='C' && magic[1]=='Y' && magic[2]=='B' && magic[3]=='V' && version == CY_BVH_FILE_VERSION &&
+			       nodeSize == sizeof(Node) && elementCountBits == CY_BVH_ELEMENT_COUNT_BITS && contentHash == hash;
+		}
 	};
 
-	//! Recursively splits the given temporary node.
-	void SplitTempNode(TempNode *tNode, unsigned int maxElementsPerNode)
+	//! Checks the tree structure loaded from a cache file. Returns false if a node is not reachable from
+	//! the root by a single path, if a child index or a leaf element range is out of bounds, if the tree is
+	//! deeper than CY_BVH_MAX_DEPTH, or if an element index is not smaller than the number of elements.
+	bool IsValidTree() const
 	{
-		float const *box = tNode->GetBounds().b;
-		unsigned int *nodeElements = &elements[tNode->ElementOffset()];
-		unsigned int child1ElemCount = FindSplit(tNode->ElementCount(),nodeElements,box,maxElementsPerNode);
+		if ( numNodes == 0 ) return numElements == 0;
+		if ( numNodes <= GetRootNodeID() ) return false;
+		for ( unsigned int i=0; i<numElements; i++ ) if ( elements[i] >= numElements ) return false;
+		// The children are always placed after their parents, so the depth of a node is known before it is visited.
+		std::vector<unsigned int> depth( numNodes, 0 );
+		depth[ GetRootNodeID() ] = 1;
+		for ( unsigned int i=GetRootNodeID(); i<numNodes; i++ ) {
+			if ( depth[i] == 0 ) continue;	// not reachable from the root
+			Node const &node = nodes[i];
+			if ( node.IsLeafNode() ) {
+				if ( uint64_t(node.ElementOffset()) + node.ElementCount() > numElements ) return false;
+			} else {
+				unsigned int child = node.ChildIndex();
+				if ( child <= i || child >= numNodes-1 || depth[i] >= CY_BVH_MAX_DEPTH ) return false;
+				if ( depth[child] || depth[child+1] ) return false;
+				depth[child] = depth[child+1] = depth[i] + 1;
+			}
+		}
+		return true;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//@ Internal methods for building the BVH tree
+	/////////////////////////////////////////////////////////////////////////////////
+
+	//! Computes the bounding box of the given elements. The elements of large lists are processed in parallel.
+	void ComputeBounds( Box &box, unsigned int const *nodeElements, unsigned int elementCount ) const
+	{
+		if ( elementCount >= 2*CY_BVH_PARALLEL_BUILD_THRESHOLD ) {
+			unsigned int half = elementCount / 2;
+			Box box1, box2;
+			ParallelInvoke(
+				[&]{ ComputeBounds( box1, nodeElements,      half ); },
+				[&]{ ComputeBounds( box2, nodeElements+half, elementCount-half ); }
+			);
+			box = box1;
+			box += box2;
+			return;
+		}
+		box.Init();
+		for ( unsigned int i=0; i<elementCount; i++ ) {
+			Box eBox;
+			GetElementBounds( nodeElements[i], eBox.b );
+			box += eBox;
+		}
+	}
+
+	//! Recursively splits the given node and writes its sub-tree into the node array.
+	//! The child node pairs are allocated from nextNodeID, so that a serial build places the
+	//! nodes in depth-first order. The sub-trees of large nodes are built in parallel, in which case
+	//! the Build method reorders the nodes afterwards.
+	//! Close to the maximum depth, the nodes are split in half, so that the depth never exceeds CY_BVH_MAX_DEPTH.
+	void SplitNode( unsigned int nodeID, unsigned int elementOffset, unsigned int elementCount, Box const &box, unsigned int maxElementsPerNode, unsigned int depth, std::atomic<unsigned int> &nextNodeID )
+	{
+		unsigned int *nodeElements = &elements[elementOffset];
+		unsigned int child1ElemCount;
+		if ( depth < CY_BVH_MAX_DEPTH-32 ) {
+			child1ElemCount = FindSplit(elementCount,nodeElements,box.b,maxElementsPerNode);
+		} else {
+			child1ElemCount = elementCount > maxElementsPerNode ? elementCount / 2 : 0;
+		}
 
 		// If the FindSplit call does not return a valid split position
-		if ( child1ElemCount == 0 || child1ElemCount >= tNode->ElementCount() ) {
+		if ( child1ElemCount == 0 || child1ElemCount >= elementCount ) {
 			// if we must split anyway
-			if ( tNode->ElementCount() > CY_BVH_MAX_ELEMENT_COUNT ) {
+			if ( elementCount > CY_BVH_MAX_ELEMENT_COUNT ) {
 				// we split in half arbitrarily.
-				child1ElemCount = tNode->ElementCount() / 2;
+				child1ElemCount = elementCount / 2;
 			} else {
 				// otherwise, we reached a leaf node and no more split is necessary.
+				nodes[nodeID].SetLeafNode( box, elementCount, elementOffset );
 				return;
 			}
 		}
+		unsigned int child2ElemCount = elementCount - child1ElemCount;
 
 		// Compute child bounding boxes
 		Box child1Box;
 		Box child2Box;
-		for ( unsigned int i=0; i<child1ElemCount; i++ ) {
-			Box eBox;
-			GetElementBounds( nodeElements[i], eBox.b );
-			child1Box += eBox;
-		}
-		for ( unsigned int i=child1ElemCount; i<tNode->ElementCount(); i++ ) {
-			Box eBox;
-			GetElementBounds( nodeElements[i], eBox.b );
-			child2Box += eBox;
-		}
+		ComputeBounds( child1Box, nodeElements, child1ElemCount );
+		ComputeBounds( child2Box, nodeElements+child1ElemCount, child2ElemCount );
 
 		// Split recursively
-		tNode->Split( child1ElemCount, child1Box, child2Box );
-		SplitTempNode(tNode->GetChild1(),maxElementsPerNode);
-		SplitTempNode(tNode->GetChild2(),maxElementsPerNode);
+		unsigned int child1 = nextNodeID.fetch_add(2);
+		nodes[nodeID].SetInternalNode( box, child1 );
+		if ( child1ElemCount >= CY_BVH_PARALLEL_BUILD_THRESHOLD && child2ElemCount >= CY_BVH_PARALLEL_BUILD_THRESHOLD ) {
+			ParallelInvoke(
+				[&]{ SplitNode( child1,   elementOffset,                 child1ElemCount, child1Box, maxElementsPerNode, depth+1, nextNodeID ); },
+				[&]{ SplitNode( child1+1, elementOffset+child1ElemCount, child2ElemCount, child2Box, maxElementsPerNode, depth+1, nextNodeID ); }
+			);
+		} else {
+			SplitNode( child1,   elementOffset,                 child1ElemCount, child1Box, maxElementsPerNode, depth+1, nextNodeID );
+			SplitNode( child1+1, elementOffset+child1ElemCount, child2ElemCount, child2Box, maxElementsPerNode, depth+1, nextNodeID );
+		}
+	}
+
+	//! Recursively copies the given node and its sub-tree into the ordered node array, allocating the
+	//! child node pairs from nextOrderedID in the same depth-first order as a serial build.
+	void OrderNodes( Node *orderedNodes, unsigned int nodeID, unsigned int orderedID, unsigned int &nextOrderedID ) const
+	{
+		Node const &node = nodes[nodeID];
+		if ( node.IsLeafNode() ) {
+			orderedNodes[orderedID] = node;
+			return;
+		}
+		unsigned int child1 = nextOrderedID;
+		nextOrderedID += 2;
+		orderedNodes[orderedID].SetInternalNode( node.GetBox(), child1 );
+		OrderNodes( orderedNodes, node.ChildIndex(),   child1,   nextOrderedID );
+		OrderNodes( orderedNodes, node.ChildIndex()+1, child1+1, nextOrderedID );
 	}
 
-	//! Recursively converts the temporary node data to NodeData.
-	unsigned int ConvertTempData( unsigned int nodeID, TempNode *tNode, unsigned int childIndex )
+	//! Recursively recomputes the bounding boxes of the given node and its sub-tree.
+	//! The sub-trees of the nodes close to the root are processed in parallel, if the tree is large enough.
+	void RefitNode( unsigned int nodeID, unsigned int depth )
 	{
-		if ( tNode->IsLeafNode() ) {
-			nodes[nodeID].SetLeafNode( tNode->GetBounds(), tNode->ElementCount(), tNode->ElementOffset() );
-			return childIndex;
+		Node &node = nodes[nodeID];
+		Box box;
+		if ( node.IsLeafNode() ) {
+			ComputeBounds( box, &elements[node.ElementOffset()], node.ElementCount() );
 		} else {
-			nodes[nodeID].SetInternalNode( tNode->GetBounds(), childIndex );
-			unsigned int newChildIndex = ConvertTempData( childIndex, tNode->GetChild1(), childIndex+2 );
-			return ConvertTempData( childIndex+1, tNode->GetChild2(), newChildIndex );
+			unsigned int child1 = node.ChildIndex();
+			if ( depth < 32 && ( numElements >> depth ) >= CY_BVH_PARALLEL_BUILD_THRESHOLD ) {
+				ParallelInvoke(
+					[&]{ RefitNode( child1,   depth+1 ); },
+					[&]{ RefitNode( child1+1, depth+1 ); }
+				);
+			} else {
+				RefitNode( child1,   depth+1 );
+				RefitNode( child1+1, depth+1 );
+			}
+			box = nodes[child1].GetBox();
+			box += nodes[child1+1].GetBox();
+		}
+		node.SetBounds( box );
+	}
+
+	//! Intersects the given ray with the bounding box of the node using the slab test.
+	//! Returns true if the box overlaps the ray segment between zero and tMax and sets tEntry
+	//! as the distance where the ray enters the box. The exit distance is slightly enlarged,
+	//! so that rounding errors do not miss elements lying exactly on the box boundaries.
+	bool IntersectNode( unsigned int nodeID, float const origin[3], float const invDir[3], float tMax, float &tEntry ) const
+	{
+		float const *b = GetNodeBounds(nodeID);
+		float tNear = 0;
+		float tFar  = tMax;
+		for ( int k=0; k<3; k++ ) {
+			float t0 = ( b[k  ] - origin[k] ) * invDir[k];
+			float t1 = ( b[k+3] - origin[k] ) * invDir[k];
+			if ( t0 > t1 ) { float t=t0; t0=t1; t1=t; }
+			tNear = t0 > tNear ? t0 : tNear;
+			tFar  = t1 < tFar  ? t1 : tFar;
+		}
+		tEntry = tNear;
+		return tNear <= tFar * 1.00000024f;
+	}
+
+	//! Returns the surface area of the given box.
+	static float BoxArea( float const *box )
+	{
+		float dx = box[3]-box[0], dy = box[4]-box[1], dz = box[5]-box[2];
+		return 2 * ( dx*dy + dy*dz + dz*dx );
+	}
+
+	//! Recursively computes the SAH cost of the given node, scaled by the surface area of the root node.
+	float GetSAHCost( unsigned int nodeID ) const
+	{
+		float area = BoxArea( GetNodeBounds(nodeID) );
+		if ( IsLeafNode(nodeID) ) return area * GetNodeElementCount(nodeID);
+		unsigned int child1, child2;
+		GetChildNodes( nodeID, child1, child2 );
+		return area * CY_BVH_SAH_TRAVERSAL_COST + GetSAHCost(child1) + GetSAHCost(child2);
+	}
+
+	//! Called by the default implementation of FindSplit, if the split method is SPLIT_SAH.
+	//! Splits the elements using the binned surface area heuristic (SAH). The element centers are
+	//! placed into CY_BVH_SAH_BIN_COUNT bins along each axis and the split plane between the bins
+	//! with the minimum SAH cost is used. Returns zero (no split), if the node has no more than
+	//! maxElementsPerNode elements and keeping it as a leaf node is cheaper than the best split.
+	unsigned int SAHSplit(unsigned int elementCount, unsigned int *nodeElements, float const *box, unsigned int maxElementsPerNode )
+	{
+		if ( elementCount <= 1 ) return 0;
+
+		// Compute the bounds of the element centers
+		float cMin[3] = {  1e30f,  1e30f,  1e30f };
+		float cMax[3] = { -1e30f, -1e30f, -1e30f };
+		for ( unsigned int i=0; i<elementCount; i++ ) {
+			for ( int d=0; d<3; d++ ) {
+				float c = GetElementCenter( nodeElements[i], d );
+				if ( cMin[d] > c ) cMin[d] = c;
+				if ( cMax[d] < c ) cMax[d] = c;
+			}
+		}
+		float binScale[3];
+		for ( int d=0; d<3; d++ ) {
+			float extent = cMax[d] - cMin[d];
+			binScale[d] = extent > 0 ? CY_BVH_SAH_BIN_COUNT * 0.99999f / extent : 0;
 		}
+		auto binIndex = [&]( float c, int d ) {
+			float b = ( c - cMin[d] ) * binScale[d];
+			if ( ! ( b > 0 ) ) return 0;	// also keeps the centers that are not finite in the first bin
+			return b < float(CY_BVH_SAH_BIN_COUNT-1) ? int(b) : CY_BVH_SAH_BIN_COUNT-1;
+		};
+
+		// Place the elements into the bins
+		Box          binBox  [3][CY_BVH_SAH_BIN_COUNT];
+		unsigned int binCount[3][CY_BVH_SAH_BIN_COUNT] = {};
+		for ( unsigned int i=0; i<elementCount; i++ ) {
+			Box eBox;
+			GetElementBounds( nodeElements[i], eBox.b );
+			for ( int d=0; d<3; d++ ) {
+				if ( binScale[d] == 0 ) continue;
+				int b = binIndex( GetElementCenter( nodeElements[i], d ), d );
+				binBox  [d][b] += eBox;
+				binCount[d][b]++;
+			}
+		}
+
+		// Find the split with the minimum cost by sweeping the bins along each axis
+		int   bestDim  = -1;
+		int   bestBin  = 0;
+		float bestCost = 1e30f;
+		for ( int d=0; d<3; d++ ) {
+			if ( binScale[d] == 0 ) continue;
+			float rightArea[CY_BVH_SAH_BIN_COUNT];
+			Box rightBox;
+			unsigned int rightCount = 0;
+			for ( int b=CY_BVH_SAH_BIN_COUNT-1; b>0; b-- ) {
+				rightBox += binBox[d][b];
+				rightCount += binCount[d][b];
+				rightArea[b] = rightCount > 0 ? BoxArea(rightBox.b) * rightCount : 0;
+			}
+			Box leftBox;
+			unsigned int leftCount = 0;
+			for ( int b=0; b<CY_BVH_SAH_BIN_COUNT-1; b++ ) {
+				leftBox += binBox[d][b];
+				leftCount += binCount[d][b];
+				if ( leftCount == 0 || leftCount == elementCount ) continue;
+				float cost = BoxArea(leftBox.b) * leftCount + rightArea[b+1];
+				if ( cost < bestCost ) {
+					bestCost = cost;
+					bestDim  = d;
+					bestBin  = b;
+				}
+			}
+		}
+		if ( bestDim < 0 ) return 0;
+
+		// Keep the node as a leaf, if it is not more expensive than splitting
+		if ( elementCount <= maxElementsPerNode ) {
+			float area = BoxArea(box);
+			float splitCost = CY_BVH_SAH_TRAVERSAL_COST + ( area > 0 ? bestCost / area : 0 );
+			if ( splitCost >= float(elementCount) ) return 0;
+		}
+
+		// Partition the elements
+		unsigned int i=0, j=elementCount;
+		while ( i<j ) {
+			if ( binIndex( GetElementCenter( nodeElements[i], bestDim ), bestDim ) <= bestBin ) {
+				i++;
+			} else {
+				j--;
+				unsigned int t = nodeElements[i];
+				nodeElements[i] = nodeElements[j];
+				nodeElements[j] = t;
+			}
+		}
+		return i;
 	}
 
 	//! Called by the default implementation of FindSplit.
@@ -332,8 +813,375 @@ private:
 
 //-------------------------------------------------------------------------------
 
+//! Wide Bounding Volume Hierarchy class
+//!
+//! BVHWide collapses a binary BVH into a hierarchy with up to WIDTH (4 or 8) children per node.
+//! Each node keeps the bounding boxes of its children in structure-of-arrays form, so that
+//! a ray is tested against all children of a node at once using SSE (4-wide) or AVX (8-wide)
+//! instructions, when available. This reduces the number of traversal steps and cache misses.
+
+template <int WIDTH>
+class BVHWide
+{
+public:
+
+	//!@name Constructor and destructor
+	BVHWide() : nodes(0), elements(0), numNodes(0), numElements(0) {}
+	virtual ~BVHWide() { Clear(); }
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//@ Clear and Build Methods
+	/////////////////////////////////////////////////////////////////////////////////
+
+	//! Clears the tree structure
+	void Clear()
+	{
+		delete [] nodes;
+		nodes = 0;
+		delete [] elements;
+		elements = 0;
+		numNodes = 0;
+		numElements = 0;
+	}
+
+	//! Builds the tree structure by collapsing the given binary BVH.
+	//! The children of a wide node are found by repeatedly replacing the internal child node
+	//! with the largest surface area by its own children, until there are WIDTH children.
+	//! The given BVH is not needed after this call.
+	void Build( BVH const &bvh )
+	{
+		Clear();
+		if ( bvh.GetNodeCount() == 0 ) return;
+		nodes    = new Node[ bvh.GetNodeCount() ];	// a wide tree cannot have more internal nodes than the binary tree
+		elements = new unsigned int[ bvh.GetElementCount() ];
+		numNodes = 1;
+		Node &root = nodes[0];
+		root.Init();
+		unsigned int rootID = bvh.GetRootNodeID();
+		if ( bvh.IsLeafNode(rootID) ) {
+			root.SetChild( 0, bvh.GetNodeBounds(rootID), AddLeaf( bvh, rootID ) );
+		} else {
+			CollapseNode( bvh, rootID, 0 );
+		}
+		if ( numNodes < bvh.GetNodeCount() ) {
+			Node *usedNodes = new Node[ numNodes ];
+			MemCopy( usedNodes, nodes, numNodes );
+			delete [] nodes;
+			nodes = usedNodes;
+		}
+	}
+
+	//! Returns the number of nodes in the tree structure.
+	unsigned int GetNodeCount() const { return numNodes; }
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//@ Ray Traversal Methods
+	/////////////////////////////////////////////////////////////////////////////////
+
+	//! Traverses the hierarchy along the given ray and calls the given element intersection function
+	//! for the elements of the leaf nodes hit by the ray. The children of each node are tested together
+	//! and visited in near-to-far order using a fixed-size stack.
+	//! The ray segment begins at the origin and ends at tMax along the given direction.
+	//! The element intersection function must be in the following form:
+	//!
+	//! bool ElementIntersect( unsigned int elementID, float &tMax )
+	//!
+	//! It must return true and reduce tMax, if the ray hits the element closer than tMax.
+	//! If anyHit is true, the traversal stops at the first hit found, which is useful for shadow rays.
+	//! Returns true if the ray hits an element.
+	template <typename ElementIntersectFunc>
+	bool TraceRay( float const origin[3], float const direction[3], float &tMax, ElementIntersectFunc elementIntersect, bool anyHit=false ) const
+	{
+		if ( nodes == 0 ) return false;
+		Ray ray( origin, direction );
+
+		struct StackEntry { unsigned int child; float tEntry; };
+		StackEntry stack[ CY_BVH_MAX_DEPTH*(WIDTH-1) ];
+		int stackSize = 0;
+
+		bool hit = false;
+		unsigned int child = 0;	// the root node
+		for (;;) {
+			if ( child & _CY_BVH_LEAF_BIT_MASK ) {
+				unsigned int const *leafElements = &elements[ child & _CY_BVH_ELEMENT_OFFSET_MASK ];
+				unsigned int elemCount = ((child>>_CY_BVH_ELEMENT_OFFSET_BITS)&_CY_BVH_ELEMENT_COUNT_MASK)+1;
+				for ( unsigned int i=0; i<elemCount; i++ ) {
+					if ( elementIntersect( leafElements[i], tMax ) ) {
+						hit = true;
+						if ( anyHit ) return true;
+					}
+				}
+			} else {
+				Node const &node = nodes[child];
+				float tNear[WIDTH];
+				unsigned int mask = IntersectChildren( node, ray, tMax, tNear );
+				if ( mask ) {
+					// Sort the hit children from far to near, push them to the stack, and continue with the nearest one
+					int n = 0;
+					int order[WIDTH];
+					for ( int i=0; i<WIDTH; i++ ) {
+						if ( ( mask & (1u<<i) ) == 0 ) continue;
+						int j = n++;
+						for ( ; j>0 && tNear[order[j-1]] < tNear[i]; j-- ) order[j] = order[j-1];
+						order[j] = i;
+					}
+					for ( int j=0; j<n-1; j++ ) {
+						assert( stackSize < CY_BVH_MAX_DEPTH*(WIDTH-1) );
+						stack[stackSize].child  = node.child[ order[j] ];
+						stack[stackSize].tEntry = tNear[ order[j] ];
+						stackSize++;
+					}
+					child = node.child[ order[n-1] ];
+					continue;
+				}
+			}
+			// Pop the next node from the stack, skipping the ones that are farther than the closest hit
+			do {
+				if ( stackSize == 0 ) return hit;
+				stackSize--;
+			} while ( stack[stackSize].tEntry > tMax );
+			child = stack[stackSize].child;
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+
+private:
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//@ Internal storage
+	/////////////////////////////////////////////////////////////////////////////////
+
+	//! A wide node keeps the bounding boxes of its children as separate arrays for each dimension.
+	//! Each child is either a leaf, which keeps the leaf bit, the element count, and the element offset
+	//! in the same form as BVH nodes, or the index of an internal node. Unused children have empty boxes.
+	struct Node
+	{
+		float        bMin[3][WIDTH];	//!< minimum bounds of the children
+		float        bMax[3][WIDTH];	//!< maximum bounds of the children
+		unsigned int child[WIDTH];		//!< leaf data or the internal node index of the children
+
+		void Init()
+		{
+			for ( int d=0; d<3; d++ ) for ( int i=0; i<WIDTH; i++ ) { bMin[d][i] = std::numeric_limits<float>::infinity(); bMax[d][i] = -std::numeric_limits<float>::infinity(); }
+			for ( int i=0; i<WIDTH; i++ ) child[i] = 0;
+		}
+		void SetChild( int i, float const *box, unsigned int childData )
+		{
+			for ( int d=0; d<3; d++ ) { bMin[d][i] = box[d]; bMax[d][i] = box[d+3]; }
+			child[i] = childData;
+		}
+	};
+
+	//! Ray data precomputed for the slab tests. For each dimension, near and far are the offsets of
+	//! the minimum and maximum bounds arrays within a node, swapped if the ray direction is negative.
+	struct Ray
+	{
+		float org[3], invDir[3];
+		int   nearOffset[3], farOffset[3];
+		Ray( float const origin[3], float const direction[3] )
+		{
+			for ( int k=0; k<3; k++ ) {
+				org[k] = origin[k];
+				invDir[k] = 1.0f / ( std::abs(direction[k]) > 1e-30f ? direction[k] : ( direction[k] < 0 ? -1e-30f : 1e-30f ) );
+				int minOffset = k*WIDTH;
+				int maxOffset = (3+k)*WIDTH;
+				nearOffset[k] = invDir[k] >= 0 ? minOffset : maxOffset;
+				farOffset [k] = invDir[k] >= 0 ? maxOffset : minOffset;
+			}
+		}
+	};
+
+	Node         *nodes;		//!< the tree structure that keeps all the node data, starting with the root node
+	unsigned int *elements;		//!< indices of all elements in all leaf nodes
+	unsigned int  numNodes;		//!< the number of nodes
+	unsigned int  numElements;	//!< the number of elements
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//@ Internal methods
+	/////////////////////////////////////////////////////////////////////////////////
+
+	//! Appends the elements of the given binary leaf node and returns the wide leaf data.
+	unsigned int AddLeaf( BVH const &bvh, unsigned int nodeID )
+	{
+		unsigned int count = bvh.GetNodeElementCount(nodeID);
+		unsigned int offset = numElements;
+		MemCopy( elements + offset, bvh.GetNodeElements(nodeID), count );
+		numElements += count;
+		return (offset&_CY_BVH_ELEMENT_OFFSET_MASK)|((count-1)<<_CY_BVH_ELEMENT_OFFSET_BITS)|_CY_BVH_LEAF_BIT_MASK;
+	}
+
+	//! Recursively fills the given wide node using the descendants of the given internal binary node.
+	void CollapseNode( BVH const &bvh, unsigned int binaryNodeID, unsigned int wideNodeID )
+	{
+		unsigned int children[WIDTH];
+		int n = 2;
+		bvh.GetChildNodes( binaryNodeID, children[0], children[1] );
+		while ( n < WIDTH ) {
+			int largest = -1;
+			float largestArea = -1;
+			for ( int i=0; i<n; i++ ) {
+				if ( bvh.IsLeafNode(children[i]) ) continue;
+				float const *b = bvh.GetNodeBounds(children[i]);
+				float dx = b[3]-b[0], dy = b[4]-b[1], dz = b[5]-b[2];
+				float area = dx*dy + dy*dz + dz*dx;
+				if ( area > largestArea ) { largestArea = area; largest = i; }
+			}
+			if ( largest < 0 ) break;
+			unsigned int c1, c2;
+			bvh.GetChildNodes( children[largest], c1, c2 );
+			children[largest] = c1;
+			children[n++] = c2;
+		}
+
+		nodes[wideNodeID].Init();
+		for ( int i=0; i<n; i++ ) {
+			unsigned int childData;
+			if ( bvh.IsLeafNode(children[i]) ) {
+				childData = AddLeaf( bvh, children[i] );
+			} else {
+				childData = numNodes++;
+				CollapseNode( bvh, children[i], childData );
+			}
+			nodes[wideNodeID].SetChild( i, bvh.GetNodeBounds(children[i]), childData );
+		}
+	}
+
+	//! Tests the ray against the bounding boxes of all children of the given node.
+	//! Returns a bit mask of the children hit by the ray within tMax and sets their entry distances.
+	static unsigned int IntersectChildren( Node const &node, Ray const &ray, float tMax, float tNear[WIDTH] )
+	{
+		float const *b = &node.bMin[0][0];
+		float tFarMax = tMax * 1.00000024f;	// slightly enlarged, so that rounding errors do not miss elements on the box boundaries
+#if defined(_CY_BVH_AVX)
+		if ( WIDTH == 8 ) {
+			__m256 tn = _mm256_setzero_ps();
+			__m256 tf = _mm256_set1_ps( tFarMax );
+			for ( int k=0; k<3; k++ ) {
+				__m256 o = _mm256_set1_ps( ray.org[k] );
+				__m256 d = _mm256_set1_ps( ray.invDir[k] );
+				tn = _mm256_max_ps( tn, _mm256_mul_ps( _mm256_sub_ps( _mm256_loadu_ps( b + ray.nearOffset[k] ), o ), d ) );
+				tf = _mm256_min_ps( tf, _mm256_mul_ps( _mm256_sub_ps( _mm256_loadu_ps( b + ray.farOffset [k] ), o ), d ) );
+			}
+			_mm256_storeu_ps( tNear, tn );
+			return (unsigned int) _mm256_movemask_ps( _mm256_cmp_ps( tn, tf, _CMP_LE_OQ ) );
+		}
+#endif
+#if defined(_CY_BVH_SSE)
+		if ( WIDTH % 4 == 0 ) {
+			unsigned int mask = 0;
+			for ( int i=0; i<WIDTH; i+=4 ) {
+				__m128 tn = _mm_setzero_ps();
+				__m128 tf = _mm_set1_ps( tFarMax );
+				for ( int k=0; k<3; k++ ) {
+					__m128 o = _mm_set1_ps( ray.org[k] );
+					__m128 d = _mm_set1_ps( ray.invDir[k] );
+					tn = _mm_max_ps( tn, _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( b + ray.nearOffset[k] + i ), o ), d ) );
+					tf = _mm_min_ps( tf, _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( b + ray.farOffset [k] + i ), o ), d ) );
+				}
+				_mm_storeu_ps( tNear + i, tn );
+				mask |= (unsigned int) _mm_movemask_ps( _mm_cmple_ps( tn, tf ) ) << i;
+			}
+			return mask;
+		}
+#endif
+		unsigned int mask = 0;
+		for ( int i=0; i<WIDTH; i++ ) {
+			float tn = 0;
+			float tf = tFarMax;
+			for ( int k=0; k<3; k++ ) {
+				float t0 = ( b[ ray.nearOffset[k] + i ] - ray.org[k] ) * ray.invDir[k];
+				float t1 = ( b[ ray.farOffset [k] + i ] - ray.org[k] ) * ray.invDir[k];
+				tn = t0 > tn ? t0 : tn;
+				tf = t1 < tf ? t1 : tf;
+			}
+			tNear[i] = tn;
+			if ( tn <= tf ) mask |= 1u << i;
+		}
+		return mask;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+};
+
+typedef BVHWide<4> BVH4;	//!< Wide Bounding Volume Hierarchy with 4 children per node
+typedef BVHWide<8> BVH8;	//!< Wide Bounding Volume Hierarchy with 8 children per node
+
+//-------------------------------------------------------------------------------
+
 #ifdef _CY_TRIMESH_H_INCLUDED_
 
+//! Ray data precomputed for the watertight ray-triangle intersection test with TriMesh faces.
+//! The ray is transformed such that its direction becomes the positive z axis.
+//!
+//! Sven Woop, Carsten Benthin, and Ingo Wald. 2013. Watertight Ray/Triangle Intersection.
+//! Journal of Computer Graphics Techniques 2, 1 (June 2013), 65-82.
+
+class TriMeshRay
+{
+public:
+	//! Precomputes the ray data for the given ray origin and direction.
+	TriMeshRay( Vec3f const &o, Vec3f const &dir ) : origin(o)
+	{
+		Vec3f d( std::abs(dir.x), std::abs(dir.y), std::abs(dir.z) );
+		kz = d.x >= d.y ? ( d.x >= d.z ? 0 : 2 ) : ( d.y >= d.z ? 1 : 2 );
+		kx = (kz+1) % 3;
+		ky = (kx+1) % 3;
+		if ( dir[kz] < 0 ) { int k=kx; kx=ky; ky=k; }	// preserve the winding order
+		sx = dir[kx] / dir[kz];
+		sy = dir[ky] / dir[kz];
+		sz = 1.0f / dir[kz];
+	}
+
+	//! Intersects the ray with the given face of the mesh, ignoring hits farther than t.
+	//! If there is a hit, returns true and sets t and the barycentric coordinates bc.
+	bool IntersectFace( TriMesh const &mesh, unsigned int faceID, float &t, Vec3f &bc ) const
+	{
+		TriMesh::TriFace const &f = mesh.F(faceID);
+		Vec3f const a = mesh.V(f.v[0]) - origin;
+		Vec3f const b = mesh.V(f.v[1]) - origin;
+		Vec3f const c = mesh.V(f.v[2]) - origin;
+
+		// Shear and scale the vertices
+		float ax = a[kx] - sx*a[kz];
+		float ay = a[ky] - sy*a[kz];
+		float bx = b[kx] - sx*b[kz];
+		float by = b[ky] - sy*b[kz];
+		float cx = c[kx] - sx*c[kz];
+		float cy = c[ky] - sy*c[kz];
+
+		// Compute the scaled barycentric coordinates, falling back to double precision on the edges
+		float u = cx*by - cy*bx;
+		float v = ax*cy - ay*cx;
+		float w = bx*ay - by*ax;
+		if ( u == 0 || v == 0 || w == 0 ) {
+			u = float( double(cx)*double(by) - double(cy)*double(bx) );
+			v = float( double(ax)*double(cy) - double(ay)*double(cx) );
+			w = float( double(bx)*double(ay) - double(by)*double(ax) );
+		}
+		if ( (u<0 || v<0 || w<0) && (u>0 || v>0 || w>0) ) return false;
+		float det = u + v + w;
+		if ( det == 0 ) return false;
+
+		// Compute the scaled hit distance and test it against the valid ray segment
+		float tScaled = sz * ( u*a[kz] + v*b[kz] + w*c[kz] );
+		if ( det < 0 ) { det=-det; tScaled=-tScaled; u=-u; v=-v; w=-w; }
+		if ( tScaled <= 0 || tScaled >= t * det ) return false;
+
+		float invDet = 1.0f / det;
+		t = tScaled * invDet;
+		bc.Set( u*invDet, v*invDet, w*invDet );
+		return true;
+	}
+
+private:
+	Vec3f origin;
+	int   kx, ky, kz;	// the permutation of the dimensions, such that kz is the dominant direction
+	float sx, sy, sz;	// the shear and scale constants
+};
+
+//-------------------------------------------------------------------------------
+
 //! Bounding Volume Hierarchy for triangular meshes (TriMesh)
 
 class BVHTriMesh : public BVH
@@ -344,11 +1192,72 @@ public:
 	BVHTriMesh( TriMesh const *m ) { SetMesh(m); }
 
 	//! Sets the mesh pointer and builds the BVH structure.
-	void SetMesh( TriMesh const *m, unsigned int maxElementsPerNode=CY_BVH_MAX_ELEMENT_COUNT )
+	void SetMesh( TriMesh const *m, unsigned int maxElementsPerNode=CY_BVH_MAX_ELEMENT_COUNT, SplitMethod method=SPLIT_MEAN )
 	{
 		mesh = m;
 		Clear();
-		Build(mesh->NF(),maxElementsPerNode);
+		Build(mesh->NF(),maxElementsPerNode,method);
+	}
+
+	//! Sets the mesh pointer and loads the BVH structure from the given cache file, if the file was
+	//! saved for the same mesh and build parameters. Otherwise, builds the BVH structure and saves it
+	//! to the cache file, so that the next call with the same mesh can skip building it.
+	//! Returns true if the BVH structure is loaded from the cache file.
+	bool SetMeshCached( TriMesh const *m, char const *cacheFilename, unsigned int maxElementsPerNode=CY_BVH_MAX_ELEMENT_COUNT, SplitMethod method=SPLIT_MEAN )
+	{
+		mesh = m;
+		if ( maxElementsPerNode > CY_BVH_MAX_ELEMENT_COUNT ) maxElementsPerNode = CY_BVH_MAX_ELEMENT_COUNT;
+		uint64_t hash = ComputeMeshHash( *m, ( uint64_t(maxElementsPerNode) << 8 ) | uint64_t(method) );
+		if ( Load( cacheFilename, hash ) && GetElementCount() == mesh->NF() ) return true;
+		Build(mesh->NF(),maxElementsPerNode,method);
+		Save( cacheFilename, hash );
+		return false;
+	}
+
+	//! Computes a 64-bit hash value of the vertex positions and faces of the given mesh,
+	//! combined with the given seed, which can be used as the content hash of the cache files.
+	static uint64_t ComputeMeshHash( TriMesh const &m, uint64_t seed=0 )
+	{
+		uint64_t hash = HashBytes( 14695981039346656037ull, &seed, sizeof(seed) );
+		unsigned int counts[2] = { m.NV(), m.NF() };
+		hash = HashBytes( hash, counts, sizeof(counts) );
+		if ( m.NV() > 0 ) hash = HashBytes( hash, &m.V(0), m.NV()*sizeof(Vec3f) );
+		if ( m.NF() > 0 ) hash = HashBytes( hash, &m.F(0), m.NF()*sizeof(TriMesh::TriFace) );
+		return hash;
+	}
+
+	//! Keeps the information about the closest ray hit.
+	struct HitInfo
+	{
+		unsigned int faceID;	//!< The index of the face hit by the ray
+		float        t;			//!< The distance to the hit point along the ray direction
+		Vec3f        bc;		//!< The barycentric coordinates of the hit point on the face, which can be used with TriMesh::GetVec, GetNormal, and GetTexCoord
+	};
+
+	//! Finds the closest face hit by the given ray within the distance tMax.
+	//! Returns true if the ray hits a face and fills the given hit information.
+	bool IntersectRay( Vec3f const &origin, Vec3f const &direction, HitInfo &hit, float tMax=(std::numeric_limits<float>::max)() ) const
+	{
+		TriMeshRay ray( origin, direction );
+		hit.t = tMax;
+		return TraceRay( &origin.x, &direction.x, hit.t, [&]( unsigned int faceID, float &t ) {
+			Vec3f bc;
+			if ( ! ray.IntersectFace( *mesh, faceID, t, bc ) ) return false;
+			hit.faceID = faceID;
+			hit.bc = bc;
+			return true;
+		} );
+	}
+
+	//! Returns true if the given ray hits any face within the distance tMax.
+	//! This method stops at the first hit found, so it is faster than IntersectRay for shadow rays.
+	bool IsOccluded( Vec3f const &origin, Vec3f const &direction, float tMax=(std::numeric_limits<float>::max)() ) const
+	{
+		TriMeshRay ray( origin, direction );
+		return TraceRay( &origin.x, &direction.x, tMax, [&]( unsigned int faceID, float &t ) {
+			Vec3f bc;
+			return ray.IntersectFace( *mesh, faceID, t, bc );
+		}, true );
 	}
 
 protected:
@@ -376,8 +1285,77 @@ protected:
 
 private:
 	TriMesh const *mesh;
+
+	//! Combines the given data with the hash value using FNV-1a on 64-bit words, followed by the remaining bytes.
+	static uint64_t HashBytes( uint64_t hash, void const *data, size_t size )
+	{
+		uint64_t const prime = 1099511628211ull;
+		unsigned char const *bytes = (unsigned char const*) data;
+		size_t i = 0;
+		for ( ; i+8 <= size; i+=8 ) {
+			uint64_t word;
+			memcpy( &word, bytes+i, 8 );
+			hash = ( hash ^ word ) * prime;
+		}
+		for ( ; i<size; i++ ) hash = ( hash ^ bytes[i] ) * prime;
+		return hash;
+	}
 };
 
+//-------------------------------------------------------------------------------
+
+//! Wide BVH hierarchy for triangular meshes (TriMesh)
+template <int WIDTH>
+class BVHWideTriMesh : public BVHWide<WIDTH>
+{
+public:
+	typedef BVHTriMesh::HitInfo HitInfo;	//!< Keeps the information about the closest ray hit.
+
+	//!@name Constructors
+	BVHWideTriMesh() : mesh(0) {}
+	BVHWideTriMesh( TriMesh const *m ) { SetMesh(m); }
+
+	//! Sets the mesh pointer and builds the wide BVH structure by collapsing a binary BVH.
+	void SetMesh( TriMesh const *m, unsigned int maxElementsPerNode=CY_BVH_MAX_ELEMENT_COUNT, BVH::SplitMethod method=BVH::SPLIT_MEAN )
+	{
+		mesh = m;
+		BVHTriMesh bvh;
+		bvh.SetMesh( m, maxElementsPerNode, method );
+		this->Build( bvh );
+	}
+
+	//! Finds the closest face hit by the given ray within the distance tMax.
+	//! Returns true if the ray hits a face and fills the given hit information.
+	bool IntersectRay( Vec3f const &origin, Vec3f const &direction, HitInfo &hit, float tMax=(std::numeric_limits<float>::max)() ) const
+	{
+		TriMeshRay ray( origin, direction );
+		hit.t = tMax;
+		return this->TraceRay( &origin.x, &direction.x, hit.t, [&]( unsigned int faceID, float &t ) {
+			Vec3f bc;
+			if ( ! ray.IntersectFace( *mesh, faceID, t, bc ) ) return false;
+			hit.faceID = faceID;
+			hit.bc = bc;
+			return true;
+		} );
+	}
+
+	//! Returns true if the given ray hits any face within the distance tMax.
+	bool IsOccluded( Vec3f const &origin, Vec3f const &direction, float tMax=(std::numeric_limits<float>::max)() ) const
+	{
+		TriMeshRay ray( origin, direction );
+		return this->TraceRay( &origin.x, &direction.x, tMax, [&]( unsigned int faceID, float &t ) {
+			Vec3f bc;
+			return ray.IntersectFace( *mesh, faceID, t, bc );
+		}, true );
+	}
+
+private:
+	TriMesh const *mesh;
+};
+
+typedef BVHWideTriMesh<4> BVH4TriMesh;	//!< 4-wide BVH hierarchy for triangular meshes (TriMesh)
+typedef BVHWideTriMesh<8> BVH8TriMesh;	//!< 8-wide BVH hierarchy for triangular meshes (TriMesh)
+
 #endif
 
 //-------------------------------------------------------------------------------
@@ -385,9 +1363,13 @@ private:
 //-------------------------------------------------------------------------------
 
 typedef cy::BVH cyBVH;	//!< Bounding Volume Hierarchy class
+typedef cy::BVH4 cyBVH4;	//!< Wide Bounding Volume Hierarchy with 4 children per node
+typedef cy::BVH8 cyBVH8;	//!< Wide Bounding Volume Hierarchy with 8 children per node
 
 #ifdef _CY_TRIMESH_H_INCLUDED_
 typedef cy::BVHTriMesh cyBVHTriMesh;	//!< BVH hierarchy for triangular meshes (TriMesh)
+typedef cy::BVH4TriMesh cyBVH4TriMesh;	//!< 4-wide BVH hierarchy for triangular meshes (TriMesh)
+typedef cy::BVH8TriMesh cyBVH8TriMesh;	//!< 8-wide BVH hierarchy for triangular meshes (TriMesh)
 #endif
 
 //-------------------------------------------------------------------------------
@@ -40,6 +40,8 @@
 
 #include <cassert>
 #include <cstdint>
+#include <vector>
+#include <algorithm>
 #include "cyCore.h"
 
 //-------------------------------------------------------------------------------
@@ -144,6 +146,18 @@ public:
 	//! Returns false if the item is not in the heap anymore (removed by Pop) or if its heap position is not changed.
 	bool MoveItemDown( SIZE_TYPE id ) { return HeapMoveDown(heapPos[id]); }
 
+	//! Moves the items with the given ids towards the bottom of the heap.
+	//! This method is useful for fixing the heap after multiple items are modified externally to decrease their priorities.
+	//! The ids can include items that are not in the heap anymore.
+	void MoveItemsDown( SIZE_TYPE count, SIZE_TYPE const *ids )
+	{
+		// The items are moved starting from the bottom of the heap, so that moving an item down
+		// never moves a child up above another modified item that is not processed yet.
+		moveOrder.assign( ids, ids+count );
+		std::sort( moveOrder.begin(), moveOrder.end(), [this]( SIZE_TYPE a, SIZE_TYPE b ){ return heapPos[a] > heapPos[b]; } );
+		for ( SIZE_TYPE id : moveOrder ) MoveItemDown( id );
+	}
+
 	//! Returns if the item with the given id is in the heap or removed by Pop.
 	bool IsInHeap( SIZE_TYPE id ) const { assert(id<size); return heapPos[id]<=heapItemCount; }
 
@@ -203,6 +217,7 @@ private:
 	SIZE_TYPE heapItemCount;	// The number of items in the heap.
 	SIZE_TYPE size;				// The total item count, including the ones removed from the heap.
 	bool deleteData;			// Determines whether the data pointer owns the memory it points to.
+	std::vector<SIZE_TYPE> moveOrder;	// The order of the items moved by MoveItemsDown.
 
 	// Clears the data pointer and deallocates memory if the data is owned.
 	void ClearData()
@@ -287,6 +302,531 @@ private:
 template <typename DATA_TYPE, typename SIZE_TYPE=size_t> _CY_TEMPLATE_ALIAS( MaxHeap, (Heap<true, DATA_TYPE,SIZE_TYPE>) );	//!< A general-purpose max-heap structure that allows random access and updates.
 template <typename DATA_TYPE, typename SIZE_TYPE=size_t> _CY_TEMPLATE_ALIAS( MinHeap, (Heap<false,DATA_TYPE,SIZE_TYPE>) );	//!< A general-purpose min-heap structure that allows random access and updates.
 
+//-------------------------------------------------------------------------------
+
+//! A d-ary heap structure that allows random access and updates.
+//!
+//! It has the same interface as the Heap class, but it is designed to reduce cache misses.
+//! Each node has ARITY children (4 by default), so the heap is shallower than a binary heap and
+//! the children of a node are consecutive in memory. Also, each entry of the heap array keeps a copy
+//! of the item next to its id, so that comparisons do not access the main data in random order.
+//! Therefore, the item copies in the heap must be updated when the main data is modified externally,
+//! which is done by the MoveItem, MoveItemUp, MoveItemDown, and MoveItemsDown methods.
+//! The DATA_TYPE should be a small type, such as a number, since it is copied when items are moved.
+
+template <bool MAX_HEAP, typename DATA_TYPE, typename SIZE_TYPE=size_t, int ARITY=4>
+class DaryHeap
+{
+public:
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@name Constructor and Destructor
+
+	DaryHeap() : data(nullptr), heap(nullptr), heapPos(nullptr), heapItemCount(0), heapAllocSize(0), size(0), deleteData(false) {}
+	~DaryHeap() { Clear(); }
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@name Initialization methods
+
+	//! Deletes all data owned by the class.
+	void Clear() { ClearData(); ClearHeap(); }
+
+	//! Copies the main data items from an array into the internal storage of this class.
+	void CopyData( DATA_TYPE const *items, SIZE_TYPE itemCount )
+	{
+		ClearData();
+		size = itemCount;
+		data = new DATA_TYPE[size];
+		for ( SIZE_TYPE i=0; i<size; i++ ) data[i] = items[i];
+		deleteData = true;
+	}
+
+	//! Moves the main data items from an array to the internal storage of this class.
+	//! The class claims ownership of the data, so the given array must NOT be deleted externally.
+	//! Modifying this array externally requires updating the heap using the MoveItem methods.
+	void MoveData( DATA_TYPE *items, SIZE_TYPE itemCount )
+	{
+		ClearData();
+		data = items;
+		size = itemCount;
+		deleteData = true;
+	}
+
+	//! Sets the data pointer of this class without claiming ownership of the data (see Heap::SetDataPointer).
+	//! Modifying the data items externally requires updating the heap using the MoveItem methods.
+	void SetDataPointer( DATA_TYPE *items, SIZE_TYPE itemCount )
+	{
+		ClearData();
+		data = items;
+		size = itemCount;
+		deleteData = false;
+	}
+
+	//! The Build method builds the heap structure using the main data. Therefore,
+	//! the main data must be set using either CopyData, MoveData, or SetDataPointer
+	//! before calling the Build method.
+	void Build()
+	{
+		if ( heapAllocSize < size ) {
+			ClearHeap();
+			heap    = new Entry[ size ];
+			heapPos = new SIZE_TYPE[ size ];
+			heapAllocSize = size;
+		}
+		heapItemCount = size;
+		for ( SIZE_TYPE i=0; i<size; i++ ) {
+			heap[i].item = data[i];
+			heap[i].id   = i;
+			heapPos[i]   = i;
+		}
+		BuildHeap();
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@name Access and manipulation methods
+
+	//! Returns the item from the main data with the given id.
+	DATA_TYPE const & GetItem( SIZE_TYPE id ) const { assert(id<size); return data[id]; }
+
+	//! Sets the item with the given id and updates the heap structure accordingly.
+	//! Returns false if the item is not in the heap anymore (removed by Pop) or if its heap position is not changed.
+	bool SetItem( SIZE_TYPE id, DATA_TYPE const &item ) { assert(id<size); data[id]=item; return MoveItem(id); }
+
+	//! Moves the item with the given id to the correct position in the heap.
+	//! This method is useful for fixing the heap position after an item is modified externally.
+	//! Returns false if the item is not in the heap anymore (removed by Pop) or if its heap position is not changed.
+	bool MoveItem( SIZE_TYPE id )
+	{
+		SIZE_TYPE ix = heapPos[id];
+		if ( ix >= heapItemCount ) return false;
+		heap[ix].item = data[id];
+		if ( HeapMoveUp(ix) ) return true;
+		return HeapMoveDown(ix);
+	}
+
+	//! Moves the item with the given id towards the top of the heap.
+	//! This method is useful for fixing the heap position after an item is modified externally to increase its priority.
+	//! Returns false if the item is not in the heap anymore (removed by Pop) or if its heap position is not changed.
+	bool MoveItemUp( SIZE_TYPE id )
+	{
+		SIZE_TYPE ix = heapPos[id];
+		if ( ix >= heapItemCount ) return false;
+		heap[ix].item = data[id];
+		return HeapMoveUp(ix);
+	}
+
+	//! Moves the item with the given id towards the bottom of the heap.
+	//! This method is useful for fixing the heap position after an item is modified externally to decrease its priority.
+	//! Returns false if the item is not in the heap anymore (removed by Pop) or if its heap position is not changed.
+	bool MoveItemDown( SIZE_TYPE id )
+	{
+		SIZE_TYPE ix = heapPos[id];
+		if ( ix >= heapItemCount ) return false;
+		heap[ix].item = data[id];
+		return HeapMoveDown(ix);
+	}
+
+	//! Moves the items with the given ids towards the bottom of the heap. This method is useful for fixing
+	//! the heap after multiple items are modified externally to decrease their priorities. The ids can
+	//! include items that are not in the heap anymore. If the number of items is large compared to the
+	//! number of items in the heap, the heap is rebuilt, instead of moving the items one by one.
+	void MoveItemsDown( SIZE_TYPE count, SIZE_TYPE const *ids )
+	{
+		if ( count > heapItemCount / 8 + 1 ) {
+			for ( SIZE_TYPE i=0; i<count; i++ ) {
+				SIZE_TYPE ix = heapPos[ ids[i] ];
+				if ( ix < heapItemCount ) heap[ix].item = data[ ids[i] ];
+			}
+			BuildHeap();
+		} else {
+			for ( SIZE_TYPE i=0; i<count; i++ ) MoveItemDown( ids[i] );
+		}
+	}
+
+	//! Returns if the item with the given id is in the heap or removed by Pop.
+	bool IsInHeap( SIZE_TYPE id ) const { assert(id<size); return heapPos[id]<heapItemCount; }
+
+	//! Returns the number of items in the heap.
+	SIZE_TYPE NumItemsInHeap() const { return heapItemCount; }
+
+	//! Returns false if there are no items in the heap.
+	bool IsEmpty() const { return heapItemCount==0; }
+
+	//! Returns true if there is any item in the heap.
+	bool NotEmpty() const { return heapItemCount>0; }
+
+	//! Returns the item from the heap with the given heap position.
+	//! Note that items that are removed from the heap appear in the inverse order 
+	//! with which they were removed after the last item in the heap.
+	DATA_TYPE const & GetFromHeap( SIZE_TYPE heapIndex ) const { assert(heapIndex<size); return data[heap[heapIndex].id]; }
+
+	//! Returns the id of the item from the heap with the given heap position.
+	//! Note that items that are removed from the heap appear in the inverse order 
+	//! with which they were removed after the last item in the heap.
+	SIZE_TYPE GetIDFromHeap( SIZE_TYPE heapIndex ) const { assert(heapIndex<size); return heap[heapIndex].id; }
+
+	//! Returns the item at the top of the heap.
+	DATA_TYPE const & GetTopItem() const { assert(size>=1); return data[heap[0].id]; }
+
+	//! Returns the id of the item at the top of the heap.
+	SIZE_TYPE GetTopItemID() const { assert(size>=1); return heap[0].id; }
+
+	//! Removes and returns the item at the top of the heap.
+	//! The removed item is not deleted, but it is removed from the heap
+	//! by placing it right after the last item in the heap.
+	SIZE_TYPE Pop( DATA_TYPE &item )
+	{
+		item = data[ heap[0].id ];
+		return Pop();
+	}
+
+	//! Removes the item at the top of the heap.
+	//! The removed item is not deleted, but it is removed from the heap
+	//! by placing it right after the last item in the heap.
+	SIZE_TYPE Pop()
+	{
+		SIZE_TYPE top = heap[0].id;
+		heapItemCount--;
+		SwapItems( SIZE_TYPE(0), heapItemCount );
+		HeapMoveDown(SIZE_TYPE(0));
+		return top;
+	}
+
+private:
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@name Internal structures and methods
+
+	struct Entry
+	{
+		DATA_TYPE item;	// A copy of the main data item
+		SIZE_TYPE id;	// The id of the item
+	};
+
+	DATA_TYPE *data;			// The main data pointer.
+	Entry     *heap;			// The heap array, keeping the id of each data item and a copy of the item.
+	SIZE_TYPE *heapPos;			// The heap position of each item.
+	SIZE_TYPE heapItemCount;	// The number of items in the heap.
+	SIZE_TYPE heapAllocSize;	// The number of items allocated for the heap arrays.
+	SIZE_TYPE size;				// The total item count, including the ones removed from the heap.
+	bool deleteData;			// Determines whether the data pointer owns the memory it points to.
+
+	// Clears the data pointer and deallocates memory if the data is owned.
+	void ClearData()
+	{
+		if ( deleteData ) delete [] data;
+		data = nullptr;
+		deleteData = false;
+		size = SIZE_TYPE(0);
+	}
+
+	// Clears the heap structure.
+	void ClearHeap()
+	{
+		delete [] heap;    heap    = nullptr;
+		delete [] heapPos; heapPos = nullptr;
+		heapItemCount = SIZE_TYPE(0);
+		heapAllocSize = SIZE_TYPE(0);
+	}
+
+	// Builds the heap order for the items in the heap array.
+	void BuildHeap()
+	{
+		if ( heapItemCount <= 1 ) return;
+		for ( SIZE_TYPE ix=(heapItemCount-2)/ARITY+1; ix>0; ix-- ) HeapMoveDown(ix-1);
+	}
+
+	// Checks if the item should be moved up, returns true if the item is moved.
+	bool HeapMoveUp( SIZE_TYPE ix )
+	{
+		Entry e = heap[ix];
+		SIZE_TYPE org = ix;
+		while ( ix > 0 ) {
+			SIZE_TYPE parent = (ix-1) / ARITY;
+			if ( ! NotInOrder( heap[parent].item, e.item ) ) break;
+			SetEntry( ix, heap[parent] );
+			ix = parent;
+		}
+		if ( ix != org ) SetEntry( ix, e );
+		return ix!=org;
+	}
+
+	// Checks if the item should be moved down, returns true if the item is moved.
+	bool HeapMoveDown( SIZE_TYPE ix )
+	{
+		Entry e = heap[ix];
+		SIZE_TYPE org = ix;
+		for (;;) {
+			SIZE_TYPE first = ix*ARITY + 1;
+			if ( first >= heapItemCount ) break;
+			SIZE_TYPE last  = first + ARITY;
+			if ( last > heapItemCount ) last = heapItemCount;
+			SIZE_TYPE child = first;
+			for ( SIZE_TYPE c=first+1; c<last; c++ ) if ( NotInOrder( heap[child].item, heap[c].item ) ) child = c;
+			if ( ! NotInOrder( e.item, heap[child].item ) ) break;
+			SetEntry( ix, heap[child] );
+			ix = child;
+		}
+		if ( ix != org ) SetEntry( ix, e );
+		return ix!=org;
+	}
+
+	// If max-heap, returns if item1 is smaller than item2.
+	// If min-heap, returns if item1 is greater than item2.
+	static bool NotInOrder( DATA_TYPE const &item1, DATA_TYPE const &item2 ) { return MAX_HEAP ? ( item1 < item2 ) : ( item1 > item2 ); }
+
+	// Places the given entry at the given heap position.
+	void SetEntry( SIZE_TYPE ix, Entry const &e )
+	{
+		heap[ix] = e;
+		heapPos[ e.id ] = ix;
+	}
+
+	// Swaps the heap positions of items at ix1 and ix2.
+	void SwapItems( SIZE_TYPE ix1, SIZE_TYPE ix2 )
+	{
+		Entry t = heap[ix1];
+		SetEntry( ix1, heap[ix2] );
+		SetEntry( ix2, t );
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+};
+
+//-------------------------------------------------------------------------------
+
+template <typename DATA_TYPE, typename SIZE_TYPE=size_t, int ARITY=4> _CY_TEMPLATE_ALIAS( MaxDaryHeap, (DaryHeap<true, DATA_TYPE,SIZE_TYPE,ARITY>) );	//!< A d-ary max-heap structure that allows random access and updates.
+template <typename DATA_TYPE, typename SIZE_TYPE=size_t, int ARITY=4> _CY_TEMPLATE_ALIAS( MinDaryHeap, (DaryHeap<false,DATA_TYPE,SIZE_TYPE,ARITY>) );	//!< A d-ary min-heap structure that allows random access and updates.
+
+//-------------------------------------------------------------------------------
+
+//! A bucket-based max-priority queue for items that mostly decrease, with the same interface as MaxHeap.
+//!
+//! The range of the items, from the smaller of zero and the smallest finite item to the largest item
+//! at the time of building, is split into equal-sized buckets, each of which keeps a list of its items.
+//! When an item is moved to another bucket after its value is modified, it is added to the new bucket
+//! without removing it from the old one, so moving an item takes constant time and it does nothing if
+//! the item remains in the same bucket. The outdated entries are skipped while looking for the top item,
+//! which scans the buckets downwards from the last top bucket and takes constant amortized time when the
+//! items only decrease. The lists are rebuilt when the outdated entries grow beyond the number of items.
+//!
+//! The items in the same bucket are considered equal, except for the items below the range (such as
+//! negative infinity), which are kept in a separate bucket that is searched exhaustively. Therefore,
+//! the order of the items is approximate with the precision of the bucket size. By default, the
+//! number of buckets is the same as the number of items.
+//!
+//! This is not necessarily faster than MaxDaryHeap. When the items decrease by small amounts, such as
+//! the weights in weighted sample elimination, a heap moves each item only a few levels, while the
+//! bucket queue touches more memory per update. In weighted sample elimination (see the heap_benchmark
+//! program next to the cs6610 projects), the queue takes about 15% of the total time or less. The
+//! bucket queue reduced the queue time by 10-30% only for the smallest inputs (100K samples in 2D and
+//! 25K samples in 6D). It was as fast or up to 25% slower for larger 2D and 6D inputs and 15-70% slower
+//! for 3D inputs. Therefore, it should be preferred only after measuring the intended use.
+
+template <typename DATA_TYPE, typename SIZE_TYPE=size_t>
+class MaxBucketQueue
+{
+public:
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@name Constructor and Destructor
+
+	MaxBucketQueue() : data(nullptr), size(0), itemCount(0), bucketCount(0), bucketCountParam(0), rangeMin(0), bucketScale(0), top(0) {}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@name Initialization methods
+
+	//! Sets the data pointer of this class. The data items are not copied and they must NOT be deleted
+	//! while an object of this class is used. When a data item is modified externally, one of the MoveItem
+	//! methods must be called for updating its place in the queue.
+	void SetDataPointer( DATA_TYPE *items, SIZE_TYPE numItems ) { data = items; size = numItems; }
+
+	//! Sets the number of buckets. If zero (the default), the number of buckets is the number of items.
+	void SetBucketCount( SIZE_TYPE numBuckets ) { bucketCountParam = numBuckets; }
+
+	//! Builds the queue using the data items. The data pointer must be set before calling this method.
+	void Build()
+	{
+		itemCount   = size;
+		bucketCount = bucketCountParam > 0 ? bucketCountParam : ( size > 0 ? size : SIZE_TYPE(1) );
+		DATA_TYPE rangeMax = DATA_TYPE(0);
+		rangeMin = DATA_TYPE(0);
+		for ( SIZE_TYPE i=0; i<size; i++ ) {
+			if ( ! IsFinite( data[i] ) ) continue;
+			if ( rangeMin > data[i] ) rangeMin = data[i];
+			if ( rangeMax < data[i] ) rangeMax = data[i];
+		}
+		bucketScale = rangeMax > rangeMin ? DATA_TYPE(bucketCount) / ( rangeMax - rangeMin ) : DATA_TYPE(0);
+		nodes.resize( size );
+		order.resize( size );
+		for ( SIZE_TYPE i=0; i<size; i++ ) {
+			order[i]        = i;
+			nodes[i].pos    = i;
+			nodes[i].bucket = BucketOf( data[i] );
+		}
+		entries.reserve( 2*size + 1 );
+		BuildLists();
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@name Access and manipulation methods
+
+	//! Returns the item from the main data with the given id.
+	DATA_TYPE const & GetItem( SIZE_TYPE id ) const { assert(id<size); return data[id]; }
+
+	//! Sets the item with the given id and updates the queue accordingly.
+	//! Returns false if the item is not in the queue anymore (removed by Pop) or if its bucket is not changed.
+	bool SetItem( SIZE_TYPE id, DATA_TYPE const &item ) { assert(id<size); data[id]=item; return MoveItem(id); }
+
+	//! Moves the item with the given id to the correct bucket after it is modified externally.
+	//! Returns false if the item is not in the queue anymore (removed by Pop) or if its bucket is not changed.
+	bool MoveItem( SIZE_TYPE id )
+	{
+		if ( ! IsInHeap(id) ) return false;
+		SIZE_TYPE b = BucketOf( data[id] );
+		if ( b == nodes[id].bucket ) return false;
+		nodes[id].bucket = b;
+		if ( entries.size() > 2*size ) BuildLists();
+		else AddEntry( id, b );
+		return true;
+	}
+
+	//! Same as MoveItem. It is provided for compatibility with the Heap class.
+	bool MoveItemUp  ( SIZE_TYPE id ) { return MoveItem(id); }
+
+	//! Same as MoveItem. It is provided for compatibility with the Heap class.
+	bool MoveItemDown( SIZE_TYPE id ) { return MoveItem(id); }
+
+	//! Moves the items with the given ids to their correct buckets. It is provided for compatibility with the DaryHeap class.
+	void MoveItemsDown( SIZE_TYPE count, SIZE_TYPE const *ids ) { for ( SIZE_TYPE i=0; i<count; i++ ) MoveItem( ids[i] ); }
+
+	//! Returns if the item with the given id is in the queue or removed by Pop.
+	bool IsInHeap( SIZE_TYPE id ) const { assert(id<size); return nodes[id].pos<itemCount; }
+
+	//! Returns the number of items in the queue.
+	SIZE_TYPE NumItemsInHeap() const { return itemCount; }
+
+	//! Returns false if there are no items in the queue.
+	bool IsEmpty() const { return itemCount==0; }
+
+	//! Returns true if there is any item in the queue.
+	bool NotEmpty() const { return itemCount>0; }
+
+	//! Returns the id of the item with the given index. The items in the queue have indices smaller than
+	//! the number of items in the queue, in no particular order. The items that are removed from the queue
+	//! appear in the inverse order with which they were removed after the items in the queue.
+	SIZE_TYPE GetIDFromHeap( SIZE_TYPE index ) const { assert(index<size); return order[index]; }
+
+	//! Returns the item with the given index (see GetIDFromHeap).
+	DATA_TYPE const & GetFromHeap( SIZE_TYPE index ) const { return data[ GetIDFromHeap(index) ]; }
+
+	//! Returns the id of the item at the top of the queue.
+	SIZE_TYPE GetTopItemID() const { assert(itemCount>=1); return FindTop(); }
+
+	//! Returns the item at the top of the queue.
+	DATA_TYPE const & GetTopItem() const { return data[ GetTopItemID() ]; }
+
+	//! Removes and returns the item at the top of the queue.
+	SIZE_TYPE Pop( DATA_TYPE &item )
+	{
+		SIZE_TYPE id = Pop();
+		item = data[id];
+		return id;
+	}
+
+	//! Removes the item at the top of the queue and returns its id.
+	//! The removed item is placed right after the last item in the queue (see GetIDFromHeap).
+	SIZE_TYPE Pop()
+	{
+		assert(itemCount>=1);
+		SIZE_TYPE id = FindTop();
+		itemCount--;
+		SIZE_TYPE last = order[itemCount];
+		SIZE_TYPE p    = nodes[id].pos;
+		order[p] = last;       nodes[last].pos = p;
+		order[itemCount] = id; nodes[id].pos   = itemCount;
+		return id;
+	}
+
+private:
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@name Internal structures and methods
+
+	struct Node
+	{
+		SIZE_TYPE bucket;	// The current bucket of the item.
+		SIZE_TYPE pos;		// The index of the item in the order array.
+	};
+	struct Entry
+	{
+		SIZE_TYPE id;		// The item of the entry.
+		SIZE_TYPE next;		// The next entry in the same bucket.
+	};
+
+	DATA_TYPE                     *data;				// The main data pointer.
+	SIZE_TYPE                      size;				// The total item count, including the ones removed from the queue.
+	SIZE_TYPE                      itemCount;			// The number of items in the queue.
+	SIZE_TYPE                      bucketCount;			// The number of buckets for the items within the range.
+	SIZE_TYPE                      bucketCountParam;	// The number of buckets set by the user, zero for automatic.
+	DATA_TYPE                      rangeMin;			// The minimum value of the bucket range.
+	DATA_TYPE                      bucketScale;			// The number of buckets per unit value.
+	std::vector<Node>              nodes;				// The bucket and the order index of each item.
+	std::vector<SIZE_TYPE>         order;				// The items in the queue, followed by the removed items.
+	mutable std::vector<SIZE_TYPE> head;				// The first entry of each bucket. Bucket zero keeps the items below the range.
+	mutable std::vector<Entry>     entries;				// The entries of all buckets, including the outdated ones.
+	mutable SIZE_TYPE              top;					// The highest bucket that can contain items.
+
+	static SIZE_TYPE None() { return (std::numeric_limits<SIZE_TYPE>::max)(); }
+
+	SIZE_TYPE BucketOf( DATA_TYPE const &item ) const
+	{
+		if ( ! ( item >= rangeMin ) ) return 0;
+		DATA_TYPE b = ( item - rangeMin ) * bucketScale;
+		if ( b >= DATA_TYPE(bucketCount-1) ) return bucketCount;
+		return SIZE_TYPE(b) + 1;
+	}
+
+	// An entry is outdated if its item is removed from the queue or moved to another bucket.
+	bool IsValid( SIZE_TYPE id, SIZE_TYPE b ) const { return nodes[id].pos < itemCount && nodes[id].bucket == b; }
+
+	void AddEntry( SIZE_TYPE id, SIZE_TYPE b )
+	{
+		Entry e;
+		e.id   = id;
+		e.next = head[b];
+		head[b] = SIZE_TYPE( entries.size() );
+		entries.push_back( e );
+		if ( top < b ) top = b;
+	}
+
+	// Rebuilds the bucket lists using the items in the queue, discarding the outdated entries.
+	void BuildLists()
+	{
+		head.assign( bucketCount+1, None() );
+		entries.clear();
+		top = 0;
+		for ( SIZE_TYPE i=0; i<itemCount; i++ ) AddEntry( order[i], nodes[ order[i] ].bucket );
+	}
+
+	// Returns the first valid entry of the highest non-empty bucket, removing the outdated entries
+	// before it. If only the bucket below the range has items, returns the largest item in it.
+	SIZE_TYPE FindTop() const
+	{
+		for (;;) {
+			while ( top > 0 && head[top] == None() ) top--;
+			if ( top == 0 ) break;
+			Entry const &e = entries[ head[top] ];
+			if ( IsValid( e.id, top ) ) return e.id;
+			head[top] = e.next;
+		}
+		SIZE_TYPE id = None();
+		for ( SIZE_TYPE i=head[0]; i!=None(); i=entries[i].next ) {
+			SIZE_TYPE j = entries[i].id;
+			if ( IsValid( j, 0 ) && ( id == None() || data[id] < data[j] ) ) id = j;
+		}
+		return id;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+};
+
 //-------------------------------------------------------------------------------
 } // namespace cy
 //-------------------------------------------------------------------------------
@@ -295,6 +835,12 @@ template <bool MAX_HEAP, typename DATA_TYPE, typename SIZE_TYPE=size_t> _CY_TEMP
 template <               typename DATA_TYPE, typename SIZE_TYPE=size_t> _CY_TEMPLATE_ALIAS( cyMaxHeap, (cy::Heap<true,    DATA_TYPE,SIZE_TYPE>) );	//!< A general-purpose max-heap structure that allows random access and updates.
 template <               typename DATA_TYPE, typename SIZE_TYPE=size_t> _CY_TEMPLATE_ALIAS( cyMinHeap, (cy::Heap<false,   DATA_TYPE,SIZE_TYPE>) );	//!< A general-purpose min-heap structure that allows random access and updates.
 
+template <bool MAX_HEAP, typename DATA_TYPE, typename SIZE_TYPE=size_t, int ARITY=4> _CY_TEMPLATE_ALIAS( cyDaryHeap,    (cy::DaryHeap<MAX_HEAP,DATA_TYPE,SIZE_TYPE,ARITY>) );	//!< A d-ary heap structure that allows random access and updates.
+template <               typename DATA_TYPE, typename SIZE_TYPE=size_t, int ARITY=4> _CY_TEMPLATE_ALIAS( cyMaxDaryHeap, (cy::DaryHeap<true,    DATA_TYPE,SIZE_TYPE,ARITY>) );	//!< A d-ary max-heap structure that allows random access and updates.
+template <               typename DATA_TYPE, typename SIZE_TYPE=size_t, int ARITY=4> _CY_TEMPLATE_ALIAS( cyMinDaryHeap, (cy::DaryHeap<false,   DATA_TYPE,SIZE_TYPE,ARITY>) );	//!< A d-ary min-heap structure that allows random access and updates.
+
+template <typename DATA_TYPE, typename SIZE_TYPE=size_t> _CY_TEMPLATE_ALIAS( cyMaxBucketQueue, (cy::MaxBucketQueue<DATA_TYPE,SIZE_TYPE>) );	//!< A bucket-based max-priority queue for items that mostly decrease.
+
 //-------------------------------------------------------------------------------
 
 #endif
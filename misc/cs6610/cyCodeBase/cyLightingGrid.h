@@ -55,7 +55,7 @@
 #include "cyIVector.h"
 #include "cyColor.h"
 #include "cyPointCloud.h"
-#include <random>
+#include "cyParallel.h"
 
 //-------------------------------------------------------------------------------
 namespace cy {
@@ -87,10 +87,12 @@ public:
 	const Color& GetLightIntens( int level, int ix ) const { return levels[level].colors[ix]; }								//!< Returns the intensity of the light with index ix at the given level.
 	const Vec3f& GetLightPosDev( int level, int ix ) const { return level > 0 ? levels[level].pDev[ix] : Vec3f(0,0,0); }	//!< Returns the position variation of the light with index ix at the given level.
 
-	void Clear() { if ( levels ) delete [] levels; levels = nullptr; numLevels = 0; }	//!< Deletes all data.
+	void Clear() { if ( levels ) delete [] levels; levels = nullptr; numLevels = 0; updateData = UpdateData(); }	//!< Deletes all data.
 
 	//! Builds the Lighting Grid Hierarchy for the given point light positions and intensities using the given parameters.
 	//! This method builds the hierarchy using the given cellSize as the size of the lowest (finest) level grid cells.
+	//! The grid of a level can have at most 2^21 cells along each axis. The lower levels that would have more cells are skipped,
+	//! and the build fails and returns false if the highest level would have more cells.
 	bool Build( const Vec3f *lightPos,			//!< Light positions.
 	            const Color *lightIntensities, 	//!< Light intensities.
 	            int          numLights, 		//!< Number of lights.
@@ -114,6 +116,27 @@ public:
 		return DoBuild( lightPos, lightIntensities, numLights, autoFitScale, minLevelLights );
 	}
 
+	//! Updates the Lighting Grid Hierarchy for the given point light positions and intensities, reusing the grid of the last build.
+	//! This is intended for animated lights that change only slightly from one frame to the next.
+	//! The grid cells and the levels of the last build are kept and only the grid nodes around the lights with
+	//! changed positions or intensities are accumulated again. The point cloud of a level is rebuilt only if
+	//! its nodes have changed, and the point cloud of level 0 is rebuilt only if a light position has changed.
+	//! The first call after a build accumulates all grid nodes and keeps the data needed by the following calls.
+	//! The resulting hierarchy only depends on the given lights and the grid of the last build, not on the previous updates,
+	//! but it can be slightly different from building the hierarchy for the same lights, since Build fits the grid to the lights.
+	//! If the number of lights is different or a light moves out of the range of the grid,
+	//! the hierarchy is built again using the parameters of the last build.
+	//! Returns false if the hierarchy was not built before or if building it again fails.
+	bool Update( const Vec3f *lightPos,				//!< Light positions.
+	             const Color *lightIntensities, 	//!< Light intensities.
+	             int          numLights 			//!< Number of lights.
+	           )
+	{
+		if ( ! levels ) return false;
+		if ( numLights != lightCount ) return Rebuild( lightPos, lightIntensities, numLights );
+		return DoUpdate( lightPos, lightIntensities ) || Rebuild( lightPos, lightIntensities, numLights );
+	}
+
 	//! Computes the illumination at the given position using the given accuracy parameter alpha.
 	template <typename LightingFunction>
 	void Light( const Vec3f      &pos,				//!< The position where the lighting will be evaluated.
@@ -126,12 +149,32 @@ public:
 
 	//! Computes the illumination at the given position using the given accuracy parameter alpha.
 	//! This method provides stochastic sampling by randomly changing the given light position when calling the lighting function.
+	//! The random positions are generated using a sample index computed from the given position and a counter
+	//! of the calling thread, so each call produces new random positions, even for the same position.
+	//! Use the method with a sample index for reproducible results.
 	template <typename LightingFunction>
 	void Light( const Vec3f      &pos,						//!< The position where the lighting will be evaluated.
 	            float            alpha,						//!< The accuracy parameter. It should be 1 or greater. Larger values produce more accurate results with substantially more computation.
 	            int              stochasticShadowSamples,   //!< When this parameter is zero, the given lightingFunction is called once per light, using the position of the light. Otherwise, it is called as many times as this parameter specifies, using random positions around each light position.
 	            LightingFunction lightingFunction			//!< This function is called for each light used for lighting computation. It should be in the form void LightingFunction(int level, int light_id, const Vec3f &light_position, const Color &light_intensity).
 	          )
+	{
+		Light( pos, alpha, stochasticShadowSamples, PositionSampleIndex(pos) ^ RandomHash( NextSampleIndex(1) ), lightingFunction );
+	}
+
+	//! Computes the illumination at the given position using the given accuracy parameter alpha.
+	//! This method provides stochastic sampling by randomly changing the given light position when calling the lighting function.
+	//! The random positions are generated by a counter-based random number generator, using the given sample index,
+	//! the level, and the index of the light. Therefore, the results only depend on the given parameters, and this method
+	//! can be called from multiple threads simultaneously with reproducible results, regardless of the number of threads.
+	//! Different sample indices (such as the index of a pixel sample) produce different random positions.
+	template <typename LightingFunction>
+	void Light( const Vec3f      &pos,						//!< The position where the lighting will be evaluated.
+	            float            alpha,						//!< The accuracy parameter. It should be 1 or greater. Larger values produce more accurate results with substantially more computation.
+	            int              stochasticShadowSamples,   //!< When this parameter is zero, the given lightingFunction is called once per light, using the position of the light. Otherwise, it is called as many times as this parameter specifies, using random positions around each light position.
+	            uint32_t         sampleIndex,				//!< The sample index used for generating the random positions.
+	            LightingFunction lightingFunction			//!< This function is called for each light used for lighting computation. It should be in the form void LightingFunction(int level, int light_id, const Vec3f &light_position, const Color &light_intensity).
+	          )
 	{
 		if ( numLevels > 1 ) {
 
@@ -148,8 +191,9 @@ public:
 			{
 				if ( stochasticShadowSamples > 0 ) {
 					Color cc = c / (float) stochasticShadowSamples;
+					uint32_t stream = RandomStream( sampleIndex, level, i );
 					for ( int j=0; j<stochasticShadowSamples; j++ ) {
-						Vec3f pj = p + RandomPos() * levels[level].pDev[i];
+						Vec3f pj = p + RandomPos( stream, j ) * levels[level].pDev[i];
 						lightingFunction( level, i, pj, cc );
 					}
 				} else {
@@ -185,7 +229,7 @@ public:
 				int id = levels[numLevels-1].pc.GetPointIndex(i);
 				Color c = levels[numLevels-1].colors[id];
 				if ( dist2 < rr ) c *= (sqrtf(dist2)-r_min)/r_min;
-				callLightingFunc( numLevels-1, i, p, c );
+				callLightingFunc( numLevels-1, id, p, c );
 			}
 
 		} else {
@@ -195,11 +239,258 @@ public:
 				const Vec3f &p = levels[0].pc.GetPoint(i);
 				int id = levels[0].pc.GetPointIndex(i);
 				Color c = levels[0].colors[id];
-				lightingFunction( 0, i, p, c );
+				lightingFunction( 0, id, p, c );
 			}
 		}
 	}
 
+	//! The lights used for lighting a position, stored as a structure of arrays for batch lighting computations.
+	class LightList
+	{
+	public:
+		LightList() : count(0) {}	//!< Constructor
+
+		int          Count () const { return count; }			//!< Returns the number of lights.
+		const int*   Level () const { return level.data(); }	//!< Returns the array of the level of each light.
+		const int*   ID    () const { return id.data(); }		//!< Returns the array of the index of each light at its level.
+		const float* PosX  () const { return x.data(); }		//!< Returns the array of the x coordinate of each light position.
+		const float* PosY  () const { return y.data(); }		//!< Returns the array of the y coordinate of each light position.
+		const float* PosZ  () const { return z.data(); }		//!< Returns the array of the z coordinate of each light position.
+		const float* IntensR() const { return r.data(); }		//!< Returns the array of the red component of each light intensity.
+		const float* IntensG() const { return g.data(); }		//!< Returns the array of the green component of each light intensity.
+		const float* IntensB() const { return b.data(); }		//!< Returns the array of the blue component of each light intensity.
+
+		void Clear() { count = 0; }	//!< Removes all lights, keeping the allocated memory.
+
+		//! Adds a light to the end of the list.
+		void Add( int lightLevel, int lightID, const Vec3f &p, const Color &c )
+		{
+			if ( count == (int) level.size() ) Grow();
+			level[count] = lightLevel;
+			id   [count] = lightID;
+			x[count] = p.x; y[count] = p.y; z[count] = p.z;
+			r[count] = c.r; g[count] = c.g; b[count] = c.b;
+			count++;
+		}
+
+	private:
+		int                count;
+		std::vector<int>   level, id;
+		std::vector<float> x, y, z, r, g, b;
+
+		void Grow()
+		{
+			size_t n = level.size() < 64 ? 64 : level.size()*2;
+			level.resize(n); id.resize(n);
+			x.resize(n); y.resize(n); z.resize(n);
+			r.resize(n); g.resize(n); b.resize(n);
+		}
+	};
+
+	//! Computes the illumination at the given positions using the given accuracy parameter alpha.
+	//! The lights used for each position are the same as the ones used by the Light method, but they are
+	//! passed to the given batchLightingFunction in groups using a LightList (see the other LightBatch method).
+	template <typename BatchLightingFunction>
+	void LightBatch( const Vec3f           *pos,					//!< The positions where the lighting will be evaluated.
+	                 int                   numPositions,			//!< The number of positions.
+	                 float                 alpha,					//!< The accuracy parameter. It should be 1 or greater. Larger values produce more accurate results with substantially more computation.
+	                 BatchLightingFunction batchLightingFunction	//!< This function is called one or more times for each position. It should be in the form void BatchLightingFunction(int position_index, const LightList &lights).
+	               )
+	{
+		LightBatch( pos, numPositions, alpha, 0, 0, batchLightingFunction );
+	}
+
+	//! Computes the illumination at the given positions using the given accuracy parameter alpha.
+	//! This method provides stochastic sampling by adding the lights to the LightList using random positions around them.
+	//! The random positions for the position with index i are generated using the sample index firstSampleIndex+i
+	//! (see the other LightBatch method), where firstSampleIndex is taken from a counter of the calling thread,
+	//! so each call produces new random positions. Use the other LightBatch method for reproducible results.
+	template <typename BatchLightingFunction>
+	void LightBatch( const Vec3f           *pos,						//!< The positions where the lighting will be evaluated.
+	                 int                   numPositions,				//!< The number of positions.
+	                 float                 alpha,						//!< The accuracy parameter. It should be 1 or greater. Larger values produce more accurate results with substantially more computation.
+	                 int                   stochasticShadowSamples,		//!< When this parameter is zero, each light is added to the LightList once, using the position of the light. Otherwise, it is added as many times as this parameter specifies, using random positions around each light position.
+	                 BatchLightingFunction batchLightingFunction		//!< This function is called one or more times for each position. It should be in the form void BatchLightingFunction(int position_index, const LightList &lights).
+	               )
+	{
+		LightBatch( pos, numPositions, alpha, stochasticShadowSamples, NextSampleIndex( uint32_t(numPositions) ), batchLightingFunction );
+	}
+
+	//! Computes the illumination at the given positions using the given accuracy parameter alpha.
+	//! The lights used for each position are the same as the ones used by the Light method, but they are
+	//! gathered in a LightList and passed to the given batchLightingFunction in groups of up to 256 lights,
+	//! so the batchLightingFunction is called one or more times for each position and it should accumulate
+	//! the lighting. It is called at least once for each position, even if no lights are used for it.
+	//! The lights of a level can be in a different order than the one used by the Light method.
+	//!
+	//! The positions are processed in parallel in tiles of nearby positions along their Morton order (Z-order).
+	//! For each tile and level, the lights that can illuminate any position in the tile are found with a single
+	//! query, and then they are tested for each position in the tile. All calls for the same position are
+	//! consecutive, but the batchLightingFunction can be called from multiple threads simultaneously.
+	//!
+	//! The random positions for the position with index i are the same as the ones generated by the Light method
+	//! with sample index firstSampleIndex+i, so the results do not depend on the number of threads.
+	template <typename BatchLightingFunction>
+	void LightBatch( const Vec3f           *pos,						//!< The positions where the lighting will be evaluated.
+	                 int                   numPositions,				//!< The number of positions.
+	                 float                 alpha,						//!< The accuracy parameter. It should be 1 or greater. Larger values produce more accurate results with substantially more computation.
+	                 int                   stochasticShadowSamples,		//!< When this parameter is zero, each light is added to the LightList once, using the position of the light. Otherwise, it is added as many times as this parameter specifies, using random positions around each light position.
+	                 uint32_t              firstSampleIndex,			//!< The sample index of the first position used for generating the random positions.
+	                 BatchLightingFunction batchLightingFunction		//!< This function is called one or more times for each position. It should be in the form void BatchLightingFunction(int position_index, const LightList &lights).
+	               )
+	{
+		if ( numPositions <= 0 || numLevels <= 0 ) return;
+
+		std::vector<int> order;
+		PointCloud<Vec3f,float,3,int>::SortQueries( numPositions, pos, order );
+
+		// The inner and outer radii of each level
+		std::vector<float> rMin( numLevels ), rMax( numLevels );
+		float r = alpha * cellSize;
+		rMin[0] = 0;
+		rMax[0] = r;
+		for ( int level=1; level<numLevels; level++ ) {
+			rMin[level] = r;
+			r *= 2;
+			rMax[level] = r;
+		}
+
+		struct Candidates {
+			std::vector<int>   id;
+			std::vector<float> x, y, z;
+			void Clear() { id.clear(); x.clear(); y.clear(); z.clear(); }
+		};
+		int const tileSize = 64;
+		int const listSize = 256;
+		int numTiles = ( numPositions + tileSize - 1 ) / tileSize;
+		ParallelFor( 0, numTiles, [&]( int tileBegin, int tileEnd ) {
+			LightList lights;
+			int  q = 0;				// the current position
+			bool flushed = false;	// whether the batchLightingFunction is called for the current position
+			std::vector<Candidates> candidates( numLevels );	// the lights of each level that can illuminate the positions in the tile
+			std::vector<char>       perPosition( numLevels );	// the levels that are queried for each position, since the tile is too large
+			std::vector<float>      candDist2;
+
+			auto addLight = [&]( int level, int id, const Vec3f &p, const Color &c )
+			{
+				if ( stochasticShadowSamples > 0 && level > 0 ) {
+					Color cc = c / (float) stochasticShadowSamples;
+					uint32_t stream = RandomStream( firstSampleIndex + uint32_t(q), level, id );
+					for ( int j=0; j<stochasticShadowSamples; j++ ) {
+						Vec3f pj = p + RandomPos( stream, j ) * levels[level].pDev[id];
+						lights.Add( level, id, pj, cc );
+						if ( lights.Count() == listSize ) { batchLightingFunction( q, lights ); lights.Clear(); flushed = true; }
+					}
+				} else {
+					lights.Add( level, id, p, c );
+					if ( lights.Count() == listSize ) { batchLightingFunction( q, lights ); lights.Clear(); flushed = true; }
+				}
+			};
+
+			// Computes the intensity of a light at the given distance, returns false if the light is not used
+			auto levelIntensity = [&]( int level, int id, float dist2, Color &c )
+			{
+				if ( numLevels == 1 ) {
+					c = levels[0].colors[id];
+					return true;
+				}
+				float r_min = rMin[level], r = rMax[level];
+				if ( level == 0 ) {
+					c = levels[0].colors[id];
+					if ( dist2 > r*r ) c *= 1 - (sqrtf(dist2)-r)/r;
+					return true;
+				}
+				if ( dist2 <= r_min*r_min ) return false;
+				c = levels[level].colors[id];
+				if ( level < numLevels-1 ) {
+					float d = sqrtf(dist2);
+					if ( d > r ) c *= 1 - (d-r)/r;
+					else c *= (d-r_min)/r_min;
+				} else {
+					if ( dist2 < r*r ) c *= (sqrtf(dist2)-r_min)/r_min;
+				}
+				return true;
+			};
+
+			for ( int tile=tileBegin; tile<tileEnd; tile++ ) {
+				int begin = tile * tileSize;
+				int end   = (std::min)( begin + tileSize, numPositions );
+
+				// Find the lights that can illuminate the tile
+				Vec3f boundMin = pos[ order[begin] ];
+				Vec3f boundMax = boundMin;
+				for ( int i=begin+1; i<end; i++ ) {
+					const Vec3f &p = pos[ order[i] ];
+					for ( int d=0; d<3; d++ ) {
+						if ( boundMin[d] > p[d] ) boundMin[d] = p[d];
+						if ( boundMax[d] < p[d] ) boundMax[d] = p[d];
+					}
+				}
+				Vec3f center = ( boundMin + boundMax ) / 2;
+				float halfDiag = ( boundMax - boundMin ).Length() / 2;
+				for ( int level=0; level<numLevels-1; level++ ) {
+					float radius = rMax[level]*2;
+					Candidates &cand = candidates[level];
+					cand.Clear();
+					perPosition[level] = halfDiag > radius;
+					if ( perPosition[level] ) continue;
+					levels[level].pc.GetPoints( center, ( radius + halfDiag ) * 1.001f, [&cand](int i, const Vec3f &p, float dist2, float &radius2) {
+						cand.id.push_back( i );
+						cand.x.push_back( p.x );
+						cand.y.push_back( p.y );
+						cand.z.push_back( p.z );
+					} );
+				}
+
+				// Light each position in the tile
+				for ( int k=begin; k<end; k++ ) {
+					q = order[k];
+					const Vec3f &position = pos[q];
+					flushed = false;
+					lights.Clear();
+					for ( int level=0; level<numLevels-1; level++ ) {
+						float radius = rMax[level]*2;
+						if ( perPosition[level] ) {
+							levels[level].pc.GetPoints( position, radius, [&](int i, const Vec3f &p, float dist2, float &radius2) {
+								Color c;
+								if ( levelIntensity( level, i, dist2, c ) ) addLight( level, i, p, c );
+							} );
+						} else {
+							float rr = radius * radius;
+							Candidates const &cand = candidates[level];
+							int nc = (int) cand.id.size();
+							candDist2.resize( nc );
+							float *d2 = candDist2.data();
+							const float *cx = cand.x.data(), *cy = cand.y.data(), *cz = cand.z.data();
+							_CY_IVDEP_FOR ( int j=0; j<nc; j++ ) {
+								float dx = position.x - cx[j];
+								float dy = position.y - cy[j];
+								float dz = position.z - cz[j];
+								d2[j] = dx*dx + dy*dy + dz*dz;
+							}
+							for ( int j=0; j<nc; j++ ) {
+								Color c;
+								if ( d2[j] < rr && levelIntensity( level, cand.id[j], d2[j], c ) ) addLight( level, cand.id[j], Vec3f(cx[j],cy[j],cz[j]), c );
+							}
+						}
+					}
+					// The highest level includes all lights
+					int level = numLevels-1;
+					PointCloud<Vec3f,float,3,int> const &pc = levels[level].pc;
+					int n = pc.GetPointCount();
+					for ( int i=0; i<n; i++ ) {
+						const Vec3f &p = pc.GetPoint(i);
+						float dist2 = (position - p).LengthSquared();
+						int id = pc.GetPointIndex(i);
+						Color c;
+						if ( levelIntensity( level, id, dist2, c ) ) addLight( level, id, p, c );
+					}
+					if ( lights.Count() > 0 || ! flushed ) batchLightingFunction( q, lights );
+				}
+			}
+		} );
+	}
+
 private:
 	struct Level {
 		Level() : colors(nullptr), pDev(nullptr) {}
@@ -212,28 +503,509 @@ private:
 	int    numLevels;
 	float  cellSize;
 
-	float RandomX()
+	// The grid and the parameters of the last build, kept for updates
+	Vec3f gridCorner;			// the corner of the grid
+	bool  topTrilinear;			// true if the lights are distributed to the 8 nodes around them at the highest level
+	int   lightCount;
+	float buildAutoFitScale;
+	float buildCellSize;
+	int   buildMinLevelLights;
+	int   buildHighestLevel;
+
+	// The hash function of the PCG random number generator, used as a counter-based random number generator
+	static uint32_t RandomHash( uint32_t v )
+	{
+		uint32_t state = v * 747796405u + 2891336453u;
+		uint32_t word = ( ( state >> ( ( state >> 28u ) + 4u ) ) ^ state ) * 277803737u;
+		return ( word >> 22u ) ^ word;
+	}
+
+	// Returns the random number stream for the given sample index and light
+	static uint32_t RandomStream( uint32_t sampleIndex, int level, int id )
 	{
-		static thread_local std::mt19937 generator;
-		std::uniform_real_distribution<float> distribution;
-		float x = distribution(generator);
-		float y = distribution(generator);
+		return RandomHash( sampleIndex ^ RandomHash( uint32_t(id) ^ RandomHash( uint32_t(level) ) ) );
+	}
+
+	// Returns the next sample index of the calling thread and advances it by the given count,
+	// so that the methods without a sample index use different random positions for each call
+	static uint32_t NextSampleIndex( uint32_t count )
+	{
+		static thread_local uint32_t next = 0;
+		uint32_t sampleIndex = next;
+		next += count;
+		return sampleIndex;
+	}
+
+	// Returns a sample index computed from the bits of the given position
+	static uint32_t PositionSampleIndex( const Vec3f &pos )
+	{
+		uint32_t b[3];
+		memcpy( b, &pos, sizeof(b) );
+		return RandomHash( b[0] ^ RandomHash( b[1] ^ RandomHash( b[2] ) ) );
+	}
+
+	// Returns a random value between -1 and 1 with a raised cosine distribution, using the given random bits
+	static float RandomX( uint32_t bitsX, uint32_t bitsY )
+	{
+		float x = float( bitsX >> 8 ) * ( 1.0f / 16777216.0f );
+		float y = float( bitsY >> 8 ) * ( 1.0f / 16777216.0f );
 		if ( y > (cosf(x*Pi<float>())+1)*0.5f ) x -= 1;
 		return x;
 	}
 
-	Vec3f RandomPos()
+	// Returns the random position offset of the given sample of the given random number stream
+	static Vec3f RandomPos( uint32_t stream, int sample )
 	{
+		uint32_t counter = stream + uint32_t(sample) * 6;
 		Vec3f p;
-		p.x = RandomX();
-		p.y = RandomX();
-		p.z = RandomX();
+		p.x = RandomX( RandomHash( counter   ), RandomHash( counter+1 ) );
+		p.y = RandomX( RandomHash( counter+2 ), RandomHash( counter+3 ) );
+		p.z = RandomX( RandomHash( counter+4 ), RandomHash( counter+5 ) );
 		return p;
 	}
 
+	struct Node {
+		Node() : position(0,0,0), color(0,0,0), stdev(0,0,0), weight(0) {}
+		Vec3f position;
+		Color color;
+#ifdef CY_LIGHTING_GRID_ORIG_POS
+		Vec3f origPos;
+#endif // CY_LIGHTING_GRID_ORIG_POS
+		Vec3f stdev;
+		float weight;
+		void AddLight( float w, const Vec3f &p, const Color &c )
+		{
+			weight   += w;
+			position += w * p;
+			color    += w * c;
+			stdev    += w * (p*p);
+		}
+		void Add( const Node &n )
+		{
+			weight   += n.weight;
+			position += n.position;
+			color    += n.color;
+			stdev    += n.stdev;
+		}
+		void Normalize()
+		{ 
+			if ( weight > 0 ) {
+				position /= weight;
+				stdev = stdev/weight - position*position;
+			}
+		}
+	};
+
+	// A grid node of a level, identified by the Morton code of its grid index
+	struct Cell {
+		uint64_t key;
+		Node     node;
+	};
+
+	static Vec3f GridIndex( IVec3i &index, const Vec3f &pos, float cellSize )
+	{
+		Vec3f normP = pos / cellSize;
+		index = IVec3i(normP);
+		return normP - Vec3f(index);
+	}
+
+	static uint64_t SpreadBits( uint64_t v )
+	{
+		v &= 0x1FFFFF;
+		v = ( v | v << 32 ) & 0x1F00000000FFFFull;
+		v = ( v | v << 16 ) & 0x1F0000FF0000FFull;
+		v = ( v | v <<  8 ) & 0x100F00F00F00F00Full;
+		v = ( v | v <<  4 ) & 0x10C30C30C30C30C3ull;
+		v = ( v | v <<  2 ) & 0x1249249249249249ull;
+		return v;
+	}
+
+	// The range of the cell indices along each axis that can be packed into the keys.
+	// The builds skip the levels that would have more cells along an axis.
+	static int const CellKeyRange = 1 << 21;
+
+	static uint64_t CellKey( int x, int y, int z )
+	{
+		assert( x >= 0 && y >= 0 && z >= 0 && x < CellKeyRange && y < CellKeyRange && z < CellKeyRange );
+		return SpreadBits(x) | ( SpreadBits(y) << 1 ) | ( SpreadBits(z) << 2 );
+	}
+
+	static int CompactBits( uint64_t v )
+	{
+		v &= 0x1249249249249249ull;
+		v = ( v | v >>  2 ) & 0x10C30C30C30C30C3ull;
+		v = ( v | v >>  4 ) & 0x100F00F00F00F00Full;
+		v = ( v | v >>  8 ) & 0x1F0000FF0000FFull;
+		v = ( v | v >> 16 ) & 0x1F00000000FFFFull;
+		v = ( v | v >> 32 ) & 0x1FFFFF;
+		return int(v);
+	}
+
+	// Merges the sorted cell lists from begin to end into the list at begin, adding the nodes of the cells with the same key.
+	// The lists are merged in a fixed order, so that the results do not depend on the number of threads.
+	static void MergeCells( std::vector< std::vector<Cell> > &lists, int begin, int end )
+	{
+		if ( end - begin < 2 ) return;
+		int mid = ( begin + end ) / 2;
+		ParallelInvoke( [&]{ MergeCells( lists, begin, mid ); }, [&]{ MergeCells( lists, mid, end ); } );
+		std::vector<Cell> &a = lists[begin];
+		std::vector<Cell> &b = lists[mid];
+		std::vector<Cell> merged;
+		merged.reserve( a.size() + b.size() );
+		size_t i = 0, j = 0;
+		while ( i < a.size() && j < b.size() ) {
+			if      ( a[i].key < b[j].key ) merged.push_back( a[i++] );
+			else if ( b[j].key < a[i].key ) merged.push_back( b[j++] );
+			else {
+				merged.push_back( a[i++] );
+				merged.back().node.Add( b[j++].node );
+			}
+		}
+		merged.insert( merged.end(), a.begin()+i, a.end() );
+		merged.insert( merged.end(), b.begin()+j, b.end() );
+		a.swap( merged );
+		std::vector<Cell>().swap( b );
+	}
+
+	// Adds the lights to the grid nodes of a level, given the order of the lights and the cell size of the level.
+	// If trilinear is true, each light is distributed to the 8 nodes around it. Otherwise, it is added to the node of its cell.
+	// Only the nodes that receive lights are generated and they are sorted by their keys.
+	// The lights are processed in parallel in chunks of consecutive lights, each of which accumulates its own nodes
+	// using a hash table, and then the nodes of the chunks are merged.
+	static void SplatLights( std::vector<Cell> &cells, const Vec3f *lightPos, const Color *lightColor, const std::vector<int> &order, const Vec3f &corner, float nodeCellSize, bool trilinear )
+	{
+		int numLights = (int) order.size();
+		int const chunkSize = 1024;
+		int const tableBits = 14;	// enough for 8 nodes per light in a chunk
+		int numChunks = ( numLights + chunkSize - 1 ) / chunkSize;
+		std::vector< std::vector<Cell> > chunkCells( numChunks );
+		ParallelFor( 0, numChunks, [&]( int chunkBegin, int chunkEnd ) {
+			std::vector<uint64_t> tableKey ( size_t(1) << tableBits );
+			std::vector<int>      tableCell( size_t(1) << tableBits, -1 );
+			for ( int chunk=chunkBegin; chunk<chunkEnd; chunk++ ) {
+				int begin = chunk * chunkSize;
+				int end   = (std::min)( begin + chunkSize, numLights );
+				std::vector<Cell> &chunkList = chunkCells[chunk];
+				auto addLight = [&]( uint64_t key, float w, const Vec3f &p, const Color &c )
+				{
+					size_t h = size_t( ( key * 0x9E3779B97F4A7C15ull ) >> ( 64 - tableBits ) );
+					while ( tableCell[h] >= 0 && tableKey[h] != key ) h = ( h + 1 ) & ( ( size_t(1) << tableBits ) - 1 );
+					if ( tableCell[h] < 0 ) {
+						tableKey [h] = key;
+						tableCell[h] = (int) chunkList.size();
+						Cell cell;
+						cell.key = key;
+						chunkList.push_back( cell );
+					}
+					chunkList[ tableCell[h] ].node.AddLight( w, p, c );
+				};
+				for ( int k=begin; k<end; k++ ) {
+					int i = order[k];
+					IVec3i index;
+					Vec3f interp = GridIndex( index, lightPos[i]-corner, nodeCellSize );
+					if ( ! trilinear ) {
+						addLight( CellKey( index.x, index.y, index.z ), 1, lightPos[i], lightColor[i] );
+						continue;
+					}
+					for ( int j=0; j<8; j++ ) {
+						float w = ((j&1) ? interp.x : (1-interp.x)) * ((j&2) ? interp.y : (1-interp.y)) * ((j&4) ? interp.z : (1-interp.z));
+						addLight( CellKey( index.x + (j&1), index.y + ((j>>1)&1), index.z + ((j>>2)&1) ), w, lightPos[i], lightColor[i] );
+					}
+				}
+				// Clear the hash table and sort the nodes
+				for ( size_t j=0; j<chunkList.size(); j++ ) {
+					size_t h = size_t( ( chunkList[j].key * 0x9E3779B97F4A7C15ull ) >> ( 64 - tableBits ) );
+					while ( tableKey[h] != chunkList[j].key ) h = ( h + 1 ) & ( ( size_t(1) << tableBits ) - 1 );
+					tableCell[h] = -1;
+				}
+				std::sort( chunkList.begin(), chunkList.end(), []( const Cell &a, const Cell &b ){ return a.key < b.key; } );
+			}
+		} );
+		MergeCells( chunkCells, 0, numChunks );
+		cells.swap( chunkCells[0] );
+		ParallelFor( size_t(0), cells.size(), [&]( size_t begin, size_t end ) {
+			for ( size_t i=begin; i<end; i++ ) {
+				cells[i].node.Normalize();
+#ifdef CY_LIGHTING_GRID_ORIG_POS
+				uint64_t key = cells[i].key;
+				cells[i].node.origPos = corner + Vec3f( float(CompactBits(key)), float(CompactBits(key>>1)), float(CompactBits(key>>2)) ) * nodeCellSize;
+#endif // CY_LIGHTING_GRID_ORIG_POS
+			}
+		}, size_t(4096) );
+	}
+
+	// Sets the lights of a level using the grid nodes with nonzero weights
+	static void SetLevel( Level &thisLevel, const std::vector<Cell> &levelNodes, bool normalize )
+	{
+		std::vector<Node> lights;
+		lights.reserve( levelNodes.size() );
+		for ( size_t i=0; i<levelNodes.size(); i++ ) {
+			if ( levelNodes[i].node.weight > 0 ) {
+				lights.push_back( levelNodes[i].node );
+				if ( normalize ) lights.back().Normalize();
+			}
+		}
+		int lightCount = (int) lights.size();
+		thisLevel.pc.BuildWithFunc( lightCount, [&lights]( int i ){ return lights[i].position; } );
+		delete [] thisLevel.colors;
+		delete [] thisLevel.pDev;
+		thisLevel.colors = new Color[ lightCount ];
+		thisLevel.pDev = new Vec3f[ lightCount ];
+		for ( int i=0; i<lightCount; i++ ) {
+			const Node &n = lights[i];
+			thisLevel.colors[i] = n.color;
+			thisLevel.pDev[i].x = sqrtf( n.stdev.x ) * Pi<float>();
+			thisLevel.pDev[i].y = sqrtf( n.stdev.y ) * Pi<float>();
+			thisLevel.pDev[i].z = sqrtf( n.stdev.z ) * Pi<float>();
+		}
+	}
+
+	// A light in the list of lights sorted by the keys of their level 1 cells.
+	// The lights in a cell of any level are consecutive in this list, since the key of a cell
+	// at a higher level is a prefix of the keys of the level 1 cells it contains.
+	struct SortedLight {
+		uint64_t key;
+		int      id;
+		bool operator < ( const SortedLight &s ) const { return key < s.key || ( key == s.key && id < s.id ); }
+	};
+
+	// The data generated by the first update after a build, which is used by the following updates
+	struct UpdateData {
+		std::vector<Vec3f>               lightPos;	// the light positions of the last update
+		std::vector<uint64_t>            lightKey;	// the key of the level 1 cell of each light
+		std::vector<SortedLight>         sorted;	// the lights sorted by their keys
+		std::vector< std::vector<Cell> > cells;		// the grid nodes of each level before normalization, sorted by their keys
+	};
+	UpdateData updateData;
+
+	bool Rebuild( const Vec3f *lightPos, const Color *lightColor, int numLights )
+	{
+		return DoBuild( lightPos, lightColor, numLights, buildAutoFitScale, buildMinLevelLights, buildCellSize, buildHighestLevel );
+	}
+
+	// Computes the key of the level 1 cell that contains the given position.
+	// Returns false if the position is outside of the range of the grid.
+	bool LevelOneKey( uint64_t &key, const Vec3f &pos ) const
+	{
+		Vec3f normP = ( pos - gridCorner ) / cellSize;
+		float const maxIndex = float( CellKeyRange - 1 );	// keeps the nodes at the far side of the cells within the range
+		if ( ! ( normP.x >= 0 && normP.y >= 0 && normP.z >= 0 && normP.x < maxIndex && normP.y < maxIndex && normP.z < maxIndex ) ) return false;
+		IVec3i index(normP);
+		key = CellKey( index.x, index.y, index.z );
+		return true;
+	}
+
+	// Finds the range of the sorted lights in the cell with the given key, where shift is three times the level of the cell minus one.
+	static void LightRange( const std::vector<SortedLight> &sorted, uint64_t key, int shift, size_t &begin, size_t &end )
+	{
+		auto keyLess = []( const SortedLight &s, uint64_t k ){ return s.key < k; };
+		begin = std::lower_bound( sorted.begin(), sorted.end(), key << shift, keyLess ) - sorted.begin();
+		end   = std::lower_bound( sorted.begin()+begin, sorted.end(), (key+1) << shift, keyLess ) - sorted.begin();
+	}
+
+	// Replaces the cells with the keys of the given sorted list of changed cells, removing the changed cells with zero weight.
+	static void MergeChangedCells( std::vector<Cell> &cells, const std::vector<Cell> &changedCells )
+	{
+		std::vector<Cell> merged;
+		merged.reserve( cells.size() + changedCells.size() );
+		size_t i = 0;
+		for ( size_t j=0; j<changedCells.size(); j++ ) {
+			uint64_t key = changedCells[j].key;
+			while ( i < cells.size() && cells[i].key < key ) merged.push_back( cells[i++] );
+			if ( i < cells.size() && cells[i].key == key ) i++;
+			if ( changedCells[j].node.weight > 0 ) merged.push_back( changedCells[j] );
+		}
+		merged.insert( merged.end(), cells.begin()+i, cells.end() );
+		cells.swap( merged );
+	}
+
+	// Updates the hierarchy using the grid of the last build. Returns false if a light is outside of the range of the grid.
+	// The grid nodes are accumulated in a fixed order, so that they only depend on the given lights.
+	bool DoUpdate( const Vec3f *lightPos, const Color *lightColor )
+	{
+		UpdateData &u = updateData;
+		int const numLights = lightCount;
+		int const blockSize = 4096;
+		int const numBlocks = ( numLights + blockSize - 1 ) / blockSize;
+		bool const firstUpdate = u.lightPos.empty();
+
+		// Compute the keys of the level 1 cells of the lights
+		std::vector<uint64_t> keys;
+		if ( numLevels > 1 ) {
+			keys.resize( numLights );
+			std::vector<char> blockValid( numBlocks, 1 );
+			ParallelFor( 0, numBlocks, [&]( int blockBegin, int blockEnd ) {
+				for ( int b=blockBegin; b<blockEnd; b++ ) {
+					int end = (std::min)( (b+1)*blockSize, numLights );
+					for ( int i=b*blockSize; i<end; i++ ) {
+						if ( ! LevelOneKey( keys[i], lightPos[i] ) ) { blockValid[b] = 0; break; }
+					}
+				}
+			} );
+			for ( int b=0; b<numBlocks; b++ ) if ( ! blockValid[b] ) return false;
+		}
+
+		// Find the lights with changed positions or intensities
+		std::vector<int> changed;
+		bool posChanged = firstUpdate;
+		if ( ! firstUpdate ) {
+			std::vector< std::vector<int> > blockChanged( numBlocks );
+			std::vector<char> blockPosChanged( numBlocks, 0 );
+			ParallelFor( 0, numBlocks, [&]( int blockBegin, int blockEnd ) {
+				for ( int b=blockBegin; b<blockEnd; b++ ) {
+					int end = (std::min)( (b+1)*blockSize, numLights );
+					for ( int i=b*blockSize; i<end; i++ ) {
+						bool moved = ! ( lightPos[i] == u.lightPos[i] );
+						if ( moved || lightColor[i] != levels[0].colors[i] ) {
+							blockChanged[b].push_back( i );
+							if ( moved ) blockPosChanged[b] = 1;
+						}
+					}
+				}
+			} );
+			for ( int b=0; b<numBlocks; b++ ) {
+				changed.insert( changed.end(), blockChanged[b].begin(), blockChanged[b].end() );
+				if ( blockPosChanged[b] ) posChanged = true;
+			}
+			if ( changed.empty() ) return true;
+		}
+
+		if ( numLevels > 1 ) {
+			// Update the sorted list of lights and find the level 1 cells that must be accumulated again.
+			// If there are too many changes, all cells are accumulated again.
+			bool const allDirty = firstUpdate || changed.size() > size_t(numLights/4);
+			std::vector<uint64_t> dirty;
+			if ( firstUpdate ) {
+				u.sorted.resize( numLights );
+				for ( int i=0; i<numLights; i++ ) {
+					u.sorted[i].key = keys[i];
+					u.sorted[i].id  = i;
+				}
+				std::sort( u.sorted.begin(), u.sorted.end() );
+				u.cells.resize( numLevels );
+			} else {
+				std::vector<SortedLight> moved;
+				for ( size_t j=0; j<changed.size(); j++ ) {
+					int i = changed[j];
+					if ( ! allDirty ) dirty.push_back( keys[i] );
+					if ( keys[i] != u.lightKey[i] ) {
+						if ( ! allDirty ) dirty.push_back( u.lightKey[i] );
+						SortedLight s = { keys[i], i };
+						moved.push_back( s );
+					}
+				}
+				if ( ! moved.empty() ) {
+					std::sort( moved.begin(), moved.end() );
+					std::vector<SortedLight> kept;
+					kept.reserve( numLights );
+					for ( size_t j=0; j<u.sorted.size(); j++ ) {
+						if ( u.sorted[j].key == keys[ u.sorted[j].id ] ) kept.push_back( u.sorted[j] );
+					}
+					std::merge( kept.begin(), kept.end(), moved.begin(), moved.end(), u.sorted.begin() );
+				}
+			}
+			if ( allDirty ) {
+				for ( size_t j=0; j<u.sorted.size(); j++ ) {
+					if ( j == 0 || u.sorted[j].key != u.sorted[j-1].key ) dirty.push_back( u.sorted[j].key );
+				}
+			} else {
+				std::sort( dirty.begin(), dirty.end() );
+				dirty.erase( std::unique( dirty.begin(), dirty.end() ), dirty.end() );
+			}
+
+			// Accumulate the nodes of the dirty cells of each level
+			for ( int level=1; level<numLevels; level++ ) {
+				int shift = 3 * (level-1);
+				if ( level > 1 ) {
+					// The cells that contain the dirty cells of the lower level
+					for ( size_t j=0; j<dirty.size(); j++ ) dirty[j] >>= 3;
+					dirty.erase( std::unique( dirty.begin(), dirty.end() ), dirty.end() );
+				}
+				std::vector<Cell> changedCells;
+				if ( level == numLevels-1 && topTrilinear ) {
+					// The nodes around the dirty cells receive the trilinear weights of the lights in the cells
+					std::vector<uint64_t> dirtyNodes;
+					dirtyNodes.reserve( dirty.size() * 8 );
+					for ( size_t j=0; j<dirty.size(); j++ ) {
+						int x = CompactBits( dirty[j] ), y = CompactBits( dirty[j]>>1 ), z = CompactBits( dirty[j]>>2 );
+						for ( int k=0; k<8; k++ ) dirtyNodes.push_back( CellKey( x + (k&1), y + ((k>>1)&1), z + ((k>>2)&1) ) );
+					}
+					std::sort( dirtyNodes.begin(), dirtyNodes.end() );
+					dirtyNodes.erase( std::unique( dirtyNodes.begin(), dirtyNodes.end() ), dirtyNodes.end() );
+					float const levelCellSize = cellSize * float( 1 << (level-1) );
+					changedCells.resize( dirtyNodes.size() );
+					ParallelFor( size_t(0), dirtyNodes.size(), [&]( size_t begin, size_t end ) {
+						for ( size_t j=begin; j<end; j++ ) {
+							Cell &cell = changedCells[j];
+							cell.key = dirtyNodes[j];
+							IVec3i node( CompactBits( cell.key ), CompactBits( cell.key>>1 ), CompactBits( cell.key>>2 ) );
+							for ( int k=0; k<8; k++ ) {
+								IVec3i c( node.x - (k&1), node.y - ((k>>1)&1), node.z - ((k>>2)&1) );
+								if ( c.x < 0 || c.y < 0 || c.z < 0 ) continue;
+								size_t lBegin, lEnd;
+								LightRange( u.sorted, CellKey( c.x, c.y, c.z ), shift, lBegin, lEnd );
+								for ( size_t l=lBegin; l<lEnd; l++ ) {
+									int i = u.sorted[l].id;
+									Vec3f interp = ( lightPos[i] - gridCorner ) / levelCellSize - Vec3f(c);
+									float w = ((k&1) ? interp.x : (1-interp.x)) * ((k&2) ? interp.y : (1-interp.y)) * ((k&4) ? interp.z : (1-interp.z));
+									cell.node.AddLight( w, lightPos[i], lightColor[i] );
+								}
+							}
+						}
+					}, size_t(16) );
+				} else {
+					changedCells.resize( dirty.size() );
+					ParallelFor( size_t(0), dirty.size(), [&]( size_t begin, size_t end ) {
+						for ( size_t j=begin; j<end; j++ ) {
+							Cell &cell = changedCells[j];
+							cell.key = dirty[j];
+							if ( level == 1 ) {
+								size_t lBegin, lEnd;
+								LightRange( u.sorted, cell.key, 0, lBegin, lEnd );
+								for ( size_t l=lBegin; l<lEnd; l++ ) {
+									int i = u.sorted[l].id;
+									cell.node.AddLight( 1, lightPos[i], lightColor[i] );
+								}
+							} else {
+								// Add the nodes of the cells of the lower level within this cell
+								const std::vector<Cell> &lower = u.cells[level-1];
+								auto keyLess = []( const Cell &c, uint64_t k ){ return c.key < k; };
+								auto it = std::lower_bound( lower.begin(), lower.end(), cell.key << 3, keyLess );
+								for ( ; it != lower.end() && (it->key >> 3) == cell.key; ++it ) cell.node.Add( it->node );
+							}
+						}
+					}, size_t(64) );
+				}
+				if ( allDirty ) u.cells[level].clear();
+				MergeChangedCells( u.cells[level], changedCells );
+				SetLevel( levels[level], u.cells[level], true );
+			}
+		}
+
+		// Update the lights of level 0 and keep them for the next update
+		if ( firstUpdate ) {
+			for ( int i=0; i<numLights; i++ ) levels[0].colors[i] = lightColor[i];
+			u.lightPos.assign( lightPos, lightPos + numLights );
+		} else {
+			for ( size_t j=0; j<changed.size(); j++ ) {
+				int i = changed[j];
+				levels[0].colors[i] = lightColor[i];
+				u.lightPos[i] = lightPos[i];
+			}
+		}
+		if ( posChanged ) levels[0].pc.Build( numLights, lightPos );
+		u.lightKey.swap( keys );
+		return true;
+	}
+
 	bool DoBuild( const Vec3f *lightPos, const Color *lightColor, int numLights, float autoFitScale, int minLevelLights, float cellSize=0, int highestLevel=10 )
 	{
 		Clear();
+		lightCount          = numLights;
+		buildAutoFitScale   = autoFitScale;
+		buildMinLevelLights = minLevelLights;
+		buildCellSize       = cellSize;
+		buildHighestLevel   = highestLevel;
 		if ( numLights <= 0 || highestLevel <= 0 ) return false;
 
 		// Compute the bounding box for the lighPoss
@@ -264,163 +1036,57 @@ private:
 				highestLevelMult = 1 << (highestLevel-1);
 				highestCellSize = cellSize * highestLevelMult;
 			}
-			highestGridRes = IVec3i(boundDif / highestCellSize) + 2;
+			Vec3f res = boundDif / highestCellSize;
+			if ( ! ( res.Max() < float( CellKeyRange - 2 ) ) ) return false;	// the cells cannot be indexed by the keys
+			highestGridRes = IVec3i(res) + 2;
 		}
+		if ( highestGridRes.Max() >= CellKeyRange ) return false;
 
-		struct Node {
-			Node() : position(0,0,0), color(0,0,0), weight(0), firstChild(-1) {}
-			Vec3f position;
-			Color color;
-#ifdef CY_LIGHTING_GRID_ORIG_POS
-			Vec3f origPos;
-#endif // CY_LIGHTING_GRID_ORIG_POS
-			Vec3f stdev;
-			float weight;
-			int firstChild;
-			void AddLight( float w, const Vec3f &p, const Color &c )
-			{
-				weight   += w;
-				position += w * p;
-				color    += w * c;
-				stdev    += w * (p*p);
-			}
-			void Normalize()
-			{ 
-				if ( weight > 0 ) {
-					position /= weight;
-					stdev = stdev/weight - position*position;
-				}
-			}
-		};
-
-		// Allocate the temporary nodes
+		// The grid nodes of each level are kept in sparse lists of cells, sorted by their Morton codes.
+		// The lights are also sorted in Morton order, so that the lights processed together affect nearby nodes.
 		numLevels = highestLevel+1;
-		std::vector< std::vector<Node> > nodes(numLevels);
-
-		auto gridIndex = []( IVec3i &index, const Vec3f &pos, float cellSize )
-		{
-			Vec3f normP = pos / cellSize;
-			index = IVec3i(normP);
-			return normP - Vec3f(index);
-		};
-
-		auto addLightToNodes = []( std::vector<Node> &nds, const int nodeIDs[8], const Vec3f &interp, const Vec3f &light_pos, const Color &light_color )
-		{
-			for ( int j=0; j<8; j++ ) {
-				float w = ((j&1) ? interp.x : (1-interp.x)) * ((j&2) ? interp.y : (1-interp.y)) * ((j&4) ? interp.z : (1-interp.z));
-				nds[ nodeIDs[j] ].AddLight( w, light_pos, light_color );
-			}
-		};
+		std::vector< std::vector<Cell> > nodes(numLevels);
+		std::vector<int> order;
+		PointCloud<Vec3f,float,3,int>::SortQueries( numLights, lightPos, order );
 
 		// Generate the grid for the highest level
 		Vec3f highestGridSize = Vec3f(highestGridRes-1) * highestCellSize;
 		Vec3f center = (boundMax + boundMin) / 2;
 		Vec3f corner = center - highestGridSize/2;
-		nodes[highestLevel].resize( highestGridRes.x * highestGridRes.y * highestGridRes.z );
-#ifdef CY_LIGHTING_GRID_ORIG_POS
-		for ( int z=0, j=0; z<highestGridRes.z; z++ ) {
-			for ( int y=0; y<highestGridRes.y; y++ ) {
-				for ( int x=0; x<highestGridRes.x; x++, j++ ) {
-					nodes[highestLevel][j].origPos = corner + Vec3f(x,y,z)*highestCellSize;
-				}
-			}
-		}
-#endif // CY_LIGHTING_GRID_ORIG_POS
-		for ( int i=0; i<numLights; i++ ) {
-			IVec3i index;
-			Vec3f interp = gridIndex( index, Vec3f(lightPos[i])-corner, highestCellSize );
-			int is = index.z*highestGridRes.y*highestGridRes.x + index.y*highestGridRes.x + index.x;
-			int nodeIDs[8] = {
-				is,
-				is + 1,
-				is + highestGridRes.x,
-				is + highestGridRes.x + 1,
-				is + highestGridRes.x*highestGridRes.y,
-				is + highestGridRes.x*highestGridRes.y + 1,
-				is + highestGridRes.x*highestGridRes.y + highestGridRes.x,
-				is + highestGridRes.x*highestGridRes.y + highestGridRes.x + 1,
-			};
-			for ( int j=0; j<8; j++ ) assert( nodeIDs[j] >= 0 && nodeIDs[j] < (int)nodes[highestLevel].size() );
-			addLightToNodes( nodes[highestLevel], nodeIDs, interp, lightPos[i], lightColor[i] );
-		}
-		for ( int i=0; i<(int)nodes[highestLevel].size(); i++ ) nodes[highestLevel][i].Normalize();
+		SplatLights( nodes[highestLevel], lightPos, lightColor, order, corner, highestCellSize, true );
 
 		// Generate the lower levels
 		float nodeCellSize = highestCellSize;
-		IVec3i gridRes = highestGridRes;
 		int levelSkip = 0;
+		int64_t levelGridRes = highestGridRes.Max();
 		for ( int level=highestLevel-1; level>0; level-- ) {
 			// Find the number of nodes for this level
 			int nodeCount = 0;
-			for ( int i=0; i<(int)nodes[level+1].size(); i++ ) {
-				if ( nodes[level+1][i].weight > 0 ) {
-					nodes[level+1][i].firstChild = nodeCount;
-					nodeCount += 8;
-				}
+			for ( size_t i=0; i<nodes[level+1].size(); i++ ) {
+				if ( nodes[level+1][i].node.weight > 0 ) nodeCount += 8;
 			}
 
-			if ( nodeCount > numLights/4 ) {
+			// Skip this level and the lower ones if they have too many nodes or their cells cannot be indexed by the keys
+			levelGridRes *= 2;
+			if ( nodeCount > numLights/4 || levelGridRes >= CellKeyRange ) {
 				levelSkip = level;
 				break;
 			}
 
-			nodes[level].resize( nodeCount );
-			// Add the lights to the nodes
+			// Add the lights to the nodes. Each light is added to the node of its cell, since the
+			// node of a cell receives all trilinear weights of the lights in the cell.
 			nodeCellSize /= 2;
-			gridRes *= 2;
-#ifdef CY_LIGHTING_GRID_ORIG_POS
-			for ( int i=0; i<(int)nodes[level+1].size(); i++ ) {
-				int fc = nodes[level+1][i].firstChild;
-				if ( fc < 0 ) continue;
-				for ( int z=0, j=0; z<2; z++ ) {
-					for ( int y=0; y<2; y++ ) {
-						for ( int x=0; x<2; x++, j++ ) {
-							nodes[level][fc+j].origPos = nodes[level+1][i].origPos + Vec3f(x,y,z)*nodeCellSize;
-						}
-					}
-				}
-			}
-#endif // CY_LIGHTING_GRID_ORIG_POS
-			for ( int i=0; i<numLights; i++ ) {
-				IVec3i index;
-				Vec3f interp = gridIndex( index, Vec3f(lightPos[i])-corner, nodeCellSize );
-				// find the node IDs
-				int nodeIDs[8];
-				index <<= level+2;
-				for ( int z=0, j=0; z<2; z++ ) {
-					int iz = index.z + z;
-					for ( int y=0; y<2; y++ ) {
-						int iy = index.y + y;
-						for ( int x=0; x<2; x++, j++ ) {
-							int ix = index.x + x;
-							int hix = ix >> (highestLevel+2);
-							int hiy = iy >> (highestLevel+2);
-							int hiz = iz >> (highestLevel+2);
-							int nid = hiz*highestGridRes.y*highestGridRes.x + hiy*highestGridRes.x + hix;
-							for ( int l=highestLevel-1; l>=level; l-- ) {
-								int ii = ((index.z >> l)&4) | ((index.y >> (l+1))&2) |  ((index.x >> (l+2))&1);
-								assert( nodes[l+1][nid].firstChild >= 0 );
-								nid = nodes[l+1][nid].firstChild + ii;
-								assert( nid >= 0 && nid < (int)nodes[l].size() );
-							}
-							nodeIDs[j] = nid;
-						}
-					}
-				}
-				addLightToNodes( nodes[level], nodeIDs, interp, lightPos[i], lightColor[i] );
-			}
-			for ( int i=0; i<(int)nodes[level].size(); i++ ) nodes[level][i].Normalize();
+			SplatLights( nodes[level], lightPos, lightColor, order, corner, nodeCellSize, false );
 		}
 
 		// Copy light data
 		numLevels = highestLevel + 1 - levelSkip;
-		int levelBaseSkip = 0;
 		// Skip levels that have two few lights (based on minLevelLights).
 		for ( int level=1; level<numLevels; level++ ) {
-			std::vector<Node> &levelNodes = nodes[level+levelSkip];
+			std::vector<Cell> &levelNodes = nodes[level+levelSkip];
 			int count = 0;
-			for ( int i=0; i<(int)levelNodes.size(); i++ ) {
-				if ( levelNodes[i].weight > 0 ) {
+			for ( size_t i=0; i<levelNodes.size(); i++ ) {
+				if ( levelNodes[i].node.weight > 0 ) {
 					count++;
 				}
 			}
@@ -432,28 +1098,8 @@ private:
 
 		levels = new Level[ numLevels ];
 		for ( int level=1; level<numLevels; level++ ) {
-			std::vector<Node> &levelNodes = nodes[level+levelSkip];
-			Level &thisLevel = levels[level];
-			std::vector<Vec3f> pos( levelNodes.size() );
-			int lightCount = 0;
-			for ( int i=0; i<(int)levelNodes.size(); i++ ) {
-				if ( levelNodes[i].weight > 0 ) {
-					pos[lightCount++] = levelNodes[i].position;
-				}
-			}
-			thisLevel.pc.Build( lightCount, pos.data() );
-			thisLevel.colors = new Color[ lightCount ];
-			thisLevel.pDev = new Vec3f[ lightCount ];
-			for ( int i=0, j=0; i<(int)levelNodes.size(); i++ ) {
-				if ( levelNodes[i].weight > 0 ) {
-					assert( j < lightCount );
-					thisLevel.colors[j] = levelNodes[i].color;
-					thisLevel.pDev[j].x = sqrtf( levelNodes[i].stdev.x ) * Pi<float>();
-					thisLevel.pDev[j].y = sqrtf( levelNodes[i].stdev.y ) * Pi<float>();
-					thisLevel.pDev[j].z = sqrtf( levelNodes[i].stdev.z ) * Pi<float>();
-					j++;
-				}
-			}
+			std::vector<Cell> &levelNodes = nodes[level+levelSkip];
+			SetLevel( levels[level], levelNodes, false );
 			levelNodes.resize(0);
 			levelNodes.shrink_to_fit();
 		}
@@ -466,6 +1112,10 @@ private:
 		levels[0].pc.Build( numLights, pos.data() );
 		this->cellSize = nodeCellSize;
 
+		// Keep the grid for updates
+		gridCorner   = corner;
+		topTrilinear = numLevels + levelSkip == highestLevel + 1;
+
 		return true;
 	}
 };
@@ -0,0 +1,140 @@
+// cyCodeBase by Cem Yuksel
+// [www.cemyuksel.com]
+//-------------------------------------------------------------------------------
+//! \file   cyMappedFile.h 
+//! \author Cem Yuksel
+//!
+//! \brief  Memory-mapped file class
+//! 
+//! This file includes a class that maps the contents of a file to memory,
+//! so that the file data can be accessed directly without reading or copying it.
+//! It uses mmap on POSIX systems and file mapping objects on Windows.
+//!
+//-------------------------------------------------------------------------------
+//
+// Copyright (c) 2016, Cem Yuksel <cem@cemyuksel.com>
+// All rights reserved.
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy 
+// of this software and associated documentation files (the "Software"), to deal 
+// in the Software without restriction, including without limitation the rights 
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+// copies of the Software, and to permit persons to whom the Software is 
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all 
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+// SOFTWARE.
+// 
+//-------------------------------------------------------------------------------
+
+#ifndef _CY_MAPPED_FILE_H_INCLUDED_
+#define _CY_MAPPED_FILE_H_INCLUDED_
+
+//-------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+//-------------------------------------------------------------------------------
+namespace cy {
+//-------------------------------------------------------------------------------
+
+//! Memory-mapped file class.
+//!
+//! Maps the entire contents of a file to memory. The operating system loads the pages
+//! of the file on demand, so opening even a very large file is fast and the parts of the
+//! file that are never accessed are never read. The mapping is kept until Close is called
+//! or the object is destroyed, so pointers to the file data must not be used after that.
+
+class MappedFile
+{
+public:
+	MappedFile() : data(nullptr), size(0) {}
+	virtual ~MappedFile() { Close(); }
+
+	//! Maps the file with the given name to memory. Returns false if the file cannot be opened or is empty.
+	//! If copyOnWrite is true, the mapped data can be modified, but the modifications are private
+	//! to this process and they are never written back to the file. Otherwise, the data is read-only.
+	bool Open( char const *filename, bool copyOnWrite=false )
+	{
+		Close();
+#ifdef _WIN32
+		HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+		if ( file == INVALID_HANDLE_VALUE ) return false;
+		LARGE_INTEGER fileSize;
+		if ( GetFileSizeEx( file, &fileSize ) && fileSize.QuadPart > 0 ) {
+			HANDLE mapping = CreateFileMappingA( file, nullptr, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr );
+			if ( mapping ) {
+				data = MapViewOfFile( mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0 );
+				if ( data ) size = (size_t) fileSize.QuadPart;
+				CloseHandle( mapping );
+			}
+		}
+		CloseHandle( file );
+#else
+		int fd = open( filename, O_RDONLY );
+		if ( fd < 0 ) return false;
+		struct stat fileStat;
+		if ( fstat( fd, &fileStat ) == 0 && fileStat.st_size > 0 ) {
+			void *d = mmap( nullptr, (size_t) fileStat.st_size, copyOnWrite ? PROT_READ|PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0 );
+			if ( d != MAP_FAILED ) {
+				data = d;
+				size = (size_t) fileStat.st_size;
+			}
+		}
+		close( fd );
+#endif
+		return data != nullptr;
+	}
+
+	//! Unmaps the file data.
+	void Close()
+	{
+		if ( data == nullptr ) return;
+#ifdef _WIN32
+		UnmapViewOfFile( data );
+#else
+		munmap( data, size );
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	bool        IsOpen () const { return data != nullptr; }	//!< Returns true if a file is mapped.
+	size_t      GetSize() const { return size; }				//!< Returns the size of the mapped file in bytes.
+	void const* GetData() const { return data; }				//!< Returns the mapped file data.
+	void*       GetData()       { return data; }				//!< Returns the mapped file data. It can be modified only if the file is opened with copyOnWrite.
+
+private:
+	void  *data;	//!< the mapped file data
+	size_t size;	//!< the size of the mapped file data
+
+	MappedFile( MappedFile const & ) = delete;
+	MappedFile& operator = ( MappedFile const & ) = delete;
+};
+
+//-------------------------------------------------------------------------------
+} // namespace cy
+//-------------------------------------------------------------------------------
+
+typedef cy::MappedFile cyMappedFile;	//!< Memory-mapped file class
+
+//-------------------------------------------------------------------------------
+
+#endif
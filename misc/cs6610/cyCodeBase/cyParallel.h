@@ -0,0 +1,263 @@
+// cyCodeBase by Cem Yuksel
+// [www.cemyuksel.com]
+//-------------------------------------------------------------------------------
+//! \file   cyParallel.h 
+//! \author Cem Yuksel
+//!
+//! \brief  Parallel execution helpers
+//! 
+//! This file includes functions for executing tasks in parallel. The tasks are
+//! executed using Intel's Thread Building Library (TBB) or Microsoft's Parallel
+//! Patterns Library (PPL), if tbb.h or ppl.h is included prior to including
+//! cyParallel.h. Otherwise, they are executed by a work-stealing pool of
+//! std::thread workers.
+//!
+//-------------------------------------------------------------------------------
+//
+// Copyright (c) 2016, Cem Yuksel <cem@cemyuksel.com>
+// All rights reserved.
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy 
+// of this software and associated documentation files (the "Software"), to deal 
+// in the Software without restriction, including without limitation the rights 
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+// copies of the Software, and to permit persons to whom the Software is 
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all 
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+// SOFTWARE.
+// 
+//-------------------------------------------------------------------------------
+
+#ifndef _CY_PARALLEL_H_INCLUDED_
+#define _CY_PARALLEL_H_INCLUDED_
+
+//-------------------------------------------------------------------------------
+
+#ifndef _CY_PARALLEL_LIB
+# ifdef __TBB_tbb_H
+#  define _CY_PARALLEL_LIB tbb
+# elif defined(_PPL_H)
+#  define _CY_PARALLEL_LIB concurrency
+# endif
+#endif
+
+//-------------------------------------------------------------------------------
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+//-------------------------------------------------------------------------------
+namespace cy {
+//-------------------------------------------------------------------------------
+
+//! Returns the number of hardware threads that can be used for parallel execution.
+inline int GetThreadCount()
+{
+	static int const n = std::thread::hardware_concurrency() > 0 ? (int) std::thread::hardware_concurrency() : 1;
+	return n;
+}
+
+//! A pool of worker threads that execute the tasks of ParallelInvoke using work stealing.
+//!
+//! Each thread has its own task queue. A thread adds its new tasks to the back of its queue and,
+//! when it needs to wait for a task, it first tries to take the task back from its queue, so that
+//! nested tasks are executed in depth-first order with good cache locality. Idle threads steal the
+//! oldest tasks from the front of the other queues, which are typically the largest ones.
+//! Threads that wait for a stolen task keep executing other tasks instead of blocking.
+//! The pool has one less worker than the hardware thread count, since the calling thread also works.
+
+class ThreadPool
+{
+public:
+	//! A task that is executed once by a thread of the pool. The task data is kept by the caller,
+	//! which must wait until the task is done (see Wait) before releasing it.
+	class Task
+	{
+	public:
+		template <typename FUNC> explicit Task( FUNC const &f ) : func(&f), run(&Call<FUNC>), done(false) {}
+		bool IsDone() const { return done.load( std::memory_order_acquire ); }
+	private:
+		void const *func;
+		void (*run)( void const * );
+		std::atomic<bool> done;
+		template <typename FUNC> static void Call( void const *f ) { (*static_cast<FUNC const*>(f))(); }
+		void Execute() { run(func); done.store( true, std::memory_order_release ); }
+		friend class ThreadPool;
+	};
+
+	//! Returns the global thread pool.
+	static ThreadPool& Get() { static ThreadPool pool( GetThreadCount()-1 ); return pool; }
+
+	//! Returns the number of worker threads.
+	int GetWorkerCount() const { return (int) workers.size(); }
+
+	//! Adds the given task to the queue of the current thread.
+	void Push( Task *task )
+	{
+		Queue &q = queues[ QueueIndex() ];
+		{
+			std::lock_guard<std::mutex> lock( q.mutex );
+			q.tasks.push_back( task );
+		}
+		pendingTasks.fetch_add( 1 );
+		std::lock_guard<std::mutex> lock( sleepMutex );
+		sleepCondition.notify_one();
+	}
+
+	//! Waits until the given task, which must be the last task pushed by the current thread, is done.
+	//! If the task is still in the queue, it is executed by the current thread.
+	//! Otherwise, the current thread executes other tasks until the thread that stole the task finishes it.
+	void Wait( Task *task )
+	{
+		Queue &q = queues[ QueueIndex() ];
+		bool own = false;
+		{
+			std::lock_guard<std::mutex> lock( q.mutex );
+			if ( ! q.tasks.empty() && q.tasks.back() == task ) {
+				q.tasks.pop_back();
+				own = true;
+			}
+		}
+		if ( own ) {
+			pendingTasks.fetch_sub( 1 );
+			task->Execute();
+			return;
+		}
+		while ( ! task->IsDone() ) {
+			Task *t = Steal( QueueIndex() );
+			if ( t ) t->Execute();
+			else std::this_thread::yield();
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock( sleepMutex );
+			stop = true;
+			sleepCondition.notify_all();
+		}
+		for ( size_t i=0; i<workers.size(); i++ ) workers[i].join();
+		delete [] queues;
+	}
+
+private:
+	struct Queue
+	{
+		std::mutex         mutex;
+		std::deque<Task*>  tasks;
+	};
+
+	std::vector<std::thread> workers;
+	Queue                   *queues;	// one queue for each worker, followed by a shared queue for all other threads
+	int                      numQueues;
+	std::atomic<int>         pendingTasks;
+	std::mutex               sleepMutex;
+	std::condition_variable  sleepCondition;
+	bool                     stop;
+
+	explicit ThreadPool( int numWorkers ) : queues(nullptr), numQueues(0), pendingTasks(0), stop(false)
+	{
+		if ( numWorkers < 0 ) numWorkers = 0;
+		numQueues = numWorkers + 1;
+		queues = new Queue[ numQueues ];
+		for ( int i=0; i<numWorkers; i++ ) workers.push_back( std::thread( [this,i]{ WorkerLoop(i); } ) );
+	}
+	ThreadPool( ThreadPool const & ) = delete;
+	ThreadPool& operator = ( ThreadPool const & ) = delete;
+
+	static int& WorkerIndex() { static thread_local int index = -1; return index; }
+	int QueueIndex() const { int i = WorkerIndex(); return i >= 0 ? i : numQueues-1; }
+
+	// Takes a task from the front of another queue, starting with the one after the given queue.
+	Task* Steal( int queueIndex )
+	{
+		if ( pendingTasks.load() <= 0 ) return nullptr;
+		for ( int j=1; j<=numQueues; j++ ) {
+			Queue &q = queues[ (queueIndex+j) % numQueues ];
+			std::lock_guard<std::mutex> lock( q.mutex );
+			if ( ! q.tasks.empty() ) {
+				Task *t = q.tasks.front();
+				q.tasks.pop_front();
+				pendingTasks.fetch_sub( 1 );
+				return t;
+			}
+		}
+		return nullptr;
+	}
+
+	void WorkerLoop( int index )
+	{
+		WorkerIndex() = index;
+		for (;;) {
+			Task *t = Steal( index );
+			if ( t ) {
+				t->Execute();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock( sleepMutex );
+			sleepCondition.wait( lock, [this]{ return stop || pendingTasks.load() > 0; } );
+			if ( stop ) break;
+		}
+	}
+};
+
+//! Calls the given two functions, potentially in parallel, and returns after both functions return.
+//! The functions are called using parallel_invoke of TBB or PPL, if one of them is included before
+//! cyParallel.h. Otherwise, the first function is added to the task queue of the global ThreadPool,
+//! where an idle worker thread can steal it, while the current thread calls the second function.
+template <typename FUNC1, typename FUNC2>
+inline void ParallelInvoke( FUNC1 const &func1, FUNC2 const &func2 )
+{
+#ifdef _CY_PARALLEL_LIB
+	_CY_PARALLEL_LIB::parallel_invoke( func1, func2 );
+#else
+	ThreadPool &pool = ThreadPool::Get();
+	if ( pool.GetWorkerCount() == 0 ) {
+		func1();
+		func2();
+		return;
+	}
+	ThreadPool::Task task( func1 );
+	pool.Push( &task );
+	func2();
+	pool.Wait( &task );
+#endif
+}
+
+//! Splits the given range into sub-ranges, no smaller than grainSize, and calls the given
+//! function for each sub-range, potentially in parallel. The function must be in the following form:
+//!
+//! void RangeFunction( SIZE_TYPE rangeBegin, SIZE_TYPE rangeEnd )
+template <typename SIZE_TYPE, typename RANGE_FUNC>
+inline void ParallelFor( SIZE_TYPE begin, SIZE_TYPE end, RANGE_FUNC const &rangeFunc, SIZE_TYPE grainSize=1 )
+{
+	if ( end - begin < 2*grainSize || end - begin < 2 ) {
+		if ( begin < end ) rangeFunc( begin, end );
+		return;
+	}
+	SIZE_TYPE mid = begin + ( end - begin ) / 2;
+	ParallelInvoke(
+		[&]{ ParallelFor( begin, mid, rangeFunc, grainSize ); },
+		[&]{ ParallelFor( mid,   end, rangeFunc, grainSize ); }
+	);
+}
+
+//-------------------------------------------------------------------------------
+} // namespace cy
+//-------------------------------------------------------------------------------
+
+#endif
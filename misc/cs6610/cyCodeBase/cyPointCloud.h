@@ -63,9 +63,22 @@
 
 //-------------------------------------------------------------------------------
 
+#ifndef CY_POINT_CLOUD_MAX_LEAF_SIZE
+#define CY_POINT_CLOUD_MAX_LEAF_SIZE 32	//!< Determines the maximum number of points in a leaf node of a k-d tree with bucketed leaf nodes
+#endif
+
+#ifndef CY_POINT_CLOUD_INSERT_BUFFER_SIZE
+#define CY_POINT_CLOUD_INSERT_BUFFER_SIZE 64	//!< Determines the maximum number of inserted points that are searched without a k-d tree
+#endif
+
+//-------------------------------------------------------------------------------
+
 #include <cassert>
 #include <algorithm>
 #include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include "cyParallel.h"
 
 //-------------------------------------------------------------------------------
 namespace cy {
@@ -82,9 +95,9 @@ public:
 	/////////////////////////////////////////////////////////////////////////////////
 	//!@name Constructors and Destructor
 
-	PointCloud() : points(nullptr), pointCount(0) {}
-	PointCloud( SIZE_TYPE numPts, PointType const *pts, SIZE_TYPE const *customIndices=nullptr ) : points(nullptr), pointCount(0) { Build(numPts,pts,customIndices); }
-	~PointCloud() { delete [] points; }
+	PointCloud() : points(nullptr), pointCount(0), numInternal(0), leafSize(1), numLeaves(0), splits(nullptr), leafStart(nullptr), coords(nullptr), numIndexedInserted(0), numInsertedRemoved(0), numRemoved(0), rebuildFraction(FType(0.1)), rebuildMinCount(256) {}
+	PointCloud( SIZE_TYPE numPts, PointType const *pts, SIZE_TYPE const *customIndices=nullptr ) : points(nullptr), pointCount(0), numInternal(0), leafSize(1), numLeaves(0), splits(nullptr), leafStart(nullptr), coords(nullptr), numIndexedInserted(0), numInsertedRemoved(0), numRemoved(0), rebuildFraction(FType(0.1)), rebuildMinCount(256) { if ( customIndices ) Build(numPts,pts,customIndices); else Build(numPts,pts); }
+	~PointCloud() { delete [] points; ClearBuckets(); ClearInserted(); }
 
 	/////////////////////////////////////////////////////////////////////////////////
 	//!@ Access to internal data
@@ -96,47 +109,89 @@ public:
 	/////////////////////////////////////////////////////////////////////////////////
 	//!@ Initialization
 
+	//! Sets the maximum number of points in each leaf node of the k-d tree, which is used by the next Build call.
+	//! By default, the leaf size is one and each k-d tree node keeps a single point.
+	//! With a larger leaf size (typically 8 to 32), the tree is shallower and the points of each leaf node are kept
+	//! in a contiguous structure-of-arrays block, so a query scans them in a tight loop that the compiler can vectorize,
+	//! instead of descending to single-point leaves. This is often faster for large point clouds,
+	//! especially for radius queries, but it also keeps a second copy of the point positions.
+	//! The leaf size cannot be larger than CY_POINT_CLOUD_MAX_LEAF_SIZE.
+	void SetLeafSize( SIZE_TYPE maxPointsPerLeaf ) { leafSize = maxPointsPerLeaf < 1 ? 1 : ( maxPointsPerLeaf > CY_POINT_CLOUD_MAX_LEAF_SIZE ? CY_POINT_CLOUD_MAX_LEAF_SIZE : maxPointsPerLeaf ); }
+
+	//! Returns the maximum number of points in each leaf node of the k-d tree.
+	SIZE_TYPE GetLeafSize() const { return leafSize; }
+
 	//! Builds a k-d tree for the given points.
 	//! The positions are stored internally.
 	//! The build is parallelized using Intel's Thread Building Library (TBB) or Microsoft's Parallel Patterns Library (PPL),
-	//! if ttb.h or ppl.h is included prior to including cyPointCloud.h.
+	//! if tbb.h or ppl.h is included prior to including cyPointCloud.h, or using the std::thread pool of cyParallel.h otherwise.
 	void Build( SIZE_TYPE numPts, PointType const *pts ) { BuildWithFunc( numPts, [&pts](SIZE_TYPE i){ return pts[i]; } ); }
 
 	//! Builds a k-d tree for the given points.
 	//! The positions are stored internally, along with the indices to the given array.
 	//! The build is parallelized using Intel's Thread Building Library (TBB) or Microsoft's Parallel Patterns Library (PPL),
-	//! if ttb.h or ppl.h is included prior to including cyPointCloud.h.
+	//! if tbb.h or ppl.h is included prior to including cyPointCloud.h, or using the std::thread pool of cyParallel.h otherwise.
 	void Build( SIZE_TYPE numPts, PointType const *pts, SIZE_TYPE const *customIndices ) { BuildWithFunc( numPts, [&pts](SIZE_TYPE i){ return pts[i]; }, [&customIndices](SIZE_TYPE i){ return customIndices[i]; } ); }
 
 	//! Builds a k-d tree for the given points.
 	//! The positions are stored internally, retrieved from the given function.
 	//! The build is parallelized using Intel's Thread Building Library (TBB) or Microsoft's Parallel Patterns Library (PPL),
-	//! if ttb.h or ppl.h is included prior to including cyPointCloud.h.
+	//! if tbb.h or ppl.h is included prior to including cyPointCloud.h, or using the std::thread pool of cyParallel.h otherwise.
 	template <typename PointPosFunc>
 	void BuildWithFunc( SIZE_TYPE numPts, PointPosFunc ptPosFunc ) { BuildWithFunc(numPts, ptPosFunc, [](SIZE_TYPE i){ return i; }); }
 
 	//! Builds a k-d tree for the given points.
 	//! The positions are stored internally, along with the indices to the given array.
-	//! The positions and custom indices are retrieved from the given functions.
+	//! The positions and custom indices are retrieved from the given functions,
+	//! which can be called from multiple threads at the same time.
 	//! The build is parallelized using Intel's Thread Building Library (TBB) or Microsoft's Parallel Patterns Library (PPL),
-	//! if ttb.h or ppl.h is included prior to including cyPointCloud.h.
+	//! if tbb.h or ppl.h is included prior to including cyPointCloud.h, or using the std::thread pool of cyParallel.h otherwise.
 	template <typename PointPosFunc, typename CustomIndexFunc>
 	void BuildWithFunc( SIZE_TYPE numPts, PointPosFunc ptPosFunc, CustomIndexFunc custIndexFunc )
 	{
 		if ( points ) delete [] points;
+		ClearBuckets();
+		ClearInserted();
+		treeSlots.clear();
+		removedFlags.clear();
+		numRemoved = 0;
 		pointCount = numPts;
 		if ( pointCount == 0 ) { points = nullptr; return; }
 		points = new PointData[(pointCount|1)+1];
 		PointData *orig = new PointData[pointCount];
-		PointType boundMin( (std::numeric_limits<FType>::max)() ), boundMax( (std::numeric_limits<FType>::min)() );
-		for ( SIZE_TYPE i=0; i<pointCount; i++ ) {
-			PointType p = ptPosFunc(i);
-			orig[i].Set( p, custIndexFunc(i) );
+
+		// Gather the points and compute their bounding box in parallel, using a separate box for each block of points
+		SIZE_TYPE const blockSize = 4096;
+		SIZE_TYPE const numBlocks = (pointCount + blockSize - 1) / blockSize;
+		std::vector<PointType> blockMin( numBlocks, PointType( (std::numeric_limits<FType>::max)() ) );
+		std::vector<PointType> blockMax( numBlocks, PointType( std::numeric_limits<FType>::lowest() ) );
+		ParallelFor( SIZE_TYPE(0), numBlocks, [&]( SIZE_TYPE blockBegin, SIZE_TYPE blockEnd ) {
+			for ( SIZE_TYPE b=blockBegin; b<blockEnd; b++ ) {
+				PointType &bMin = blockMin[b];
+				PointType &bMax = blockMax[b];
+				SIZE_TYPE iEnd = (std::min)( (b+1)*blockSize, pointCount );
+				for ( SIZE_TYPE i=b*blockSize; i<iEnd; i++ ) {
+					PointType p = ptPosFunc(i);
+					orig[i].Set( p, custIndexFunc(i) );
+					for ( int j=0; j<DIMENSIONS; j++ ) {
+						if ( bMin[j] > p[j] ) bMin[j] = p[j];
+						if ( bMax[j] < p[j] ) bMax[j] = p[j];
+					}
+				}
+			}
+		} );
+		PointType boundMin = blockMin[0], boundMax = blockMax[0];
+		for ( SIZE_TYPE b=1; b<numBlocks; b++ ) {
 			for ( int j=0; j<DIMENSIONS; j++ ) {
-				if ( boundMin[j] > p[j] ) boundMin[j] = p[j];
-				if ( boundMax[j] < p[j] ) boundMax[j] = p[j];
+				if ( boundMin[j] > blockMin[b][j] ) boundMin[j] = blockMin[b][j];
+				if ( boundMax[j] < blockMax[b][j] ) boundMax[j] = blockMax[b][j];
 			}
 		}
+		if ( leafSize > 1 ) {
+			BuildBuckets( orig, boundMin, boundMax );
+			delete [] orig;
+			return;
+		}
 		BuildKDTree( orig, boundMin, boundMax, 1, 0, pointCount );
 		delete [] orig;
 		if ( (pointCount & 1) == 0 ) {
@@ -148,16 +203,96 @@ public:
 
 	//! Returns true if the Build or BuildWithFunc methods would perform the build in parallel using multi-threading.
 	//! The build is parallelized using Intel's Thread Building Library (TBB) or Microsoft's Parallel Patterns Library (PPL),
-	//! if ttb.h or ppl.h are included prior to including cyPointCloud.h.
+	//! if tbb.h or ppl.h are included prior to including cyPointCloud.h, or using the std::thread pool of cyParallel.h otherwise.
 	static bool IsBuildParallel()
 	{
 #ifdef _CY_PARALLEL_LIB
 		return true;
 #else
-		return false;
+		return GetThreadCount() > 1;
 #endif
 	}
 
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@ Dynamic updates
+	//!
+	//! The following methods update the point cloud without rebuilding the k-d tree after each change.
+	//! The points are identified by their custom indices, so the custom indices of the points must be unique.
+	//! Up to CY_POINT_CLOUD_INSERT_BUFFER_SIZE inserted points are kept in a buffer and searched one by one.
+	//! When the buffer is full, its points are moved to a separate, smaller k-d tree. These k-d trees are merged,
+	//! such that each one has more than twice as many points as the next one, so there are only a logarithmic number of them
+	//! and each inserted point is part of a logarithmic number of k-d tree builds until the main k-d tree is rebuilt.
+	//! The removed points of the k-d trees are marked, so that the search methods skip them.
+	//! Once the number of changes exceeds the rebuild threshold, the main k-d tree is rebuilt with the current points.
+	//! These methods must not be called while other threads are searching.
+
+	//! Inserts the given points with the given custom indices.
+	//! The custom index of an inserted point must not be used by another point, unless that point is removed first.
+	void Insert( SIZE_TYPE numPts, PointType const *pts, SIZE_TYPE const *customIndices )
+	{
+		for ( SIZE_TYPE i=0; i<numPts; i++ ) {
+			PointData p;
+			p.Set( pts[i], customIndices[i] );
+			insertedSlot[ customIndices[i] ] = SIZE_TYPE( insertedPoints.size() );
+			insertedPoints.push_back( p );
+			insertedRemoved.push_back( 0 );
+		}
+		if ( ! RebuildIfNeeded() && insertedPoints.size() - numIndexedInserted >= CY_POINT_CLOUD_INSERT_BUFFER_SIZE ) MergeInsertedClouds();
+	}
+
+	//! Inserts the given point with the given custom index.
+	//! The custom index of an inserted point must not be used by another point, unless that point is removed first.
+	void Insert( PointType const &pt, SIZE_TYPE customIndex ) { Insert( 1, &pt, &customIndex ); }
+
+	//! Removes the points with the given custom indices.
+	void Remove( SIZE_TYPE numPts, SIZE_TYPE const *customIndices )
+	{
+		for ( SIZE_TYPE i=0; i<numPts; i++ ) {
+			SIZE_TYPE index = customIndices[i];
+			auto inserted = insertedSlot.find( index );
+			if ( inserted != insertedSlot.end() ) {
+				RemoveInserted( inserted->second );
+				insertedSlot.erase( inserted );
+				continue;
+			}
+			// Mark the point in the k-d tree as removed
+			SIZE_TYPE slot;
+			if ( FindTreeSlot( index, slot ) && ! removedFlags[slot] ) {
+				removedFlags[slot] = 1;
+				numRemoved++;
+			}
+		}
+		RebuildIfNeeded();
+	}
+
+	//! Removes the point with the given custom index.
+	void Remove( SIZE_TYPE customIndex ) { Remove( 1, &customIndex ); }
+
+	//! Moves the point with the given custom index to the given position.
+	void Move( SIZE_TYPE customIndex, PointType const &pt ) { Remove( customIndex ); Insert( pt, customIndex ); }
+
+	//! Sets the threshold for rebuilding the k-d tree after dynamic updates. The k-d tree is rebuilt when
+	//! the number of inserted and removed points exceeds both the given fraction of the number of points
+	//! in the k-d tree and the given minimum count. The default values are 0.1 and 256.
+	void SetRebuildThreshold( FType fraction, SIZE_TYPE minCount=256 ) { rebuildFraction=fraction; rebuildMinCount=minCount; }
+
+	//! Returns the number of inserted or removed points since the k-d tree was last built.
+	SIZE_TYPE GetPendingUpdateCount() const { return SIZE_TYPE( insertedPoints.size() - numInsertedRemoved ) + numRemoved; }
+
+	//! Rebuilds the k-d tree with the current points, including the inserted points and excluding the removed ones.
+	void Rebuild()
+	{
+		std::vector<PointData> current;
+		current.reserve( pointCount + insertedPoints.size() );
+		for ( SIZE_TYPE i=1; i<=pointCount; i++ ) {
+			if ( numRemoved == 0 || ! removedFlags[i] ) current.push_back( points[i] );
+		}
+		for ( size_t j=0; j<insertedPoints.size(); j++ ) {
+			if ( ! insertedRemoved[j] ) current.push_back( insertedPoints[j] );
+		}
+		BuildWithFunc( SIZE_TYPE(current.size()), [&current](SIZE_TYPE i){ return current[i].Pos(); }, [&current](SIZE_TYPE i){ return current[i].Index(); } );
+	}
+
 	/////////////////////////////////////////////////////////////////////////////////
 	//!@ General search methods
 
@@ -221,6 +356,91 @@ public:
 		return GetPoints( position, (std::numeric_limits<FType>::max)(), maxCount, closestPoints );
 	}
 
+	/////////////////////////////////////////////////////////////////////////////////
+	//!@name K-nearest point methods
+
+	//! Finds the K closest points to the given position within the given radius.
+	//! The indices and the squared distances of the points found are written to the given arrays
+	//! of size K, sorted by their distances. The distancesSquared array can be nullptr.
+	//! Unlike the GetPoints method with maxCount, the number of points is fixed at compile time,
+	//! so the closest points are kept in a small sorted array that the compiler can optimize.
+	//! It returns the number of points found, which can be smaller than K.
+	template <int K>
+	int GetKNearestPoints( PointType const &position, SIZE_TYPE *indices, FType *distancesSquared=nullptr, FType radius=(std::numeric_limits<FType>::max)() ) const
+	{
+		KNearestList<K> nearest;
+		FType r2 = radius*radius;
+		GetPoints( position, r2, [&nearest](SIZE_TYPE i, PointType const &p, FType d2, FType &r2){ nearest.Insert( i, d2, r2 ); }, 1 );
+		for ( int j=0; j<nearest.count; j++ ) indices[j] = nearest.index[j];
+		if ( distancesSquared ) for ( int j=0; j<nearest.count; j++ ) distancesSquared[j] = nearest.dist2[j];
+		return nearest.count;
+	}
+
+	//! Finds the K closest points within the given radius for each one of the given query positions.
+	//! The results are written in structure-of-arrays form: the indices and squared distances of the points
+	//! found for the i^th query are written to indices[i*K ... i*K+K-1] and distancesSquared[i*K ... i*K+K-1],
+	//! sorted by their distances, and the number of points found is written to counts[i].
+	//! If fewer than K points are found, the remaining entries are not modified.
+	//! The distancesSquared and counts arrays can be nullptr.
+	//!
+	//! The queries are processed in parallel. To improve cache coherence, the queries are processed in
+	//! Morton order (Z-order), so that the consecutive queries on a thread are close to each other and
+	//! visit mostly the same k-d tree nodes. The results are still written in the order of the given queries.
+	template <int K>
+	void GetKNearestPoints( SIZE_TYPE numQueries, PointType const *queries, SIZE_TYPE *indices, FType *distancesSquared=nullptr, SIZE_TYPE *counts=nullptr, FType radius=(std::numeric_limits<FType>::max)() ) const
+	{
+		if ( numQueries == 0 ) return;
+		std::vector<SIZE_TYPE> order;
+		SortQueries( numQueries, queries, order );
+		SIZE_TYPE const grainSize = 256;
+		ParallelFor( SIZE_TYPE(0), numQueries, [&]( SIZE_TYPE begin, SIZE_TYPE end ) {
+			for ( SIZE_TYPE i=begin; i<end; i++ ) {
+				SIZE_TYPE q = order[i];
+				int n = GetKNearestPoints<K>( queries[q], indices + size_t(q)*K, distancesSquared ? distancesSquared + size_t(q)*K : nullptr, radius );
+				if ( counts ) counts[q] = SIZE_TYPE(n);
+			}
+		}, grainSize );
+	}
+
+	//! Computes the Morton order (Z-order) of the given query positions within their bounding box.
+	//! The indices of the queries are written to the given order array, sorted by their Morton codes.
+	static void SortQueries( SIZE_TYPE numQueries, PointType const *queries, std::vector<SIZE_TYPE> &order )
+	{
+		order.resize( numQueries );
+		for ( SIZE_TYPE i=0; i<numQueries; i++ ) order[i] = i;
+		if ( numQueries < 2 ) return;
+
+		PointType boundMin = queries[0], boundMax = queries[0];
+		for ( SIZE_TYPE i=1; i<numQueries; i++ ) {
+			for ( int j=0; j<DIMENSIONS; j++ ) {
+				if ( boundMin[j] > queries[i][j] ) boundMin[j] = queries[i][j];
+				if ( boundMax[j] < queries[i][j] ) boundMax[j] = queries[i][j];
+			}
+		}
+
+		// Interleave the quantized coordinates of the first (up to 16) dimensions
+		int const dims = DIMENSIONS < 16 ? DIMENSIONS : 16;
+		int const bits = 64 / dims < 21 ? 64 / dims : 21;
+		FType scale[16];
+		for ( int j=0; j<dims; j++ ) {
+			FType size = boundMax[j] - boundMin[j];
+			scale[j] = size > 0 ? FType( (uint64_t(1)<<bits) - 1 ) / size : FType(0);
+		}
+		std::vector<uint64_t> keys( numQueries );
+		ParallelFor( SIZE_TYPE(0), numQueries, [&]( SIZE_TYPE begin, SIZE_TYPE end ) {
+			for ( SIZE_TYPE i=begin; i<end; i++ ) {
+				uint64_t q[16];
+				for ( int j=0; j<dims; j++ ) q[j] = uint64_t( ( queries[i][j] - boundMin[j] ) * scale[j] );
+				uint64_t key = 0;
+				for ( int b=bits-1; b>=0; b-- ) {
+					for ( int j=0; j<dims; j++ ) key = (key<<1) | ((q[j]>>b)&1);
+				}
+				keys[i] = key;
+			}
+		}, SIZE_TYPE(4096) );
+		std::sort( order.begin(), order.end(), [&keys]( SIZE_TYPE a, SIZE_TYPE b ){ return keys[a] < keys[b]; } );
+	}
+
 	/////////////////////////////////////////////////////////////////////////////////
 	//!@name Closest point methods
 
@@ -337,10 +557,241 @@ private:
 #endif
 	};
 
+	// Keeps the K closest points found so far, sorted by their squared distances.
+	template <int K>
+	struct KNearestList
+	{
+		SIZE_TYPE index[K];
+		FType     dist2[K];
+		int       count;
+		KNearestList() : count(0) {}
+		// Inserts a point closer than r2 and reduces r2 to the distance of the K^th point, once K points are found.
+		void Insert( SIZE_TYPE i, FType d2, FType &r2 )
+		{
+			int j = count < K ? count++ : K-1;
+			for ( ; j>0 && dist2[j-1] > d2; j-- ) { index[j] = index[j-1]; dist2[j] = dist2[j-1]; }
+			index[j] = i;
+			dist2[j] = d2;
+			if ( count == K ) r2 = dist2[K-1];
+		}
+	};
+
 	PointData *points;		// Keeps the points as a k-d tree.
 	SIZE_TYPE  pointCount;	// Keeps the point count.
 	SIZE_TYPE  numInternal;	// Keeps the number of internal k-d tree nodes.
 
+	// The splitting plane of an internal node of a k-d tree with bucketed leaf nodes
+	struct SplitPlane
+	{
+		FType    pos;	// the position of the splitting plane along the axis
+		uint32_t axis;	// the splitting axis
+	};
+
+	SIZE_TYPE   leafSize;	// Keeps the maximum number of points in a leaf node.
+	SIZE_TYPE   numLeaves;	// Keeps the number of leaf nodes, if the leaf nodes are bucketed (zero otherwise).
+	SplitPlane *splits;		// Keeps the splitting planes of the internal nodes of a k-d tree with bucketed leaf nodes.
+	SIZE_TYPE  *leafStart;	// Keeps the index of the first point of each leaf node, followed by the point count.
+	FType      *coords;		// Keeps the coordinates of the points in leaf order, such that the j^th coordinate of the i^th point is coords[j*pointCount+i].
+
+	std::vector<PointData> insertedPoints;		// Keeps the points inserted after the k-d tree is built.
+	std::vector<uint8_t>   insertedRemoved;		// Keeps a flag for each inserted point that indicates if it is removed.
+	std::unordered_map<SIZE_TYPE,SIZE_TYPE> insertedSlot;	// Keeps the position of each inserted point in insertedPoints, using its custom index.
+	struct InsertedCloud
+	{
+		PointCloud *cloud;	// the k-d tree of the inserted points, using their positions in insertedPoints as custom indices
+		size_t      begin;	// the position of the first inserted point in the k-d tree, which ends at the beginning of the next one
+	};
+	std::vector<InsertedCloud> insertedClouds;	// Keeps the k-d trees of the first numIndexedInserted inserted points, sorted by their positions.
+	size_t                 numIndexedInserted;	// Keeps the number of inserted points in insertedClouds. The rest are searched one by one.
+	size_t                 numInsertedRemoved;	// Keeps the number of removed points in insertedClouds.
+	std::vector< std::pair<SIZE_TYPE,SIZE_TYPE> > treeSlots;	// Keeps the custom index and position of each point in the k-d tree, sorted by the custom indices.
+	std::vector<uint8_t>   removedFlags;		// Keeps a flag for each point in the k-d tree that indicates if it is removed.
+	SIZE_TYPE              numRemoved;			// Keeps the number of removed points in the k-d tree.
+	FType                  rebuildFraction;		// The fraction of the point count that triggers rebuilding the k-d tree after updates.
+	SIZE_TYPE              rebuildMinCount;		// The minimum number of updates that triggers rebuilding the k-d tree.
+
+	// Rebuilds the k-d tree, if the number of updates exceeds the rebuild threshold. Returns true if the k-d tree is rebuilt.
+	bool RebuildIfNeeded()
+	{
+		SIZE_TYPE updates = GetPendingUpdateCount();
+		if ( updates > rebuildMinCount && FType(updates) > rebuildFraction * FType(pointCount) ) { Rebuild(); return true; }
+		return false;
+	}
+
+	// Deletes the inserted points.
+	void ClearInserted()
+	{
+		insertedPoints.clear();
+		insertedRemoved.clear();
+		insertedSlot.clear();
+		for ( size_t i=0; i<insertedClouds.size(); i++ ) delete insertedClouds[i].cloud;
+		insertedClouds.clear();
+		numIndexedInserted = 0;
+		numInsertedRemoved = 0;
+	}
+
+	// Builds a k-d tree for the inserted points in the buffer. The last k-d trees of the inserted points are merged into the
+	// new one, unless they have more than twice as many points, so that each k-d tree has more than twice as many points as the next one.
+	void MergeInsertedClouds()
+	{
+		size_t begin = numIndexedInserted;
+		while ( ! insertedClouds.empty() && begin - insertedClouds.back().begin <= 2*( insertedPoints.size() - begin ) ) {
+			begin = insertedClouds.back().begin;
+			delete insertedClouds.back().cloud;
+			insertedClouds.pop_back();
+		}
+		InsertedCloud c;
+		c.cloud = new PointCloud;
+		c.cloud->SetLeafSize( leafSize );
+		c.cloud->BuildWithFunc( SIZE_TYPE( insertedPoints.size() - begin ), [&](SIZE_TYPE i){ return insertedPoints[begin+i].Pos(); }, [begin](SIZE_TYPE i){ return SIZE_TYPE(begin+i); } );
+		c.begin = begin;
+		insertedClouds.push_back( c );
+		numIndexedInserted = insertedPoints.size();
+	}
+
+	// Removes the inserted point at the given position in insertedPoints. The points in insertedClouds are marked
+	// as removed and the other points are replaced by the last inserted point.
+	void RemoveInserted( SIZE_TYPE j )
+	{
+		if ( j < numIndexedInserted ) {
+			insertedRemoved[j] = 1;
+			numInsertedRemoved++;
+			return;
+		}
+		if ( j+1 < insertedPoints.size() ) {
+			insertedPoints[j] = insertedPoints.back();
+			insertedSlot[ insertedPoints[j].Index() ] = j;
+		}
+		insertedPoints.pop_back();
+		insertedRemoved.pop_back();
+	}
+
+	// Finds the position of the point with the given custom index in the k-d tree.
+	// The sorted list of the custom indices is generated by the first call after building the k-d tree.
+	bool FindTreeSlot( SIZE_TYPE customIndex, SIZE_TYPE &slot )
+	{
+		if ( pointCount == 0 ) return false;
+		if ( treeSlots.empty() ) {
+			treeSlots.resize( pointCount );
+			for ( SIZE_TYPE i=0; i<pointCount; i++ ) treeSlots[i] = std::make_pair( points[i+1].Index(), i+1 );
+			std::sort( treeSlots.begin(), treeSlots.end() );
+			removedFlags.assign( size_t(pointCount)+2, 0 );	// includes the unused first point and the bogus last point
+		}
+		auto it = std::lower_bound( treeSlots.begin(), treeSlots.end(), std::make_pair( customIndex, SIZE_TYPE(0) ) );
+		if ( it == treeSlots.end() || it->first != customIndex ) return false;
+		slot = it->second;
+		return true;
+	}
+
+	// Deletes the data of the k-d tree with bucketed leaf nodes.
+	void ClearBuckets()
+	{
+		delete [] splits;
+		delete [] leafStart;
+		delete [] coords;
+		splits = nullptr;
+		leafStart = nullptr;
+		coords = nullptr;
+		numLeaves = 0;
+	}
+
+	// Builds a complete k-d tree with bucketed leaf nodes. The number of leaf nodes is a power of two,
+	// so that the tree can be kept implicitly like the k-d tree with single-point nodes: the children of
+	// internal node i are 2*i and 2*i+1, and leaf node i is at index numLeaves+i. The points of all leaf nodes
+	// are kept in leaf order, such that the points of each leaf node are in a contiguous block.
+	void BuildBuckets( PointData *orig, PointType const &boundMin, PointType const &boundMax )
+	{
+		numLeaves = 1;
+		while ( numLeaves*leafSize < pointCount ) numLeaves *= 2;
+		splits    = new SplitPlane[ numLeaves ];
+		leafStart = new SIZE_TYPE[ numLeaves+1 ];
+		coords    = new FType[ size_t(pointCount)*DIMENSIONS ];
+		leafStart[numLeaves] = pointCount;
+		BuildBucketNode( orig, boundMin, boundMax, 1, 0, pointCount );
+	}
+
+	// The main method for recursively building the k-d tree with bucketed leaf nodes.
+	void BuildBucketNode( PointData *orig, PointType boundMin, PointType boundMax, SIZE_TYPE nodeID, SIZE_TYPE ixStart, SIZE_TYPE ixEnd )
+	{
+		if ( nodeID >= numLeaves ) {
+			leafStart[ nodeID - numLeaves ] = ixStart;
+			for ( SIZE_TYPE i=ixStart; i<ixEnd; i++ ) {
+				points[i+1] = orig[i];
+				for ( int j=0; j<DIMENSIONS; j++ ) coords[ size_t(j)*pointCount + i ] = orig[i].Pos()[j];
+			}
+			return;
+		}
+		int axis = SplitAxis( boundMin, boundMax );
+		SIZE_TYPE ixMid = ixStart + (ixEnd-ixStart)/2;
+		if ( ixMid < ixEnd ) {
+			std::nth_element( orig+ixStart, orig+ixMid, orig+ixEnd, [axis](PointData const &a, PointData const &b){ return a.Pos()[axis] < b.Pos()[axis]; } );
+			splits[nodeID].pos = orig[ixMid].Pos()[axis];
+		} else {
+			splits[nodeID].pos = boundMax[axis];
+		}
+		splits[nodeID].axis = axis;
+		PointType bMax = boundMax;
+		bMax[axis] = splits[nodeID].pos;
+		PointType bMin = boundMin;
+		bMin[axis] = splits[nodeID].pos;
+		SIZE_TYPE const parallel_invoke_threshold = 256;
+		if ( ixMid-ixStart > parallel_invoke_threshold && ixEnd-ixMid > parallel_invoke_threshold ) {
+			ParallelInvoke(
+				[&]{ BuildBucketNode( orig, boundMin, bMax, nodeID*2,   ixStart, ixMid ); },
+				[&]{ BuildBucketNode( orig, bMin, boundMax, nodeID*2+1, ixMid,   ixEnd ); }
+			);
+		} else {
+			BuildBucketNode( orig, boundMin, bMax, nodeID*2,   ixStart, ixMid );
+			BuildBucketNode( orig, bMin, boundMax, nodeID*2+1, ixMid,   ixEnd );
+		}
+	}
+
+	// Traverses the k-d tree with bucketed leaf nodes, visiting the closer child nodes first.
+	template <typename _CALLBACK>
+	void GetPointsBucketed( PointType const &position, FType &dist2, _CALLBACK pointFound ) const
+	{
+		struct StackEntry { SIZE_TYPE nodeID; FType planeDist2; };
+		StackEntry stack[sizeof(SIZE_TYPE)*8];
+		SIZE_TYPE stackPos = 0;
+		SIZE_TYPE nodeID = 1;
+		for (;;) {
+			// Traverse down to a leaf node along the closer branch
+			while ( nodeID < numLeaves ) {
+				SplitPlane const &s = splits[nodeID];
+				FType dist1 = position[s.axis] - s.pos;
+				SIZE_TYPE child = 2*nodeID;
+				stack[stackPos].nodeID = dist1 < 0 ? child+1 : child;
+				stack[stackPos].planeDist2 = dist1*dist1;
+				stackPos++;
+				nodeID = dist1 < 0 ? child : child+1;
+			}
+
+			// Compute the distances to all points of the leaf node, then report the ones within the search radius
+			SIZE_TYPE leaf = nodeID - numLeaves;
+			SIZE_TYPE first = leafStart[leaf];
+			SIZE_TYPE n = leafStart[leaf+1] - first;
+			FType d2[CY_POINT_CLOUD_MAX_LEAF_SIZE];
+			for ( SIZE_TYPE i=0; i<n; i++ ) d2[i] = 0;
+			for ( int j=0; j<DIMENSIONS; j++ ) {
+				FType const *c = coords + size_t(j)*pointCount + first;
+				FType const pj = position[j];
+				for ( SIZE_TYPE i=0; i<n; i++ ) { FType d = c[i] - pj; d2[i] += d*d; }
+			}
+			for ( SIZE_TYPE i=0; i<n; i++ ) {
+				if ( d2[i] < dist2 ) {
+					pointFound( first+i+1, points[first+i+1], d2[i], dist2 );
+				}
+			}
+
+			// Pop the next node from the stack, skipping the ones that are farther than the search radius
+			do {
+				if ( stackPos == 0 ) return;
+				stackPos--;
+			} while ( stack[stackPos].planeDist2 >= dist2 );
+			nodeID = stack[stackPos].nodeID;
+		}
+	}
+
 	// The main method for recursively building the k-d tree.
 	void BuildKDTree( PointData *orig, PointType boundMin, PointType boundMax, SIZE_TYPE kdIndex, SIZE_TYPE ixStart, SIZE_TYPE ixEnd )
 	{
@@ -356,16 +807,13 @@ private:
 			bMax[axis] = orig[ixMid].Pos()[axis];
 			PointType bMin = boundMin;
 			bMin[axis] = orig[ixMid].Pos()[axis];
-#ifdef _CY_PARALLEL_LIB
 			SIZE_TYPE const parallel_invoke_threshold = 256;
 			if ( ixMid-ixStart > parallel_invoke_threshold && ixEnd - ixMid+1 > parallel_invoke_threshold ) {
-				_CY_PARALLEL_LIB::parallel_invoke(
+				ParallelInvoke(
 					[&]{ BuildKDTree( orig, boundMin, bMax, kdIndex*2,   ixStart, ixMid ); },
 					[&]{ BuildKDTree( orig, bMin, boundMax, kdIndex*2+1, ixMid+1, ixEnd ); }
 				);
-			} else 
-#endif
-			{
+			} else {
 				BuildKDTree( orig, boundMin, bMax, kdIndex*2,   ixStart, ixMid );
 				BuildKDTree( orig, bMin, boundMax, kdIndex*2+1, ixMid+1, ixEnd );
 			}
@@ -399,9 +847,35 @@ private:
 		return axis;
 	}
 
+	// Finds the points in the k-d tree and the inserted points, skipping the removed points.
 	template <typename _CALLBACK>
 	void GetPoints( PointType const &position, FType &dist2, _CALLBACK pointFound, SIZE_TYPE nodeID ) const
 	{
+		if ( pointCount > 0 ) {
+			if ( numRemoved > 0 ) {
+				GetPointsInTree( position, dist2, [&](SIZE_TYPE slot, PointData const &p, FType d2, FType &r2){ if ( ! removedFlags[slot] ) pointFound(p.Index(),p.Pos(),d2,r2); }, nodeID );
+			} else {
+				GetPointsInTree( position, dist2, [&](SIZE_TYPE, PointData const &p, FType d2, FType &r2){ pointFound(p.Index(),p.Pos(),d2,r2); }, nodeID );
+			}
+		}
+		if ( insertedPoints.empty() ) return;
+		for ( size_t i=0; i<insertedClouds.size(); i++ ) {
+			insertedClouds[i].cloud->GetPointsInTree( position, dist2, [&](SIZE_TYPE, PointData const &p, FType d2, FType &r2){ SIZE_TYPE j=p.Index(); if ( ! insertedRemoved[j] ) pointFound(insertedPoints[j].Index(),p.Pos(),d2,r2); }, 1 );
+		}
+		for ( size_t j=numIndexedInserted; j<insertedPoints.size(); j++ ) {
+			PointData const &p = insertedPoints[j];
+			FType d2 = (position - p.Pos()).LengthSquared();
+			if ( d2 < dist2 ) pointFound( p.Index(), p.Pos(), d2, dist2 );
+		}
+	}
+
+	// Finds the points in the k-d tree. The given function is called with the position of each point found in the points array.
+
+	template <typename _CALLBACK>
+	void GetPointsInTree( PointType const &position, FType &dist2, _CALLBACK pointFound, SIZE_TYPE nodeID ) const
+	{
+		if ( numLeaves > 0 ) { GetPointsBucketed( position, dist2, pointFound ); return; }
+
 		SIZE_TYPE stack[sizeof(SIZE_TYPE)*8];
 		SIZE_TYPE stackPos = 0;
 
@@ -418,7 +892,7 @@ private:
 			if ( dist1*dist1 < dist2 ) {
 				// check its point
 				FType d2 = (position - pos).LengthSquared();
-				if ( d2 < dist2 ) pointFound( p.Index(), pos, d2, dist2 );
+				if ( d2 < dist2 ) pointFound( nodeID, p, d2, dist2 );
 				// traverse down the other child node
 				SIZE_TYPE child = 2*nodeID;
 				nodeID = dist1 < 0 ? child+1 : child;
@@ -444,7 +918,7 @@ private:
 		PointData const &p = points[nodeID];
 		PointType const pos = p.Pos();
 		FType d2 = (position - pos).LengthSquared();
-		if ( d2 < dist2 ) pointFound( p.Index(), pos, d2, dist2 );
+		if ( d2 < dist2 ) pointFound( nodeID, p, d2, dist2 );
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////
@@ -63,8 +63,17 @@
 #include "cyCore.h"
 #include "cyHeap.h"
 #include "cyPointCloud.h"
+#include "cyParallel.h"
 #include <vector>
 
+//-------------------------------------------------------------------------------
+
+#if !defined(CY_NO_INTRIN_H) && !defined(CY_NO_EMMINTRIN_H) && !defined(CY_NO_IMMINTRIN_H)
+# if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#  define _CY_SAMPLE_ELIM_SSE
+# endif
+#endif
+
 //-------------------------------------------------------------------------------
 namespace cy {
 //-------------------------------------------------------------------------------
@@ -77,8 +86,14 @@ namespace cy {
 //!
 //! This class keeps a number of parameters for the weighted sample elimination algorithm.
 //! The main algorithm is implemented in the Eliminate method.
+//!
+//! The samples are ordered by their weights using the given QUEUE_TYPE, which must provide the
+//! interface of MaxHeap. The default MaxDaryHeap keeps the exact order of the weights.
+//! MaxBucketQueue can be used instead, which updates the weights in constant time, but it
+//! considers the weights that are closer than its bucket size equal and it is often not faster
+//! (see MaxBucketQueue).
 
-template <typename PointType, typename FType, int DIMENSIONS, typename SIZE_TYPE=size_t>
+template <typename PointType, typename FType, int DIMENSIONS, typename SIZE_TYPE=size_t, typename QUEUE_TYPE=MaxDaryHeap<FType,SIZE_TYPE>>
 class WeightedSampleElimination
 {
 public:
@@ -94,6 +109,8 @@ public:
 		gamma = FType(1.5);
 		tiling = false;
 		weightLimiting = true;
+		neighborCaching = false;
+		partitionCount = 1;
 	}
 
 	//! Tiling determines whether the generated samples are tile-able. 
@@ -115,6 +132,31 @@ public:
 	//! Returns true if weight limiting is turned on.
 	bool IsWeightLimiting() const { return weightLimiting; }
 
+	//! Neighbor caching keeps the neighbors of each sample and their weight contributions, found while
+	//! computing the initial weights, in a compact array. When a sample is eliminated, the weights of its
+	//! neighbors are updated using this array, instead of searching the k-d tree again. This is typically
+	//! much faster, but it requires memory proportional to the total number of neighbors of all input samples,
+	//! which grows with the ratio of the input and output sample counts. Neighbor caching is off by default.
+	void SetNeighborCaching( bool on=true ) { neighborCaching = on; }
+
+	//! Returns true if neighbor caching is turned on.
+	bool IsNeighborCaching() const { return neighborCaching; }
+
+	//! Sets the number of partitions along each dimension of the sampling domain for eliminating
+	//! very large sample sets in parallel. The sampling domain boundaries are split into a grid of
+	//! partitions and the samples of each partition are eliminated independently on a separate thread.
+	//! The results of this step are kept only for the samples farther than d_max from the partition
+	//! boundaries (or the domain boundaries, if tiling is on), since the neighborhoods of the other samples
+	//! extend to other partitions. Then, a final pass eliminates the samples near the partition boundaries.
+	//! Therefore, the partitions should be much larger than d_max, so that the final pass handles a small
+	//! fraction of the samples. If the partitions are smaller than 4*d_max, all samples are eliminated at once.
+	//! The results are similar, but not identical, to eliminating all samples at once. When the progressive
+	//! option is used, only the first elimination step uses partitions. The default partition count is one.
+	void SetPartitionCount( int partitionsPerDimension ) { partitionCount = partitionsPerDimension < 1 ? 1 : partitionsPerDimension; }
+
+	//! Returns the number of partitions along each dimension of the sampling domain.
+	int GetPartitionCount() const { return partitionCount; }
+
 	//! Returns the minimum bounds of the sampling domain.
 	//! The sampling domain boundaries are used for tiling and computing the maximum possible
 	//! Poisson disk radius for the sampling domain. The default boundaries are between 0 and 1.
@@ -183,6 +225,7 @@ public:
 	//! between these two points, and d_max is the current radius for the weight function.
 	//! Note that if the progressive parameter is on, the d_max value sent to the weight function can be
 	//! different than the d_max value passed to this method.
+	//! The initial weights are computed in parallel, so the weight function can be called from multiple threads.
 	template <typename WeightFunction>
 	void Eliminate ( 
 		PointType const *inputPoints, 
@@ -198,29 +241,49 @@ public:
 		assert( outputSize < inputSize );
 		assert( dimensions <= DIMENSIONS && dimensions >= 2 );
 		if ( d_max <= FType(0) ) d_max = 2 * GetMaxPoissonDiskRadius( dimensions, outputSize );
-		DoEliminate( inputPoints, inputSize, outputPoints, outputSize, d_max, weightFunction, false );
-		if ( progressive ) {
-			std::vector<PointType> tmpPoints( outputSize );
-			PointType *inPts  = outputPoints;
-			PointType *outPts = tmpPoints.data();
-			SIZE_TYPE inSize  = outputSize;
-			SIZE_TYPE outSize = 0;
-			while ( inSize >= 3 ) {
-				outSize = inSize / 2;
-				d_max *= ProgressiveRadiusMultiplier( dimensions );
-				DoEliminate( inPts, inSize, outPts, outSize, d_max, weightFunction, true );
-				if ( outPts != outputPoints ) MemCopy( outputPoints+outSize, outPts+outSize, inSize-outSize );
-				PointType *tmpPts = inPts; inPts = outPts; outPts = tmpPts;
-				inSize = outSize;
-			}
-			if ( inPts != outputPoints ) MemCopy( outputPoints, inPts, outSize );
+		if ( partitionCount > 1 ) {
+			DoEliminatePartitioned( inputPoints, inputSize, outputPoints, outputSize, d_max, weightFunction );
+		} else {
+			DoEliminate( inputPoints, inputSize, outputPoints, outputSize, d_max, weightFunction, false, tiling );
 		}
+		if ( progressive ) DoEliminateProgressive( outputPoints, outputSize, d_max, dimensions, weightFunction, []( SIZE_TYPE, SIZE_TYPE ){} );
+	}
+
+	//! Performs weighted sample elimination with the progressive option (see Eliminate) and calls the given
+	//! levelReady function as soon as each level of the progressive ordering is computed. The levelReady
+	//! function must have the following form:
+	//!
+	//! void levelReady( SIZE_TYPE levelStart, SIZE_TYPE levelEnd )
+	//!
+	//! The levels are computed in the order of decreasing size. When levelReady is called, the samples in
+	//! outputPoints[levelStart] ... outputPoints[levelEnd-1] are at their final positions, and the first levelStart
+	//! samples of outputPoints are the samples of the smaller levels, though their order is not final yet.
+	//! Therefore, the samples of a level can be used while the ordering of the smaller levels is computed.
+	//! The first call has levelEnd equal to outputSize and the last call has levelStart equal to zero.
+	//! The levelReady function is called from the calling thread.
+	template <typename WeightFunction, typename LevelReadyFunc>
+	void EliminateProgressive ( 
+		PointType const *inputPoints, 
+		SIZE_TYPE        inputSize, 
+		PointType       *outputPoints, 
+		SIZE_TYPE        outputSize, 
+		FType            d_max,
+		int              dimensions,
+		WeightFunction   weightFunction,
+		LevelReadyFunc   levelReady
+		) const
+	{
+		if ( d_max <= FType(0) ) d_max = 2 * GetMaxPoissonDiskRadius( dimensions, outputSize );
+		Eliminate( inputPoints, inputSize, outputPoints, outputSize, false, d_max, dimensions, weightFunction );
+		DoEliminateProgressive( outputPoints, outputSize, d_max, dimensions, weightFunction, levelReady );
 	}
 
 	//! This is the main method that uses weighted sample elimination for selecting a subset of samples
 	//! with blue noise (Poisson disk) characteristics from a given input sample set (inputPoints). 
 	//! The selected samples are copied to outputPoints. The output size must be smaller than the input size.
-	//! This method uses the default weight function.
+	//! This method uses the default weight function. The weights of the neighbors of each sample are computed
+	//! in batches and, if the alpha parameter is an integer (such as the default value 8), the power in the
+	//! weight function is computed using multiplications, instead of std::pow.
 	//! 
 	//! If the progressive parameter is true, the output sample points are ordered for progressive sampling,
 	//! such that when the samples are introduced one by one in this order, each subset in the sequence
@@ -245,25 +308,34 @@ public:
 		) const
 	{
 		if ( d_max <= FType(0) ) d_max = 2 * GetMaxPoissonDiskRadius( dimensions, outputSize );
-		FType alpha = this->alpha;
-		if ( weightLimiting ) {
-			FType d_min = d_max * GetWeightLimitFraction( inputSize, outputSize );
-			Eliminate( inputPoints, inputSize, outputPoints, outputSize, progressive, d_max, dimensions,
-				[d_min, alpha] (PointType const &, PointType const &, FType d2, FType d_max)
-				{
-					FType d = Sqrt(d2);
-					if ( d < d_min ) d = d_min;
-					return std::pow( FType(1) - d/d_max, alpha );
-				}
-			);
+		FType d_min = weightLimiting ? d_max * GetWeightLimitFraction( inputSize, outputSize ) : FType(0);
+		if ( alpha == FType(8) ) {
+			Eliminate( inputPoints, inputSize, outputPoints, outputSize, progressive, d_max, dimensions, DefaultWeight<8>( alpha, d_min ) );
 		} else {
-			Eliminate( inputPoints, inputSize, outputPoints, outputSize, progressive, d_max, dimensions,
-				[alpha] (PointType const &, PointType const &, FType d2, FType d_max)
-				{
-					FType d = Sqrt(d2);
-					return std::pow( FType(1) - d/d_max, alpha );
-				}
-			);
+			Eliminate( inputPoints, inputSize, outputPoints, outputSize, progressive, d_max, dimensions, DefaultWeight<0>( alpha, d_min ) );
+		}
+	}
+
+	//! Performs weighted sample elimination with the progressive option using the default weight function
+	//! and calls the given levelReady function as soon as each level of the progressive ordering is computed.
+	//! See the other EliminateProgressive method for the details of the levelReady function.
+	template <typename LevelReadyFunc>
+	void EliminateProgressive ( 
+		PointType const *inputPoints, 
+		SIZE_TYPE        inputSize, 
+		PointType       *outputPoints, 
+		SIZE_TYPE        outputSize, 
+		LevelReadyFunc   levelReady,
+		FType            d_max = FType(0),
+		int              dimensions = DIMENSIONS
+		) const
+	{
+		if ( d_max <= FType(0) ) d_max = 2 * GetMaxPoissonDiskRadius( dimensions, outputSize );
+		FType d_min = weightLimiting ? d_max * GetWeightLimitFraction( inputSize, outputSize ) : FType(0);
+		if ( alpha == FType(8) ) {
+			EliminateProgressive( inputPoints, inputSize, outputPoints, outputSize, d_max, dimensions, DefaultWeight<8>( alpha, d_min ), levelReady );
+		} else {
+			EliminateProgressive( inputPoints, inputSize, outputPoints, outputSize, d_max, dimensions, DefaultWeight<0>( alpha, d_min ), levelReady );
 		}
 	}
 
@@ -302,6 +374,125 @@ private:
 	FType     alpha, beta, gamma;	// Parameters of the default weight function.
 	bool      weightLimiting;		// Specifies whether weight limiting is used with the default weight function.
 	bool      tiling;				// Specifies whether the sampling domain is tiled.
+	bool      neighborCaching;		// Specifies whether the neighbors found while computing the initial weights are kept.
+	int       partitionCount;		// The number of partitions along each dimension for parallel elimination.
+
+	// A neighbor of a sample and its contribution to the weight of the sample
+	struct Neighbor
+	{
+		SIZE_TYPE index;
+		FType     weight;
+	};
+
+	// The default weight function. If ALPHA is positive, it must be equal to the alpha parameter and the
+	// power is computed using repeated multiplications that are determined at compile time. Otherwise,
+	// repeated multiplications are used only if alpha is a small positive integer, and std::pow is used
+	// for all other alpha values. Weights can also be computed in batches (see GetNeighborWeights).
+	template <int ALPHA>
+	class DefaultWeight
+	{
+	public:
+		DefaultWeight( FType a, FType dmin ) : alpha(a), d_min(dmin), intAlpha(0)
+		{
+			if ( ALPHA <= 0 && alpha > FType(0) && alpha <= FType(64) && alpha == FType(int(alpha)) ) intAlpha = int(alpha);
+		}
+
+		FType operator () ( PointType const &, PointType const &, FType d2, FType d_max ) const
+		{
+			FType d = Sqrt(d2);
+			if ( d < d_min ) d = d_min;
+			return Power( FType(1) - d/d_max );
+		}
+
+		// Computes the weights of n neighbors using their squared distances.
+		void Evaluate( FType *w, FType const *d2, int n, FType d_max ) const
+		{
+			SqrtBatch( w, d2, n );
+			_CY_IVDEP_FOR ( int k=0; k<n; k++ ) {
+				FType d = w[k] < d_min ? d_min : w[k];
+				w[k] = FType(1) - d/d_max;
+			}
+			if ( ALPHA > 0 ) {
+				_CY_IVDEP_FOR ( int k=0; k<n; k++ ) w[k] = PowerInt( w[k], ALPHA );
+			} else if ( intAlpha > 0 ) {
+				for ( int k=0; k<n; k++ ) w[k] = PowerInt( w[k], intAlpha );
+			} else {
+				for ( int k=0; k<n; k++ ) w[k] = std::pow( w[k], alpha );
+			}
+		}
+
+	private:
+		FType alpha, d_min;
+		int   intAlpha;		// The alpha parameter, if it is a small positive integer, zero otherwise.
+
+		FType Power( FType x ) const
+		{
+			if ( ALPHA    > 0 ) return PowerInt( x, ALPHA );
+			if ( intAlpha > 0 ) return PowerInt( x, intAlpha );
+			return std::pow( x, alpha );
+		}
+
+		static FType PowerInt( FType x, int n )
+		{
+			FType r = FType(1);
+			for ( ; n > 0; n >>= 1 ) {
+				if ( n & 1 ) r *= x;
+				x *= x;
+			}
+			return r;
+		}
+
+		template <typename T> static void SqrtBatch( T *r, T const *v, int n ) { for ( int k=0; k<n; k++ ) r[k] = Sqrt(v[k]); }
+#ifdef _CY_SAMPLE_ELIM_SSE
+		static void SqrtBatch( float *r, float const *v, int n )
+		{
+			int k = 0;
+			for ( ; k+4<=n; k+=4 ) _mm_storeu_ps( r+k, _mm_sqrt_ps( _mm_loadu_ps( v+k ) ) );
+			for ( ; k<n; k++ ) r[k] = Sqrt(v[k]);
+		}
+		static void SqrtBatch( double *r, double const *v, int n )
+		{
+			int k = 0;
+			for ( ; k+2<=n; k+=2 ) _mm_storeu_pd( r+k, _mm_sqrt_pd( _mm_loadu_pd( v+k ) ) );
+			for ( ; k<n; k++ ) r[k] = Sqrt(v[k]);
+		}
+#endif
+	};
+
+	// Calls func( i, weight ) for each neighbor i of the sample at the given index within d_max distance.
+	// The neighbors that are tiled copies of samples (i >= inputSize) are skipped.
+	template <typename WeightFunction, typename FUNC>
+	void GetNeighborWeights( PointCloud<PointType,FType,DIMENSIONS,SIZE_TYPE> const &kdtree, SIZE_TYPE inputSize, SIZE_TYPE index, PointType const &point, FType d_max, WeightFunction const &weightFunction, FUNC func ) const
+	{
+		kdtree.GetPoints( point, d_max, [&]( SIZE_TYPE i, PointType const &p, FType d2, FType & ){
+			if ( i >= inputSize || i == index ) return;
+			func( i, weightFunction(point,p,d2,d_max) );
+		} );
+	}
+
+	// Same as above for the default weight function, but the neighbors are collected in a buffer
+	// and their weights are computed in batches.
+	template <int ALPHA, typename FUNC>
+	void GetNeighborWeights( PointCloud<PointType,FType,DIMENSIONS,SIZE_TYPE> const &kdtree, SIZE_TYPE inputSize, SIZE_TYPE index, PointType const &point, FType d_max, DefaultWeight<ALPHA> const &weightFunction, FUNC func ) const
+	{
+		int const batchSize = 64;
+		SIZE_TYPE ix[batchSize];
+		FType     d2[batchSize];
+		FType     w [batchSize];
+		int n = 0;
+		auto Flush = [&]() {
+			weightFunction.Evaluate( w, d2, n, d_max );
+			for ( int k=0; k<n; k++ ) func( ix[k], w[k] );
+			n = 0;
+		};
+		kdtree.GetPoints( point, d_max, [&]( SIZE_TYPE i, PointType const &, FType dist2, FType & ){
+			if ( i >= inputSize || i == index ) return;
+			ix[n] = i;
+			d2[n] = dist2;
+			if ( ++n == batchSize ) Flush();
+		} );
+		if ( n > 0 ) Flush();
+	}
 
 	// Reflects a point near the bounds of the sampling domain off of all domain bounds for tiling.
 	template <typename OPERATION>
@@ -324,20 +515,73 @@ private:
 	}
 
 	// This is the method that performs weighted sample elimination.
+	// If the eligible array is given, only the samples with non-zero eligible values can be eliminated.
 	template <typename WeightFunction>
 	void DoEliminate( 
-		PointType const *inputPoints, 
-		SIZE_TYPE        inputSize, 
-		PointType       *outputPoints, 
-		SIZE_TYPE        outputSize, 
-		FType            d_max,
-		WeightFunction   weightFunction,
-		bool             copyEliminated
+		PointType const     *inputPoints, 
+		SIZE_TYPE            inputSize, 
+		PointType           *outputPoints, 
+		SIZE_TYPE            outputSize, 
+		FType                d_max,
+		WeightFunction       weightFunction,
+		bool                 copyEliminated,
+		bool                 tilePoints,
+		unsigned char const *eligible = nullptr
 		) const
 	{
 		// Build a k-d tree for samples
 		PointCloud<PointType,FType,DIMENSIONS,SIZE_TYPE> kdtree;
-		if ( tiling ) {
+		BuildTree( kdtree, inputPoints, inputSize, d_max, tilePoints );
+
+		// Eliminate samples using a heap that keeps the remaining samples at the beginning
+		std::vector<FType> w;
+		QUEUE_TYPE heap;
+		EliminateSamples( kdtree, inputPoints, inputSize, inputSize-outputSize, d_max, weightFunction, eligible, w, heap, []( SIZE_TYPE ){} );
+
+		// Copy the samples to the output array
+		SIZE_TYPE targetSize = copyEliminated ? inputSize : outputSize;
+		for ( SIZE_TYPE i=0; i<targetSize; i++ ) {
+			outputPoints[i] = inputPoints[ heap.GetIDFromHeap(i) ];
+		}
+	}
+
+	// Orders the given samples for progressive sampling by repeatedly eliminating half of the remaining samples.
+	// The eliminated samples of each level are written directly to their final positions after the remaining
+	// samples, which are copied to the beginning of the array before the levelReady function is called. The k-d tree is rebuilt for each level using the remaining
+	// samples only, which is faster than removing the eliminated samples from it, since the number of samples
+	// halves at each level. The k-d tree and the other buffers are reused for all levels.
+	template <typename WeightFunction, typename LevelReadyFunc>
+	void DoEliminateProgressive( PointType *points, SIZE_TYPE size, FType d_max, int dimensions, WeightFunction const &weightFunction, LevelReadyFunc levelReady ) const
+	{
+		std::vector<PointType> pts( points, points + size );
+		std::vector<PointType> remaining;
+		PointCloud<PointType,FType,DIMENSIONS,SIZE_TYPE> kdtree;
+		std::vector<FType> w;
+		QUEUE_TYPE heap;
+		SIZE_TYPE inSize = size;
+		while ( inSize >= 3 ) {
+			SIZE_TYPE outSize = inSize / 2;
+			d_max *= ProgressiveRadiusMultiplier( dimensions );
+			BuildTree( kdtree, pts.data(), inSize, d_max, tiling );
+			SIZE_TYPE levelPos = inSize;
+			EliminateSamples( kdtree, pts.data(), inSize, inSize-outSize, d_max, weightFunction, nullptr, w, heap, [&]( SIZE_TYPE i ){
+				points[ --levelPos ] = pts[i];
+			} );
+			remaining.resize( outSize );
+			for ( SIZE_TYPE i=0; i<outSize; i++ ) remaining[i] = pts[ heap.GetIDFromHeap(i) ];
+			MemCopy( points, remaining.data(), outSize );
+			levelReady( outSize, inSize );
+			pts.swap( remaining );
+			inSize = outSize;
+		}
+		levelReady( SIZE_TYPE(0), inSize );
+	}
+
+	// Builds a k-d tree for the given samples. If tilePoints is true, the copies of the samples within
+	// d_max distance to the domain boundaries are also added, using the indices of the original samples.
+	void BuildTree( PointCloud<PointType,FType,DIMENSIONS,SIZE_TYPE> &kdtree, PointType const *inputPoints, SIZE_TYPE inputSize, FType d_max, bool tilePoints ) const
+	{
+		if ( tilePoints ) {
 			std::vector<PointType> point(inputPoints, inputPoints + inputSize);
 			std::vector<SIZE_TYPE> index(inputSize);
 			for ( SIZE_TYPE i=0; i<inputSize; i++ ) index[i] = i;
@@ -350,47 +594,246 @@ private:
 		} else {
 			kdtree.Build( inputSize, inputPoints );
 		}
+	}
 
+	// Computes the weights of the samples using the given k-d tree, builds a heap with them, and eliminates
+	// the given number of samples. The eliminated function is called with the index of each eliminated sample,
+	// before the weights of its neighbors are updated. If the eligible array is given, only the samples with
+	// non-zero eligible values can be eliminated and only their weights are computed.
+	template <typename WeightFunction, typename EliminatedFunc>
+	void EliminateSamples(
+		PointCloud<PointType,FType,DIMENSIONS,SIZE_TYPE> const &kdtree,
+		PointType const          *inputPoints,
+		SIZE_TYPE                 inputSize,
+		SIZE_TYPE                 eliminateCount,
+		FType                     d_max,
+		WeightFunction const     &weightFunction,
+		unsigned char const      *eligible,
+		std::vector<FType>       &w,
+		QUEUE_TYPE               &heap,
+		EliminatedFunc            eliminated
+		) const
+	{
 		// Assign weights to each sample
-		std::vector<FType> w( inputSize, FType(0) );
-		auto AddWeights = [&]( SIZE_TYPE index, PointType const &point ) {
-			kdtree.GetPoints( point, d_max, [&weightFunction,d_max,&w,index,&point,&inputSize]( SIZE_TYPE i, PointType const &p, FType d2, FType & ){
-				if ( i >= inputSize ) return;
-				if ( i != index ) w[index] += weightFunction(point,p,d2,d_max);
+		w.assign( inputSize, FType(0) );
+		std::vector<SIZE_TYPE> neighborStart;	// the neighbors of sample i are neighbors[ neighborStart[i] ... neighborStart[i+1]-1 ]
+		std::vector<Neighbor>  neighbors;
+		if ( neighborCaching ) {
+			// Find the neighbors of each block of samples in parallel, then concatenate them
+			SIZE_TYPE const blockSize = 1024;
+			SIZE_TYPE const numBlocks = (inputSize + blockSize - 1) / blockSize;
+			std::vector< std::vector<Neighbor> > blockNeighbors( numBlocks );
+			neighborStart.resize( inputSize+1 );
+			ParallelFor( SIZE_TYPE(0), numBlocks, [&]( SIZE_TYPE blockBegin, SIZE_TYPE blockEnd ) {
+				for ( SIZE_TYPE b=blockBegin; b<blockEnd; b++ ) {
+					std::vector<Neighbor> &bn = blockNeighbors[b];
+					SIZE_TYPE iEnd = (std::min)( (b+1)*blockSize, inputSize );
+					for ( SIZE_TYPE index=b*blockSize; index<iEnd; index++ ) {
+						PointType const &point = inputPoints[index];
+						neighborStart[index] = SIZE_TYPE( bn.size() );
+						if ( eligible && ! eligible[index] ) continue;
+						GetNeighborWeights( kdtree, inputSize, index, point, d_max, weightFunction, [&]( SIZE_TYPE i, FType weight ){
+							Neighbor n;
+							n.index  = i;
+							n.weight = weight;
+							w[index] += weight;
+							bn.push_back( n );
+						} );
+					}
+				}
 			} );
-		};
-		for ( SIZE_TYPE i=0; i<inputSize; i++ ) AddWeights( i, inputPoints[i] );
+			SIZE_TYPE total = 0;
+			std::vector<SIZE_TYPE> blockOffset( numBlocks );
+			for ( SIZE_TYPE b=0; b<numBlocks; b++ ) { blockOffset[b] = total; total += SIZE_TYPE( blockNeighbors[b].size() ); }
+			neighbors.resize( total );
+			neighborStart[inputSize] = total;
+			ParallelFor( SIZE_TYPE(0), numBlocks, [&]( SIZE_TYPE blockBegin, SIZE_TYPE blockEnd ) {
+				for ( SIZE_TYPE b=blockBegin; b<blockEnd; b++ ) {
+					SIZE_TYPE iEnd = (std::min)( (b+1)*blockSize, inputSize );
+					for ( SIZE_TYPE i=b*blockSize; i<iEnd; i++ ) neighborStart[i] += blockOffset[b];
+					if ( ! blockNeighbors[b].empty() ) MemCopy( neighbors.data() + blockOffset[b], blockNeighbors[b].data(), blockNeighbors[b].size() );
+					std::vector<Neighbor>().swap( blockNeighbors[b] );
+				}
+			} );
+		} else {
+			ParallelFor( SIZE_TYPE(0), inputSize, [&]( SIZE_TYPE begin, SIZE_TYPE end ) {
+				for ( SIZE_TYPE index=begin; index<end; index++ ) {
+					PointType const &point = inputPoints[index];
+					if ( eligible && ! eligible[index] ) continue;
+					FType &wi = w[index];
+					GetNeighborWeights( kdtree, inputSize, index, point, d_max, weightFunction, [&wi]( SIZE_TYPE, FType weight ){ wi += weight; } );
+				}
+			}, SIZE_TYPE(256) );
+		}
+		// The samples that are not eligible have the minimum weight, so they are never eliminated
+		if ( eligible ) {
+			for ( SIZE_TYPE i=0; i<inputSize; i++ ) if ( ! eligible[i] ) w[i] = -std::numeric_limits<FType>::infinity();
+		}
 
 		// Build a heap for the samples using their weights
-		MaxHeap<FType,SIZE_TYPE> heap;
 		heap.SetDataPointer( w.data(), inputSize );
 		heap.Build();
 
 		// While the number of samples is greater than desired
+		std::vector<SIZE_TYPE> updated;	// the neighbors with decreased weights, which are moved down in the heap together
 		auto RemoveWeights = [&]( SIZE_TYPE index, PointType const &point ) {
-			kdtree.GetPoints( point, d_max, [&weightFunction,d_max,&w,index,&point,&heap,&inputSize]( SIZE_TYPE i, PointType const &p, FType d2, FType & ){
-				if ( i >= inputSize ) return;
-				if ( i != index ) {
-					w[i] -= weightFunction(point,p,d2,d_max);
-					heap.MoveItemDown(i);
+			updated.clear();
+			if ( neighborCaching ) {
+				for ( SIZE_TYPE k=neighborStart[index]; k<neighborStart[index+1]; k++ ) {
+					SIZE_TYPE i = neighbors[k].index;
+					w[i] -= neighbors[k].weight;
+					updated.push_back(i);
 				}
-			} );
+			} else {
+				GetNeighborWeights( kdtree, inputSize, index, point, d_max, weightFunction, [&w,&updated]( SIZE_TYPE i, FType weight ){
+					w[i] -= weight;
+					updated.push_back(i);
+				} );
+			}
+			if ( ! updated.empty() ) heap.MoveItemsDown( SIZE_TYPE( updated.size() ), updated.data() );
 		};
-		SIZE_TYPE sampleSize = inputSize;
-		while ( sampleSize > outputSize ) {
+		for ( SIZE_TYPE k=0; k<eliminateCount; k++ ) {
 			// Pull the top sample from heap
-			SIZE_TYPE i = heap.GetTopItemID();
-			heap.Pop();
+			SIZE_TYPE i = heap.Pop();
+			eliminated( i );
 			// For each sample around it, remove its weight contribution and update the heap
 			RemoveWeights( i, inputPoints[i] );
-			sampleSize--;
+		}
+	}
+
+	// Performs weighted sample elimination by splitting the sampling domain into partitions.
+	// First, the samples of each partition are eliminated in parallel, treating the partition as a tile,
+	// and the remaining samples that are farther than d_max from the partition boundaries are kept.
+	// Then, the original samples near the partition boundaries are eliminated in a final pass,
+	// in which the kept samples contribute to the weights but are not eliminated.
+	template <typename WeightFunction>
+	void DoEliminatePartitioned(
+		PointType const *inputPoints, 
+		SIZE_TYPE        inputSize, 
+		PointType       *outputPoints, 
+		SIZE_TYPE        outputSize, 
+		FType            d_max,
+		WeightFunction   weightFunction
+		) const
+	{
+		int const n = partitionCount;
+		SIZE_TYPE numPartitions = 1;
+		for ( int d=0; d<DIMENSIONS; d++ ) numPartitions *= n;
+		PointType partitionSize;
+		for ( int d=0; d<DIMENSIONS; d++ ) partitionSize[d] = ( boundsMax[d] - boundsMin[d] ) / FType(n);
+		for ( int d=0; d<DIMENSIONS; d++ ) {
+			if ( partitionSize[d] < 4*d_max ) {
+				// The partitions are too small, so we eliminate all samples at once
+				DoEliminate( inputPoints, inputSize, outputPoints, outputSize, d_max, weightFunction, false, tiling );
+				return;
+			}
 		}
 
-		// Copy the samples to the output array
-		SIZE_TYPE targetSize = copyEliminated ? inputSize : outputSize;
-		for ( SIZE_TYPE i=0; i<targetSize; i++ ) {
-			outputPoints[i] = inputPoints[ heap.GetIDFromHeap(i) ];
+		// Find the partition of each sample and whether it is near the partition boundaries
+		std::vector<SIZE_TYPE>     partition( inputSize );
+		std::vector<unsigned char> nearBoundary( inputSize );
+		ParallelFor( SIZE_TYPE(0), inputSize, [&]( SIZE_TYPE begin, SIZE_TYPE end ) {
+			for ( SIZE_TYPE i=begin; i<end; i++ ) {
+				bool near;
+				partition[i] = GetPartition( inputPoints[i], partitionSize, d_max, near );
+				nearBoundary[i] = near;
+			}
+		}, SIZE_TYPE(4096) );
+
+		// Sort the samples by their partitions, placing the samples near the boundaries after the others
+		std::vector<SIZE_TYPE> partitionStart( numPartitions+1, 0 );
+		std::vector<SIZE_TYPE> interiorCount( numPartitions, 0 );
+		for ( SIZE_TYPE i=0; i<inputSize; i++ ) {
+			partitionStart[ partition[i]+1 ]++;
+			if ( ! nearBoundary[i] ) interiorCount[ partition[i] ]++;
+		}
+		for ( SIZE_TYPE t=0; t<numPartitions; t++ ) partitionStart[t+1] += partitionStart[t];
+		std::vector<PointType> sorted( inputSize );
+		{
+			std::vector<SIZE_TYPE> interiorPos( numPartitions ), boundaryPos( numPartitions );
+			for ( SIZE_TYPE t=0; t<numPartitions; t++ ) {
+				interiorPos[t] = partitionStart[t];
+				boundaryPos[t] = partitionStart[t] + interiorCount[t];
+			}
+			for ( SIZE_TYPE i=0; i<inputSize; i++ ) {
+				SIZE_TYPE t = partition[i];
+				sorted[ nearBoundary[i] ? boundaryPos[t]++ : interiorPos[t]++ ] = inputPoints[i];
+			}
+		}
+
+		// Eliminate the interior samples of each partition in parallel
+		std::vector< std::vector<PointType> > kept( numPartitions );
+		ParallelFor( SIZE_TYPE(0), numPartitions, [&]( SIZE_TYPE partBegin, SIZE_TYPE partEnd ) {
+			for ( SIZE_TYPE t=partBegin; t<partEnd; t++ ) {
+				SIZE_TYPE count  = partitionStart[t+1] - partitionStart[t];
+				SIZE_TYPE target = SIZE_TYPE( double(outputSize) * double(count) / double(inputSize) );
+				PointType const *partPoints = sorted.data() + partitionStart[t];
+				if ( target == 0 ) continue;
+				if ( target >= count ) {
+					kept[t].assign( partPoints, partPoints + interiorCount[t] );
+					continue;
+				}
+				// The partition is tiled, so that the samples near its boundaries are not favored and the
+				// interior samples are eliminated uniformly. Only the interior samples are kept, since the
+				// samples near the boundaries are eliminated again in the final pass.
+				WeightedSampleElimination part( *this );
+				SIZE_TYPE c = t;
+				for ( int d=0; d<DIMENSIONS; d++ ) {
+					part.boundsMin[d] = boundsMin[d] + FType(c % n) * partitionSize[d];
+					part.boundsMax[d] = part.boundsMin[d] + partitionSize[d];
+					c /= n;
+				}
+				std::vector<PointType> partOutput( target );
+				part.DoEliminate( partPoints, count, partOutput.data(), target, d_max, weightFunction, false, true );
+				std::vector<PointType> &k = kept[t];
+				for ( SIZE_TYPE i=0; i<target; i++ ) {
+					bool near;
+					GetPartition( partOutput[i], partitionSize, d_max, near );
+					if ( ! near ) k.push_back( partOutput[i] );
+				}
+			}
+		} );
+
+		// Combine the remaining interior samples and the samples near the boundaries
+		std::vector<PointType> remaining;
+		std::vector<unsigned char> eligible;
+		for ( SIZE_TYPE t=0; t<numPartitions; t++ ) remaining.insert( remaining.end(), kept[t].begin(), kept[t].end() );
+		eligible.resize( remaining.size(), 0 );
+		for ( SIZE_TYPE t=0; t<numPartitions; t++ ) {
+			remaining.insert( remaining.end(), sorted.begin() + partitionStart[t] + interiorCount[t], sorted.begin() + partitionStart[t+1] );
+		}
+		eligible.resize( remaining.size(), 1 );
+		std::vector<PointType>().swap( sorted );
+
+		if ( remaining.size() < outputSize ) {
+			// This can only happen with too many partitions, so we eliminate all samples at once
+			DoEliminate( inputPoints, inputSize, outputPoints, outputSize, d_max, weightFunction, false, tiling );
+		} else if ( remaining.size() == outputSize ) {
+			MemCopy( outputPoints, remaining.data(), outputSize );
+		} else {
+			// Eliminate the samples near the partition boundaries
+			DoEliminate( remaining.data(), SIZE_TYPE(remaining.size()), outputPoints, outputSize, d_max, weightFunction, false, tiling, eligible.data() );
+		}
+	}
+
+	// Returns the partition index of the given point and sets nearBoundary to true if the point is
+	// within d_max distance to the boundaries of its partition that are shared with other partitions.
+	SIZE_TYPE GetPartition( PointType const &p, PointType const &partitionSize, FType d_max, bool &nearBoundary ) const
+	{
+		int const n = partitionCount;
+		SIZE_TYPE part = 0;
+		nearBoundary = false;
+		for ( int d=DIMENSIONS-1; d>=0; d-- ) {
+			FType x = p[d] - boundsMin[d];
+			int c = int( x / partitionSize[d] );
+			if ( c < 0 ) c = 0;
+			if ( c > n-1 ) c = n-1;
+			part = part*n + c;
+			FType local = x - FType(c)*partitionSize[d];
+			if ( ( c > 0   || tiling ) && local < d_max ) nearBoundary = true;
+			if ( ( c < n-1 || tiling ) && partitionSize[d] - local < d_max ) nearBoundary = true;
 		}
+		return part;
 	}
 
 	// Returns the change in weight function radius using half of the number of samples. It is used for progressive sampling.
@@ -37,8 +37,17 @@
 //-------------------------------------------------------------------------------
 
 #include "cyVector.h"
+#include "cyMappedFile.h"
+#include "cyParallel.h"
 #include <vector>
+#include <atomic>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
 #include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 //-------------------------------------------------------------------------------
 
@@ -126,9 +135,9 @@ public:
 
 	//!@name Constructors and Destructor
 	TriMesh() : v(nullptr), f(nullptr), vn(nullptr), fn(nullptr), vt(nullptr), ft(nullptr), m(nullptr), mcfc(nullptr)
-				, nv(0), nf(0), nvn(0), nvt(0), nm(0),boundMin(1,1,1), boundMax(0,0,0) {}
+				, nv(0), nf(0), nvn(0), nvt(0), nm(0),boundMin(1,1,1), boundMax(0,0,0), mappedFile(nullptr) {}
 	TriMesh( TriMesh const &t ) : v(nullptr), f(nullptr), vn(nullptr), fn(nullptr), vt(nullptr), ft(nullptr), m(nullptr), mcfc(nullptr)
-				, nv(0), nf(0), nvn(0), nvt(0), nm(0),boundMin(1,1,1), boundMax(0,0,0) { *this = t; }
+				, nv(0), nf(0), nvn(0), nvt(0), nm(0),boundMin(1,1,1), boundMax(0,0,0), mappedFile(nullptr) { *this = t; }
 	virtual ~TriMesh() { Clear(); }
 
 	//!@name Component Access Methods
@@ -157,7 +166,7 @@ public:
 	bool HasTextureVertices() const { return NVT() > 0; }	//!< returns true if the mesh has texture vertices
 
 	//!@name Set Component Count
-	void Clear() { SetNumVertex(0); SetNumFaces(0); SetNumNormals(0); SetNumTexVerts(0); SetNumMtls(0); boundMin.Set(1,1,1); boundMax.Zero(); }	//!< Deletes all components of the mesh
+	void Clear() { SetNumVertex(0); SetNumFaces(0); SetNumNormals(0); SetNumTexVerts(0); SetNumMtls(0); boundMin.Set(1,1,1); boundMax.Zero(); if (mappedFile) { delete mappedFile; mappedFile=nullptr; } }	//!< Deletes all components of the mesh
 	void SetNumVertex  ( unsigned int n ) { Allocate(n,v,nv); }															//!< Sets the number of vertices and allocates memory for vertex positions
 	void SetNumFaces   ( unsigned int n ) { Allocate(n,f,nf); if (fn||vn) Allocate(n,fn); if (ft||vt) Allocate(n,ft); }	//!< Sets the number of faces and allocates memory for face data. Normal faces and texture faces are also allocated, if they are used.
 	void SetNumNormals ( unsigned int n ) { Allocate(n,vn,nvn); Allocate(n==0?0:nf,fn); }									//!< Sets the number of normals and allocates memory for normals and normal faces.
@@ -178,19 +187,52 @@ public:
 
 	//!@name Compute Methods
 	void ComputeBoundingBox();						//!< Computes the bounding box
-	void ComputeNormals(bool clockwise=false);		//!< Computes and stores vertex normals
+	void ComputeNormals(bool clockwise=false, bool angleWeighted=false);	//!< Computes and stores vertex normals. The face normals are weighted by the face areas, or by the face angles at the vertices if angleWeighted is true.
+
+	//!@name Rendering Buffers
+	//! Builds an interleaved vertex buffer and an index buffer with 3 indices per face for rendering. The face corners
+	//! with the same position, normal, and texture coordinate indices are welded into a single vertex, in the order
+	//! they first appear in the faces. Each vertex has 3 position components, followed by 3 normal components, if the
+	//! mesh has normals, and texCoordComponents (up to 3) texture coordinate components, if the mesh has texture coordinates.
+	//! Returns the number of floats per vertex.
+	int BuildIndexedBuffers( std::vector<float> &vertexBuffer, std::vector<uint32_t> &indexBuffer, int texCoordComponents=2 ) const;
 
 	//!@name Load and Save methods
 	bool LoadFromFileObj( char const *filename, bool loadMtl=true, std::ostream *outStream=&std::cout );	//!< Loads the mesh from an OBJ file. Automatically converts all faces to triangles.
-	bool SaveToFileObj( char const *filename, std::ostream *outStream );									//!< Saves the mesh to an OBJ file with the given name.
+	bool SaveToFileObj( char const *filename, std::ostream *outStream, int precision=6 );					//!< Saves the mesh to an OBJ file with the given name. The values are written with the given number of digits after the decimal point, as with printf's %f format. If precision is negative, the shortest representation that reads back to the same float value is written, so that the file is lossless.
+	bool LoadFromFileBinary( char const *filename, std::ostream *outStream=&std::cout );					//!< Loads the mesh from a binary file saved by SaveToFileBinary. The file is memory-mapped and the vertex, face, and material face count arrays point to the mapped data until they are reallocated or the mesh is cleared. Modifying these arrays does not change the file.
+	bool SaveToFileBinary( char const *filename, std::ostream *outStream=&std::cout );						//!< Saves the mesh to a binary file with the given name, including all vertex, face, and material data. The data is written to a temporary file that replaces the given file at the end, so the meshes that have loaded the previous version of the file, including this mesh, keep their data. Returns false if the file cannot be written.
+	bool LoadFromFileObjCached( char const *filename, char const *cacheFilename=nullptr, bool loadMtl=true, std::ostream *outStream=&std::cout );	//!< Loads the mesh from the binary cache file, if it is newer than the given OBJ file. Otherwise, loads the OBJ file and saves the cache file. If cacheFilename is null, the cache file name is the OBJ file name followed by ".cymesh". The cache file is replaced as in SaveToFileBinary, so the meshes that have loaded its previous version keep their data.
 
 private:
-	template <class T> void Allocate( unsigned int n, T* &t ) { if (t) delete [] t; if (n>0) t = new T[n]; else t=nullptr; }
+	template <class T> void Allocate( unsigned int n, T* &t ) { if (t && !IsMapped(t)) delete [] t; if (n>0) t = new T[n]; else t=nullptr; }
 	template <class T> bool Allocate( unsigned int n, T* &t, unsigned int &nt ) { if (n==nt) return false; nt=n; Allocate(n,t); return true; }
 	template <class T> void Copy( T const *from, unsigned int n, T* &t, unsigned int &nt) { if (!from) n=0; Allocate(n,t,nt); if (t) memcpy(t,from,sizeof(T)*n); }
 	template <class T> void Copy( T const *from, unsigned int n, T* &t) { if (!from) n=0; Allocate(n,t); if (t) memcpy(t,from,sizeof(T)*n); }
 	static Vec3f Interpolate( int i, Vec3f const *v, TriFace const *f, Vec3f const &bc ) { return v[f[i].v[0]]*bc.x + v[f[i].v[1]]*bc.y + v[f[i].v[2]]*bc.z; }
 
+	// The binary file that the arrays may point to, loaded by LoadFromFileBinary
+	MappedFile *mappedFile;
+	bool IsMapped( void const *p ) const { if ( !mappedFile ) return false; uintptr_t d=(uintptr_t)mappedFile->GetData(); return (uintptr_t)p >= d && (uintptr_t)p < d+mappedFile->GetSize(); }
+
+	// The header of the binary file format. The arrays are stored after the header at the given offsets,
+	// aligned to 16 bytes, followed by the material data.
+	struct BinaryHeader
+	{
+		char     signature[4];	// "CYTM"
+		uint32_t version;
+		uint32_t headerSize;
+		uint32_t byteOrder;		// 0x01020304 in the byte order of the file
+		uint32_t flags;
+		uint32_t nv, nf, nvn, nvt, nm;
+		float    boundMin[3], boundMax[3];
+		uint64_t offset[8];		// v, f, vn, fn, vt, ft, mcfc, and materials; zero if not stored
+		uint64_t fileSize;
+	};
+	enum { BINARY_VERSION=1, BINARY_NO_MTL=1 };
+	bool LoadBinary( char const *filename, std::ostream *outStream, int requiredFlags );
+	bool SaveBinary( char const *filename, std::ostream *outStream, uint32_t flags );
+
 	// Temporary structures
 	struct MtlData
 	{
@@ -200,6 +242,39 @@ private:
 		MtlData() { faceCount=0; firstFace=0; }
 	};
 	struct MtlLibName { std::string filename; };
+
+	// A part of an .obj file that begins and ends at line boundaries, so that it can be parsed independently.
+	// The indices of the faces are local to the chunk until the data of the previous chunks is known.
+	struct ObjChunk
+	{
+		struct RelIndex { unsigned int face; int type; int slots; };	// a face with relative (negative) indices at the given slots
+		struct MtlUse   { unsigned int face; int mtl; std::string name; };
+		char const *begin, *end;
+		bool texturesBefore, normalsBefore;	// true if texture coordinates or normals are used before the chunk
+		bool usesTextures, usesNormals;		// true if the chunk uses texture coordinates or normals
+		bool needsTextures, needsNormals;	// true if the faces of the chunk depend on texturesBefore or normalsBefore
+		bool stopped;						// true if a line beginning with a null character ends the file in this chunk
+		std::vector<Vec3f>      v, vt, vn;
+		std::vector<TriFace>    f, ft, fn;
+		std::vector<RelIndex>   rel;
+		std::vector<MtlUse>     mtlUse;
+		std::vector<MtlLibName> mtlFiles;
+		unsigned int vBase, vtBase, vnBase, fBase, ftBase, fnBase;	// the indices of the first elements in the mesh
+		int mtlIndex;	// the current material at the beginning of the chunk
+		ObjChunk() : begin(nullptr), end(nullptr), texturesBefore(false), normalsBefore(false), usesTextures(false), usesNormals(false), needsTextures(false), needsNormals(false), stopped(false), vBase(0), vtBase(0), vnBase(0), fBase(0), ftBase(0), fnBase(0), mtlIndex(-1) {}
+		void Parse( bool loadMtl );
+	};
+	static int  ReadObjLine  ( char *data, char const *&p, char const *end, bool &eof );
+	static bool IsObjCommand ( char const *data, char const *cmd );
+	static bool ReadObjFloat ( char const *&s, float &f );
+	static void ReadObjVertex( char const *s, Vec3f &v );
+	static bool DecimalToFloat( uint64_t mantissa, int exponent, float &f );	// converts mantissa * 10^exponent to float, if it can be done exactly
+	static double Pow10( int i ) { static double const p[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 }; return p[i]; }	// exact powers of ten up to 1e22
+
+	// OBJ writing
+	static char* WriteObjInt  ( char *s, int i );
+	static char* WriteObjFloat( char *s, float f, int precision );
+	template <typename LINE_FUNC> static bool WriteObjLines( FILE *fp, unsigned int count, size_t maxLineSize, LINE_FUNC const &lineFunc );
 };
 
 //-------------------------------------------------------------------------------
@@ -230,15 +305,33 @@ inline int TriMesh::GetMaterialIndex(int faceID) const
 inline void TriMesh::ComputeBoundingBox()
 {
 	if ( nv > 0 ) {
+		// The vertices are processed in blocks in parallel. Each block begins with the first vertex,
+		// so that the result is identical to a serial loop, even when some vertices are NaN.
+		unsigned int const blockSize = 1 << 16;
+		unsigned int const numBlocks = ( nv + blockSize - 1 ) / blockSize;
+		std::vector<Vec3f> blockMin( numBlocks ), blockMax( numBlocks );
+		auto update = []( Vec3f &bmin, Vec3f &bmax, Vec3f const &p ) {
+			bmin.x = p.x < bmin.x ? p.x : bmin.x;
+			bmin.y = p.y < bmin.y ? p.y : bmin.y;
+			bmin.z = p.z < bmin.z ? p.z : bmin.z;
+			bmax.x = p.x > bmax.x ? p.x : bmax.x;
+			bmax.y = p.y > bmax.y ? p.y : bmax.y;
+			bmax.z = p.z > bmax.z ? p.z : bmax.z;
+		};
+		ParallelFor( 0u, numBlocks, [&]( unsigned int begin, unsigned int end ) {
+			for ( unsigned int b=begin; b<end; b++ ) {
+				Vec3f bmin = v[0], bmax = v[0];
+				unsigned int const last = (std::min)( (b+1)*blockSize, nv );
+				for ( unsigned int i=b*blockSize; i<last; i++ ) update( bmin, bmax, v[i] );
+				blockMin[b] = bmin;
+				blockMax[b] = bmax;
+			}
+		} );
 		boundMin=v[0];
 		boundMax=v[0];
-		for ( unsigned int i=1; i<nv; i++ ) {
-			if ( boundMin.x > v[i].x ) boundMin.x = v[i].x;
-			if ( boundMin.y > v[i].y ) boundMin.y = v[i].y;
-			if ( boundMin.z > v[i].z ) boundMin.z = v[i].z;
-			if ( boundMax.x < v[i].x ) boundMax.x = v[i].x;
-			if ( boundMax.y < v[i].y ) boundMax.y = v[i].y;
-			if ( boundMax.z < v[i].z ) boundMax.z = v[i].z;
+		for ( unsigned int b=0; b<numBlocks; b++ ) {
+			update( boundMin, boundMax, blockMin[b] );
+			update( boundMin, boundMax, blockMax[b] );
 		}
 	} else {
 		boundMin.Set(1,1,1);
@@ -246,27 +339,466 @@ inline void TriMesh::ComputeBoundingBox()
 	}
 }
 
-inline void TriMesh::ComputeNormals(bool clockwise)
+inline void TriMesh::ComputeNormals(bool clockwise, bool angleWeighted)
 {
 	SetNumNormals(nv);
-	for ( unsigned int i=0; i<nvn; i++ ) vn[i].Set(0,0,0);	// initialize all normals to zero
-	for ( unsigned int i=0; i<nf; i++ ) {
+	if ( nv == 0 ) return;
+	unsigned int const grainSize = 1 << 12;
+
+	auto faceNormal = [&]( unsigned int i ) {
 		Vec3f N = (v[f[i].v[1]]-v[f[i].v[0]]) ^ (v[f[i].v[2]]-v[f[i].v[0]]);	// face normal (not normalized)
 		if ( clockwise ) N = -N;
-		vn[f[i].v[0]] += N;
-		vn[f[i].v[1]] += N;
-		vn[f[i].v[2]] += N;
-		fn[i] = f[i];
+		if ( angleWeighted ) N.Normalize();
+		return N;
+	};
+	auto addNormal = [&]( unsigned int i, unsigned int j, Vec3f const &N ) {
+		if ( angleWeighted ) {
+			// weight the normalized face normal by the angle of the face at the vertex
+			Vec3f const &p = v[f[i].v[j]];
+			Vec3f e1 = v[f[i].v[(j+1)%3]] - p;
+			Vec3f e2 = v[f[i].v[(j+2)%3]] - p;
+			float const d = e1.Length() * e2.Length();
+			float const c = d > 0 ? (e1 % e2) / d : 1;
+			vn[f[i].v[j]] += N * acosf( c < -1 ? -1 : ( c > 1 ? 1 : c ) );
+		} else {
+			vn[f[i].v[j]] += N;
+		}
+	};
+
+	if ( GetThreadCount() == 1 ) {
+		for ( unsigned int i=0; i<nvn; i++ ) vn[i].Set(0,0,0);	// initialize all normals to zero
+		for ( unsigned int i=0; i<nf; i++ ) {
+			Vec3f N = faceNormal(i);
+			if ( angleWeighted ) {
+				for ( unsigned int j=0; j<3; j++ ) addNormal( i, j, N );
+			} else {
+				vn[f[i].v[0]] += N;
+				vn[f[i].v[1]] += N;
+				vn[f[i].v[2]] += N;
+			}
+			fn[i] = f[i];
+		}
+		for ( unsigned int i=0; i<nvn; i++ ) vn[i].Normalize();
+		return;
+	}
+
+	// Compute the face normals in parallel
+	std::vector<Vec3f> faceNormals( nf );
+	ParallelFor( 0u, nf, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int i=begin; i<end; i++ ) {
+			faceNormals[i] = faceNormal(i);
+			fn[i] = f[i];
+		}
+	}, grainSize );
+
+	// Group the face corners by vertex ranges, keeping them in face order within each range.
+	// Then, the normals of each vertex range are accumulated in parallel, adding the face normals in
+	// the same order as a serial loop over the faces, so the results do not depend on the thread count.
+	unsigned int const numParts  = 8 * (unsigned int) GetThreadCount();
+	unsigned int const numRanges = (std::min)( numParts, nv );
+	unsigned int const numChunks = (std::max)( 1u, (std::min)( numParts, nf ) );
+	auto rangeOf    = [&]( unsigned int i ) { return (unsigned int)( uint64_t(i) * numRanges / nv ); };
+	auto chunkBegin = [&]( unsigned int c ) { return (unsigned int)( uint64_t(c) * nf / numChunks ); };
+	std::vector<unsigned int> cornerCount( numChunks * numRanges, 0 );
+	ParallelFor( 0u, numChunks, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int c=begin; c<end; c++ ) {
+			unsigned int *count = &cornerCount[ c*numRanges ];
+			for ( unsigned int i=chunkBegin(c); i<chunkBegin(c+1); i++ ) {
+				for ( int j=0; j<3; j++ ) if ( f[i].v[j] < nv ) count[ rangeOf(f[i].v[j]) ]++;
+			}
+		}
+	} );
+	std::vector<unsigned int> rangeBegin( numRanges+1 );
+	unsigned int numCorners = 0;
+	for ( unsigned int r=0; r<numRanges; r++ ) {
+		rangeBegin[r] = numCorners;
+		for ( unsigned int c=0; c<numChunks; c++ ) {
+			unsigned int n = cornerCount[ c*numRanges + r ];
+			cornerCount[ c*numRanges + r ] = numCorners;
+			numCorners += n;
+		}
+	}
+	rangeBegin[numRanges] = numCorners;
+	std::vector<unsigned int> corners( numCorners );	// face index * 3 + corner index
+	ParallelFor( 0u, numChunks, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int c=begin; c<end; c++ ) {
+			unsigned int *pos = &cornerCount[ c*numRanges ];
+			for ( unsigned int i=chunkBegin(c); i<chunkBegin(c+1); i++ ) {
+				for ( unsigned int j=0; j<3; j++ ) if ( f[i].v[j] < nv ) corners[ pos[ rangeOf(f[i].v[j]) ]++ ] = i*3 + j;
+			}
+		}
+	} );
+
+	ParallelFor( 0u, nvn, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int i=begin; i<end; i++ ) vn[i].Set(0,0,0);	// initialize all normals to zero
+	}, grainSize );
+	ParallelFor( 0u, numRanges, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int r=begin; r<end; r++ ) {
+			for ( unsigned int k=rangeBegin[r]; k<rangeBegin[r+1]; k++ ) {
+				addNormal( corners[k] / 3, corners[k] % 3, faceNormals[ corners[k] / 3 ] );
+			}
+		}
+	} );
+	ParallelFor( 0u, nvn, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int i=begin; i<end; i++ ) vn[i].Normalize();
+	}, grainSize );
+}
+
+inline int TriMesh::BuildIndexedBuffers( std::vector<float> &vertexBuffer, std::vector<uint32_t> &indexBuffer, int texCoordComponents ) const
+{
+	bool const useNormals   = nvn > 0 && fn != nullptr;
+	bool const useTexCoords = nvt > 0 && ft != nullptr && texCoordComponents > 0;
+	int  const texCoordSize = useTexCoords ? (std::min)( texCoordComponents, 3 ) : 0;
+	int  const vertexSize   = 3 + ( useNormals ? 3 : 0 ) + texCoordSize;
+	unsigned int const numCorners = nf * 3;
+	unsigned int const grainSize  = 1 << 12;
+
+	auto sameVertex = [&]( unsigned int c0, unsigned int c1 ) {
+		unsigned int const i0=c0/3, j0=c0%3, i1=c1/3, j1=c1%3;
+		return f[i0].v[j0] == f[i1].v[j1] && ( !useTexCoords || ft[i0].v[j0] == ft[i1].v[j1] ) && ( !useNormals || fn[i0].v[j0] == fn[i1].v[j1] );
+	};
+	auto hash = [&]( unsigned int c ) {
+		unsigned int const i=c/3, j=c%3;
+		uint64_t h = f[i].v[j];
+		if ( useTexCoords ) h = h * 0x9E3779B97F4A7C15ull + ft[i].v[j];
+		if ( useNormals   ) h = h * 0x9E3779B97F4A7C15ull + fn[i].v[j];
+		h ^= h >> 31;
+		h *= 0xBF58476D1CE4E5B9ull;
+		h ^= h >> 29;
+		return h;
+	};
+
+	// Insert the face corners into a hash table in parallel. The slots keep the first face corner (plus one)
+	// with each unique combination of position, texture coordinate, and normal indices, so that the result
+	// does not depend on the order of the insertions. The table is sized for the worst case with no shared vertices.
+	uint64_t tableSize = 64;
+	while ( tableSize < uint64_t(nf) * 4 ) tableSize *= 2;
+	uint64_t const tableMask = tableSize - 1;
+	std::vector< std::atomic<uint32_t> > table( (size_t) tableSize );
+	ParallelFor( 0u, numCorners, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int c=begin; c<end; c++ ) {
+			for ( uint64_t s = hash(c) & tableMask; ; s = ( s + 1 ) & tableMask ) {
+				uint32_t e = table[s].load( std::memory_order_relaxed );
+				if ( e == 0 && table[s].compare_exchange_strong( e, c+1 ) ) break;
+				if ( sameVertex( e-1, c ) ) {
+					while ( e > c+1 && ! table[s].compare_exchange_weak( e, c+1 ) ) {}
+					break;
+				}
+			}
+		}
+	}, grainSize );
+
+	// Find the first face corner with the same vertex for all corners
+	std::vector<uint32_t> first( numCorners );
+	ParallelFor( 0u, numCorners, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int c=begin; c<end; c++ ) {
+			uint64_t s = hash(c) & tableMask;
+			while ( ! sameVertex( table[s].load( std::memory_order_relaxed ) - 1, c ) ) s = ( s + 1 ) & tableMask;
+			first[c] = table[s].load( std::memory_order_relaxed ) - 1;
+		}
+	}, grainSize );
+	std::vector< std::atomic<uint32_t> >().swap( table );
+
+	// Number the vertices in the order of their first corners
+	unsigned int const chunkSize = 1 << 16;
+	unsigned int const numChunks = ( numCorners + chunkSize - 1 ) / chunkSize;
+	std::vector<unsigned int> chunkFirstVertex( numChunks + 1, 0 );
+	ParallelFor( 0u, numChunks, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int k=begin; k<end; k++ ) {
+			unsigned int const last = (std::min)( (k+1)*chunkSize, numCorners );
+			for ( unsigned int c=k*chunkSize; c<last; c++ ) if ( first[c] == c ) chunkFirstVertex[k+1]++;
+		}
+	} );
+	for ( unsigned int k=0; k<numChunks; k++ ) chunkFirstVertex[k+1] += chunkFirstVertex[k];
+	unsigned int const numVertices = chunkFirstVertex[numChunks];
+
+	// Fill the vertex buffer and the index buffer
+	vertexBuffer.resize( size_t(numVertices) * vertexSize );
+	indexBuffer.resize( numCorners );
+	ParallelFor( 0u, numChunks, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int k=begin; k<end; k++ ) {
+			unsigned int id = chunkFirstVertex[k];
+			unsigned int const last = (std::min)( (k+1)*chunkSize, numCorners );
+			for ( unsigned int c=k*chunkSize; c<last; c++ ) {
+				if ( first[c] != c ) continue;
+				unsigned int const i=c/3, j=c%3;
+				float *vb = &vertexBuffer[ size_t(id) * vertexSize ];
+				Vec3f const &p = v[ f[i].v[j] ];
+				*vb++ = p.x;  *vb++ = p.y;  *vb++ = p.z;
+				if ( useNormals ) {
+					Vec3f const &n = vn[ fn[i].v[j] ];
+					*vb++ = n.x;  *vb++ = n.y;  *vb++ = n.z;
+				}
+				Vec3f const &t = useTexCoords ? vt[ ft[i].v[j] ] : p;
+				for ( int d=0; d<texCoordSize; d++ ) *vb++ = t[d];
+				indexBuffer[c] = id++;
+			}
+		}
+	} );
+	ParallelFor( 0u, numCorners, [&]( unsigned int begin, unsigned int end ) {
+		for ( unsigned int c=begin; c<end; c++ ) if ( first[c] != c ) indexBuffer[c] = indexBuffer[ first[c] ];
+	}, grainSize );
+	return vertexSize;
+}
+
+inline int TriMesh::ReadObjLine( char *data, char const *&p, char const *end, bool &eof )
+{
+	// Reads the next line exactly like the Buffer::ReadLine method of LoadFromFileObj reads a file,
+	// skipping comments and empty space, and replacing all white-space characters with a single space.
+	auto isSpace = []( char c ) { return c==' ' || ( c>='\t' && c<='\r' ); };
+	auto getChar = [&]() -> char { if ( p < end ) return *p++; eof = true; return char(EOF); };
+	char c = getChar();
+	while ( !eof ) {
+		while ( isSpace(c) ) c = getChar();	// skip empty space
+		if ( c == '#' ) while ( !eof && c!='\n' && c!='\r' && c!='\0' ) c = getChar();	// skip comment line
+		else break;
+	}
+	int i=0;
+	bool inspace = false;
+	while ( i<1024-1 ) {
+		if ( eof ) break;
+		if ( (unsigned char) c > ' ' ) {
+			// copy the following characters up to the next white-space or control character at once
+			if ( inspace ) data[i++] = ' ';
+			inspace = false;
+			data[i++] = c;
+			char const *s = p;
+			char const *e = p + (std::min)( end-p, ptrdiff_t(1024-1-i) );
+			while ( s<e && (unsigned char)*s > ' ' ) data[i++] = *s++;
+			p = s;
+		} else {
+			if ( c=='\n' || c=='\r' || c=='\0' ) break;
+			if ( isSpace(c) ) inspace = true;
+			else {
+				if ( inspace ) data[i++] = ' ';
+				inspace = false;
+				data[i++] = c;
+			}
+		}
+		c = getChar();
+	}
+	data[i] = '\0';
+	return i;
+}
+
+inline bool TriMesh::IsObjCommand( char const *data, char const *cmd )
+{
+	int i=0;
+	while ( cmd[i]!='\0' ) {
+		if ( cmd[i] != data[i] ) return false;
+		i++;
+	}
+	return (data[i]=='\0' || data[i]==' ');
+}
+
+inline bool TriMesh::ReadObjFloat( char const *&s, float &f )
+{
+	// Reads a decimal number, if it can be converted to the same float value as sscanf without rounding twice.
+	// Returns false for all other numbers, which must be read using sscanf.
+	char const *c = s;
+	bool negative = ( *c == '-' );
+	if ( *c == '-' || *c == '+' ) c++;
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool hasDigits = false;
+	for ( ; *c >= '0' && *c <= '9'; c++ ) {
+		hasDigits = true;
+		if ( mantissa == 0 && *c == '0' ) continue;
+		if ( ++digits > 19 ) return false;
+		mantissa = mantissa*10 + (*c-'0');
+	}
+	if ( *c == '.' ) {
+		for ( c++; *c >= '0' && *c <= '9'; c++ ) {
+			hasDigits = true;
+			exponent--;
+			if ( mantissa == 0 && *c == '0' ) continue;
+			if ( ++digits > 19 ) return false;
+			mantissa = mantissa*10 + (*c-'0');
+		}
+	}
+	if ( !hasDigits ) return false;
+	if ( *c == 'e' || *c == 'E' ) {
+		c++;
+		bool negativeExp = ( *c == '-' );
+		if ( *c == '-' || *c == '+' ) c++;
+		if ( *c < '0' || *c > '9' ) return false;
+		int e = 0;
+		for ( ; *c >= '0' && *c <= '9'; c++ ) if ( e < 1000 ) e = e*10 + (*c-'0');
+		exponent += negativeExp ? -e : e;
+	}
+	float value = 0;
+	if ( mantissa > 0 && !DecimalToFloat( mantissa, exponent, value ) ) return false;
+	f = negative ? -value : value;
+	s = c;
+	return true;
+}
+
+inline bool TriMesh::DecimalToFloat( uint64_t mantissa, int exponent, float &f )
+{
+	// Both the mantissa and the power of ten are exact doubles, so d is correctly rounded.
+	if ( mantissa > (uint64_t(1)<<53) || exponent < -22 || exponent > 22 ) return false;
+	double d = exponent < 0 ? double(mantissa) / Pow10(-exponent) : double(mantissa) * Pow10(exponent);
+	// Rounding d to float gives the correctly rounded result, unless d is exactly halfway between two floats
+	// or it is a denormal or overflowing float.
+	if ( d < (std::numeric_limits<float>::min)() || d > (std::numeric_limits<float>::max)() ) return false;
+	uint64_t bits;
+	memcpy( &bits, &d, sizeof(d) );
+	if ( ( bits & 0x1FFFFFFF ) == 0x10000000 ) return false;
+	f = float(d);
+	return true;
+}
+
+inline void TriMesh::ReadObjVertex( char const *s, Vec3f &v )
+{
+	// Same as sscanf( s, "%f %f %f", &v.x, &v.y, &v.z ) after zeroing v, but much faster for decimal numbers
+	float val[3] = { 0, 0, 0 };
+	char const *c = s;
+	for ( int i=0; i<3; i++ ) {
+		while ( *c == ' ' ) c++;
+		if ( *c == '\0' ) break;
+		if ( !ReadObjFloat( c, val[i] ) || ( *c != ' ' && *c != '\0' ) ) {
+			v.Zero();
+			sscanf( s, "%f %f %f", &v.x, &v.y, &v.z );
+			return;
+		}
+	}
+	v.Set( val[0], val[1], val[2] );
+}
+
+inline void TriMesh::ObjChunk::Parse( bool loadMtl )
+{
+	v.clear(); vt.clear(); vn.clear();
+	f.clear(); ft.clear(); fn.clear();
+	rel.clear(); mtlUse.clear(); mtlFiles.clear();
+	usesTextures = usesNormals = needsTextures = needsNormals = stopped = false;
+	bool hasTextures = texturesBefore, hasNormals = normalsBefore;
+
+	char data[1024+1] = {};
+	char const *p = begin;
+	bool eof = false;
+	for (;;) {
+		int rb = ReadObjLine( data, p, end, eof );
+		if ( rb == 0 ) {
+			stopped = !eof;
+			break;
+		}
+		if ( IsObjCommand(data,"v") ) {
+			Vec3f vertex;
+			ReadObjVertex( data+2, vertex );
+			v.push_back(vertex);
+		}
+		else if ( IsObjCommand(data,"vt") ) {
+			Vec3f texVert;
+			ReadObjVertex( data+2, texVert );
+			vt.push_back(texVert);
+			hasTextures = usesTextures = true;
+		}
+		else if ( IsObjCommand(data,"vn") ) {
+			Vec3f normal;
+			ReadObjVertex( data+2, normal );
+			vn.push_back(normal);
+			hasNormals = usesNormals = true;
+		}
+		else if ( IsObjCommand(data,"f") ) {
+			int facevert = -1;
+			bool inspace = true;
+			bool negative = false;
+			int type = 0;
+			unsigned int index = 0;
+			TriFace face = {}, textureFace = {}, normalFace = {};
+			int relFace = 0, relTexture = 0, relNormal = 0;	// the bits of the relative indices
+			auto addFace = [&]() {
+				if ( relFace ) { RelIndex r = { (unsigned int)f.size(), 0, relFace }; rel.push_back(r); }
+				f.push_back(face);
+				if ( hasTextures ) {
+					if ( relTexture ) { RelIndex r = { (unsigned int)ft.size(), 1, relTexture }; rel.push_back(r); }
+					ft.push_back(textureFace);
+				} else needsTextures = true;
+				if ( hasNormals ) {
+					if ( relNormal ) { RelIndex r = { (unsigned int)fn.size(), 2, relNormal }; rel.push_back(r); }
+					fn.push_back(normalFace);
+				} else needsNormals = true;
+			};
+			auto copyRel = []( int &bits ) { bits = ( bits & ~2 ) | ( ( bits >> 1 ) & 2 ); };
+			for ( int i=2; i<rb; i++ ) {
+				if ( data[i] == ' ' ) inspace = true;
+				else {
+					if ( inspace ) {
+						inspace=false;
+						negative = false;
+						type=0;
+						index=0;
+						if ( facevert < 2 ) facevert++;
+						else {
+							// copy the first two vertices from the previous face
+							addFace();
+							face.v[1] = face.v[2];
+							copyRel(relFace);
+							if ( hasTextures ) {
+								textureFace.v[1] = textureFace.v[2];
+								copyRel(relTexture);
+							}
+							if ( hasNormals ) {
+								normalFace.v[1] = normalFace.v[2];
+								copyRel(relNormal);
+							}
+						}
+					}
+					if ( data[i] == '/' ) { type++; index=0; }
+					if ( data[i] == '-' ) negative = true;
+					if ( data[i] >= '0' && data[i] <= '9' ) {
+						index = index*10 + (data[i]-'0');
+						while ( data[i+1] >= '0' && data[i+1] <= '9' ) index = index*10 + (data[++i]-'0');
+						int bit = 1 << facevert;
+						switch ( type ) {
+							case 0: face.v       [facevert] = negative ? (unsigned int)v. size()-index : index-1; relFace    = negative ? (relFace   |bit) : (relFace   &~bit); break;
+							case 1: textureFace.v[facevert] = negative ? (unsigned int)vt.size()-index : index-1; relTexture = negative ? (relTexture|bit) : (relTexture&~bit); hasTextures=usesTextures=true; break;
+							case 2: normalFace.v [facevert] = negative ? (unsigned int)vn.size()-index : index-1; relNormal  = negative ? (relNormal |bit) : (relNormal &~bit); hasNormals =usesNormals =true; break;
+						}
+					}
+				}
+			}
+			addFace();
+		}
+		else if ( loadMtl ) {
+			if ( IsObjCommand(data,"usemtl") ) {
+				MtlUse use;
+				use.face = (unsigned int)f.size();
+				use.mtl  = -1;
+				use.name = data+7;
+				mtlUse.push_back(use);
+			}
+			if ( IsObjCommand(data,"mtllib") ) {
+				MtlLibName libName;
+				libName.filename = data+7;
+				mtlFiles.push_back(libName);
+			}
+		}
+		if ( eof ) break;
 	}
-	for ( unsigned int i=0; i<nvn; i++ ) vn[i].Normalize();
 }
 
 inline bool TriMesh::LoadFromFileObj( char const *filename, bool loadMtl, std::ostream *outStream )
 {
-	FILE *fp = fopen(filename,"r");
-	if ( !fp ) {
-		if ( outStream ) *outStream << "ERROR: Cannot open file " << filename << std::endl;
-		return false;
+	// Map the file to memory. Files that cannot be mapped (such as empty files) are read to memory instead.
+	MappedFile mappedFile;
+	std::vector<char> fileData;
+	char const *fileBegin = nullptr;
+	size_t fileSize = 0;
+	if ( mappedFile.Open(filename) ) {
+		fileBegin = (char const *) mappedFile.GetData();
+		fileSize  = mappedFile.GetSize();
+	} else {
+		FILE *fp = fopen(filename,"rb");
+		if ( !fp ) {
+			if ( outStream ) *outStream << "ERROR: Cannot open file " << filename << std::endl;
+			return false;
+		}
+		char block[4096];
+		while ( size_t n = fread(block,1,sizeof(block),fp) ) fileData.insert( fileData.end(), block, block+n );
+		fclose(fp);
+		fileBegin = fileData.data();
+		fileSize  = fileData.size();
 	}
 
 	Clear();
@@ -347,152 +879,140 @@ inline bool TriMesh::LoadFromFileObj( char const *filename, bool loadMtl, std::o
 	};
 	MtlList mtlList;
 
-	std::vector<Vec3f>      _v;		// vertices
-	std::vector<TriFace>    _f;		// faces
-	std::vector<Vec3f>      _vn;	// vertex normal
-	std::vector<TriFace>    _fn;	// normal faces
-	std::vector<Vec3f>      _vt;	// texture vertices
-	std::vector<TriFace>    _ft;	// texture faces
-	std::vector<MtlLibName> mtlFiles;
-	std::vector<int>        faceMtlIndex;
+	// Split the file into chunks at line boundaries and parse them in parallel.
+	// Since the face indices depend on whether texture coordinates and normals are used earlier in the file,
+	// the chunks are first parsed assuming that they are not used before, and the chunks for which this
+	// assumption is wrong are parsed again once all chunks are parsed.
+	std::vector<ObjChunk> chunks;
+	size_t const chunkSize = 1 << 20;
+	for ( char const *p=fileBegin, *fileEnd=fileBegin+fileSize; p<fileEnd; ) {
+		char const *e = fileEnd;
+		if ( size_t(fileEnd-p) > chunkSize ) {
+			e = (char const *) memchr( p+chunkSize, '\n', fileEnd-p-chunkSize );
+			e = e ? e+1 : fileEnd;
+		}
+		chunks.push_back( ObjChunk() );
+		chunks.back().begin = p;
+		chunks.back().end   = e;
+		p = e;
+	}
+	ParallelFor( size_t(0), chunks.size(), [&]( size_t begin, size_t end ) {
+		for ( size_t i=begin; i<end; i++ ) chunks[i].Parse(loadMtl);
+	} );
+	for ( size_t i=0; i<chunks.size(); i++ ) {
+		if ( chunks[i].stopped ) { chunks.resize(i+1); break; }
+	}
+	std::vector<size_t> reparse;
+	for ( size_t i=1; i<chunks.size(); i++ ) {
+		ObjChunk const &p = chunks[i-1];
+		ObjChunk &c = chunks[i];
+		c.texturesBefore = p.texturesBefore || p.usesTextures;
+		c.normalsBefore  = p.normalsBefore  || p.usesNormals;
+		if ( ( c.texturesBefore && c.needsTextures ) || ( c.normalsBefore && c.needsNormals ) ) reparse.push_back(i);
+	}
+	ParallelFor( size_t(0), reparse.size(), [&]( size_t begin, size_t end ) {
+		for ( size_t i=begin; i<end; i++ ) chunks[ reparse[i] ].Parse(loadMtl);
+	} );
 
+	// Find where the data of each chunk begins and create the materials in the order they are used
+	std::vector<MtlLibName> mtlFiles;
+	unsigned int numV=0, numVT=0, numVN=0, numF=0, numFT=0, numFN=0;
 	int currentMtlIndex = -1;
-	bool hasTextures=false, hasNormals=false;
-
-	while ( int rb = buffer.ReadLine(fp) ) {
-		if ( buffer.IsCommand("v") ) {
-			Vec3f vertex;
-			buffer.ReadVertex(vertex);
-			_v.push_back(vertex);
-		}
-		else if ( buffer.IsCommand("vt") ) {
-			Vec3f texVert;
-			buffer.ReadVertex(texVert);
-			_vt.push_back(texVert);
-			hasTextures = true;
-		}
-		else if ( buffer.IsCommand("vn") ) {
-			Vec3f normal;
-			buffer.ReadVertex(normal);
-			_vn.push_back(normal);
-			hasNormals = true;
-		}
-		else if ( buffer.IsCommand("f") ) {
-			int facevert = -1;
-			bool inspace = true;
-			bool negative = false;
-			int type = 0;
-			unsigned int index;
-			TriFace face, textureFace, normalFace;
-			unsigned int nFacesBefore = (unsigned int)_f.size();
-			for ( int i=2; i<rb; i++ ) {
-				if ( buffer[i] == ' ' ) inspace = true;
-				else {
-					if ( inspace ) {
-						inspace=false;
-						negative = false;
-						type=0;
-						index=0;
-						switch ( facevert ) {
-							case -1:
-								// initialize face
-								face.v[0] = face.v[1] = face.v[2] = 0;
-								textureFace.v[0] = textureFace.v[1] = textureFace.v[2] = 0;
-								normalFace. v[0] = normalFace. v[1] = normalFace. v[2] = 0;
-							case 0:
-							case 1:
-								facevert++;
-								break;
-							case 2:
-								// copy the first two vertices from the previous face
-								_f.push_back(face);
-								face.v[1] = face.v[2];
-								if ( hasTextures ) {
-									_ft.push_back(textureFace);
-									textureFace.v[1] = textureFace.v[2];
-								}
-								if ( hasNormals ) {
-									_fn.push_back(normalFace);
-									normalFace.v[1] = normalFace.v[2];
-								}
-								faceMtlIndex.push_back(currentMtlIndex);
-								break;
-						}
-					}
-					if ( buffer[i] == '/' ) { type++; index=0; }
-					if ( buffer[i] == '-' ) negative = true;
-					if ( buffer[i] >= '0' && buffer[i] <= '9' ) {
-						index = index*10 + (buffer[i]-'0');
-						switch ( type ) {
-							case 0: face.v       [facevert] = negative ? (unsigned int)_v. size()-index : index-1; break;
-							case 1: textureFace.v[facevert] = negative ? (unsigned int)_vt.size()-index : index-1; hasTextures=true; break;
-							case 2: normalFace.v [facevert] = negative ? (unsigned int)_vn.size()-index : index-1; hasNormals =true; break;
-						}
-					}
-				}
-			}
-			_f.push_back(face);
-			if ( hasTextures ) _ft.push_back(textureFace);
-			if ( hasNormals  ) _fn.push_back(normalFace);
-			faceMtlIndex.push_back(currentMtlIndex);
-			if ( currentMtlIndex>=0 ) mtlList.mtlData[currentMtlIndex].faceCount += (unsigned int)_f.size() - nFacesBefore;
+	for ( size_t i=0; i<chunks.size(); i++ ) {
+		ObjChunk &c = chunks[i];
+		c.vBase  = numV;  numV  += (unsigned int) c.v .size();
+		c.vtBase = numVT; numVT += (unsigned int) c.vt.size();
+		c.vnBase = numVN; numVN += (unsigned int) c.vn.size();
+		c.fBase  = numF;  numF  += (unsigned int) c.f .size();
+		c.ftBase = numFT; numFT += (unsigned int) c.ft.size();
+		c.fnBase = numFN; numFN += (unsigned int) c.fn.size();
+		c.mtlIndex = currentMtlIndex;
+		for ( size_t j=0; j<c.mtlUse.size(); j++ ) {
+			c.mtlUse[j].mtl = currentMtlIndex = mtlList.CreateMtl( c.mtlUse[j].name.c_str(), c.fBase + c.mtlUse[j].face );
 		}
-		else if ( loadMtl ) {
-			if ( buffer.IsCommand("usemtl") ) {
-				currentMtlIndex = mtlList.CreateMtl(buffer.Data(7), (unsigned int)_f.size());
-			}
-			if ( buffer.IsCommand("mtllib") ) {
-				MtlLibName libName;
-				libName.filename = buffer.Data(7);
-				mtlFiles.push_back(libName);
-			}
-		}
-		if ( feof(fp) ) break;
+		mtlFiles.insert( mtlFiles.end(), c.mtlFiles.begin(), c.mtlFiles.end() );
 	}
+	int const numMtls = (int) mtlList.mtlData.size();
+	auto countFaces = [&]( std::vector<unsigned int> &count, ObjChunk const &c ) {
+		int mtl = c.mtlIndex;
+		unsigned int faceBegin = 0;
+		for ( size_t j=0; j<=c.mtlUse.size(); j++ ) {
+			unsigned int faceEnd = j < c.mtlUse.size() ? c.mtlUse[j].face : (unsigned int) c.f.size();
+			count[ mtl >= 0 && mtl < numMtls ? mtl : numMtls ] += faceEnd - faceBegin;
+			if ( j < c.mtlUse.size() ) { mtl = c.mtlUse[j].mtl; faceBegin = faceEnd; }
+		}
+	};
+	std::vector<unsigned int> mtlFaceCount( numMtls+1, 0 );
+	for ( size_t i=0; i<chunks.size(); i++ ) countFaces( mtlFaceCount, chunks[i] );
+	for ( int i=0; i<numMtls; i++ ) mtlList.mtlData[i].faceCount = mtlFaceCount[i];
 
-	fclose(fp);
-
-
-	if ( _f.size() == 0 ) return true; // No faces found
-	SetNumVertex((unsigned int)_v.size());
-	SetNumFaces((unsigned int)_f.size());
-	SetNumTexVerts((unsigned int)_vt.size());
-	SetNumNormals((unsigned int)_vn.size());
-	if ( loadMtl ) SetNumMtls((unsigned int)mtlList.mtlData.size());
+	if ( numF == 0 ) return true; // No faces found
+	SetNumVertex(numV);
+	SetNumFaces(numF);
+	SetNumTexVerts(numVT);
+	SetNumNormals(numVN);
+	if ( loadMtl ) SetNumMtls((unsigned int)numMtls);
 
-	// Copy data
-	memcpy(v, _v.data(), sizeof(Vec3f)*_v.size());
-	if ( _vt.size() > 0 ) memcpy(vt, _vt.data(), sizeof(Vec3f)*_vt.size());
-	if ( _vn.size() > 0 ) memcpy(vn, _vn.data(), sizeof(Vec3f)*_vn.size());
+	// Convert the relative indices and copy data
+	ParallelFor( size_t(0), chunks.size(), [&]( size_t begin, size_t end ) {
+		for ( size_t i=begin; i<end; i++ ) {
+			ObjChunk &c = chunks[i];
+			for ( size_t j=0; j<c.rel.size(); j++ ) {
+				ObjChunk::RelIndex const &r = c.rel[j];
+				TriFace &face = r.type==0 ? c.f[r.face] : ( r.type==1 ? c.ft[r.face] : c.fn[r.face] );
+				unsigned int base = r.type==0 ? c.vBase : ( r.type==1 ? c.vtBase : c.vnBase );
+				for ( int k=0; k<3; k++ ) if ( r.slots & (1<<k) ) face.v[k] += base;
+			}
+			if ( c.v .size() > 0 ) memcpy( v  + c.vBase,  c.v .data(), sizeof(Vec3f)*c.v .size() );
+			if ( c.vt.size() > 0 ) memcpy( vt + c.vtBase, c.vt.data(), sizeof(Vec3f)*c.vt.size() );
+			if ( c.vn.size() > 0 ) memcpy( vn + c.vnBase, c.vn.data(), sizeof(Vec3f)*c.vn.size() );
+		}
+	} );
 
-	if ( mtlList.mtlData.size() > 0 ) {
+	if ( numMtls > 0 ) {
+		// The faces are grouped by their materials in the order they appear in the file, followed by the faces without a material.
+		std::vector< std::vector<unsigned int> > chunkFaceStart( chunks.size(), std::vector<unsigned int>( numMtls+1, 0 ) );
+		ParallelFor( size_t(0), chunks.size(), [&]( size_t begin, size_t end ) {
+			for ( size_t i=begin; i<end; i++ ) countFaces( chunkFaceStart[i], chunks[i] );
+		} );
 		unsigned int fid = 0;
-		for ( int m=0; m<(int)mtlList.mtlData.size(); m++ ) {
-			for ( unsigned int i=mtlList.mtlData[m].firstFace, j=0; j<mtlList.mtlData[m].faceCount && i<_f.size(); i++ ) {
-				if ( faceMtlIndex[i] == m ) {
-					f[fid] = _f[i];
-					if ( fn ) fn[fid] = _fn[i];
-					if ( ft ) ft[fid] = _ft[i];
-					fid++;
-					j++;
-				}
+		for ( int m=0; m<=numMtls; m++ ) {
+			for ( size_t i=0; i<chunks.size(); i++ ) {
+				unsigned int n = chunkFaceStart[i][m];
+				chunkFaceStart[i][m] = fid;
+				fid += n;
 			}
-			mcfc[m] = fid;
+			if ( m < numMtls ) mcfc[m] = fid;
 		}
-		if ( fid <_f.size() ) {
-			for ( unsigned int i=0; i<_f.size(); i++ ) {
-				if ( faceMtlIndex[i] < 0 ) {
-					f[fid] = _f[i];
-					if ( fn ) fn[fid] = _fn[i];
-					if ( ft ) ft[fid] = _ft[i];
-					fid++;
+		std::vector<unsigned int> faceTarget( numF );
+		ParallelFor( size_t(0), chunks.size(), [&]( size_t begin, size_t end ) {
+			for ( size_t i=begin; i<end; i++ ) {
+				ObjChunk const &c = chunks[i];
+				std::vector<unsigned int> &start = chunkFaceStart[i];
+				int mtl = c.mtlIndex;
+				for ( unsigned int j=0, k=0; j<c.f.size(); j++ ) {
+					for ( ; k<c.mtlUse.size() && c.mtlUse[k].face<=j; k++ ) mtl = c.mtlUse[k].mtl;
+					faceTarget[ c.fBase + j ] = start[ mtl >= 0 && mtl < numMtls ? mtl : numMtls ]++;
 				}
 			}
-		}
+		} );
+		ParallelFor( size_t(0), chunks.size(), [&]( size_t begin, size_t end ) {
+			for ( size_t i=begin; i<end; i++ ) {
+				ObjChunk const &c = chunks[i];
+				for ( size_t j=0; j<c.f.size(); j++ ) f[ faceTarget[ c.fBase + j ] ] = c.f[j];
+				if ( ft ) for ( size_t j=0; j<c.ft.size() && c.ftBase+j<numF; j++ ) ft[ faceTarget[ c.ftBase + j ] ] = c.ft[j];
+				if ( fn ) for ( size_t j=0; j<c.fn.size() && c.fnBase+j<numF; j++ ) fn[ faceTarget[ c.fnBase + j ] ] = c.fn[j];
+			}
+		} );
 	} else {
-		memcpy(f, _f.data(), sizeof(TriFace)*_f.size());
-		if ( ft ) memcpy(ft, _ft.data(), sizeof(TriFace)*_ft.size());
-		if ( fn ) memcpy(fn, _fn.data(), sizeof(TriFace)*_fn.size());
+		ParallelFor( size_t(0), chunks.size(), [&]( size_t begin, size_t end ) {
+			for ( size_t i=begin; i<end; i++ ) {
+				ObjChunk const &c = chunks[i];
+				if ( c.f.size() > 0 ) memcpy( f + c.fBase, c.f.data(), sizeof(TriFace)*c.f.size() );
+				if ( ft && c.ft.size() > 0 ) memcpy( ft + c.ftBase, c.ft.data(), sizeof(TriFace)*c.ft.size() );
+				if ( fn && c.fn.size() > 0 ) memcpy( fn + c.fnBase, c.fn.data(), sizeof(TriFace)*c.fn.size() );
+			}
+		} );
 	}
 
 
@@ -549,7 +1069,138 @@ inline bool TriMesh::LoadFromFileObj( char const *filename, bool loadMtl, std::o
 
 //-------------------------------------------------------------------------------
 
-inline bool TriMesh::SaveToFileObj( char const *filename, std::ostream *outStream )
+inline char* TriMesh::WriteObjInt( char *s, int i )
+{
+	unsigned int u = (unsigned int) i;
+	if ( i < 0 ) { *s++ = '-'; u = 0u - u; }
+	char digits[10];
+	int n = 0;
+	do { digits[n++] = char('0' + u % 10); u /= 10; } while ( u );
+	while ( n > 0 ) *s++ = digits[--n];
+	return s;
+}
+
+inline char* TriMesh::WriteObjFloat( char *s, float f, int precision )
+{
+	uint32_t bits;
+	memcpy( &bits, &f, sizeof(f) );
+	bool const negative = ( bits >> 31 ) != 0;
+	int const biasedExp = int( ( bits >> 23 ) & 0xFF );
+	if ( biasedExp == 0xFF ) return s + sprintf( s, "%f", f );	// inf or nan
+
+	if ( precision >= 0 ) {
+		// The exact value of f is mantissa * 2^exponent, so f * 10^precision = mantissa * 5^precision * 2^(exponent+precision),
+		// which is rounded to an integer exactly like printf's %f format rounds the value, unless it does not fit in 64 bits.
+		static uint64_t const pow5 [] = { 1ull, 5ull, 25ull, 125ull, 625ull, 3125ull, 15625ull, 78125ull, 390625ull, 1953125ull, 9765625ull, 48828125ull, 244140625ull };
+		uint64_t mantissa = bits & 0x7FFFFF;
+		int exponent = -149;
+		if ( biasedExp > 0 ) { mantissa |= 0x800000; exponent = biasedExp - 150; }
+		int const shift = exponent + precision;
+		uint64_t n = mantissa * pow5[ (std::min)(precision,12) ];
+		if ( precision > 12 || ( shift >= 0 && ( shift > 63 || ( n >> (63-shift) ) != 0 ) ) ) {
+			return s + sprintf( s, "%.*f", precision, f );
+		}
+		uint64_t q = 0;
+		if ( shift >= 0 ) q = n << shift;
+		else if ( shift > -64 ) {
+			uint64_t const half = uint64_t(1) << (-shift-1);
+			uint64_t const rem  = n & ( (half<<1) - 1 );
+			q = n >> -shift;
+			if ( rem > half || ( rem == half && ( q & 1 ) ) ) q++;	// round half to even
+		}
+		if ( negative ) *s++ = '-';
+		uint64_t const scale = pow5[precision] << precision;	// 10^precision
+		uint64_t intPart = q / scale;
+		char digits[20];
+		int nd = 0;
+		do { digits[nd++] = char('0' + intPart % 10); intPart /= 10; } while ( intPart );
+		while ( nd > 0 ) *s++ = digits[--nd];
+		if ( precision > 0 ) {
+			*s++ = '.';
+			uint64_t frac = q % scale;
+			for ( int i=precision-1; i>=0; i-- ) { s[i] = char('0' + frac % 10); frac /= 10; }
+			s += precision;
+		}
+		return s;
+	}
+
+	// Find the fewest significant digits that read back to the same float
+	if ( negative ) *s++ = '-';
+	float const a = negative ? -f : f;
+	if ( a == 0 ) { *s++ = '0'; return s; }
+	int const k = (int) floor( log10( double(a) ) );	// approximate decimal exponent of the first digit
+	uint64_t digits = 0;
+	int exponent = 0;
+	bool found = false;
+	for ( int p=1; p<=9 && !found; p++ ) {
+		exponent = k - p + 1;
+		if ( exponent < -22 || exponent > 22 ) break;
+		double const scaled = exponent < 0 ? double(a) * Pow10(-exponent) : double(a) / Pow10(exponent);
+		digits = (uint64_t) ( scaled + 0.5 );
+		float back;
+		found = DecimalToFloat( digits, exponent, back ) && back == a;
+	}
+	if ( !found ) return s + sprintf( s, "%.9g", a );
+	while ( digits % 10 == 0 ) { digits /= 10; exponent++; }
+	char d[20];
+	int nd = 0;
+	for ( uint64_t t=digits; t; t/=10 ) d[nd++] = char('0' + t % 10);
+	int const pointPos = nd + exponent;	// number of digits before the decimal point
+	if ( pointPos > 9 || pointPos < -5 ) {
+		// scientific notation
+		*s++ = d[--nd];
+		if ( nd > 0 ) {
+			*s++ = '.';
+			while ( nd > 0 ) *s++ = d[--nd];
+		}
+		*s++ = 'e';
+		return WriteObjInt( s, pointPos-1 );
+	}
+	if ( pointPos <= 0 ) {
+		*s++ = '0';
+		*s++ = '.';
+		for ( int i=pointPos; i<0; i++ ) *s++ = '0';
+		while ( nd > 0 ) *s++ = d[--nd];
+	} else {
+		for ( int i=0; i<pointPos; i++ ) *s++ = i < nd ? d[nd-1-i] : '0';
+		if ( pointPos < nd ) {
+			*s++ = '.';
+			for ( int i=pointPos; i<nd; i++ ) *s++ = d[nd-1-i];
+		}
+	}
+	return s;
+}
+
+template <typename LINE_FUNC>
+inline bool TriMesh::WriteObjLines( FILE *fp, unsigned int count, size_t maxLineSize, LINE_FUNC const &lineFunc )
+{
+	// The lines are formatted in parallel in blocks, which are written to the file in order.
+	unsigned int const blockSize = 1 << 14;
+	unsigned int const numBlocks = ( count + blockSize - 1 ) / blockSize;
+	unsigned int const batchSize = (std::min)( numBlocks, (unsigned int) GetThreadCount() * 2 );
+	std::vector< std::vector<char> > buffer( batchSize );
+	std::vector<size_t> length( batchSize );
+	for ( unsigned int batch=0; batch<numBlocks; batch+=batchSize ) {
+		unsigned int const batchEnd = (std::min)( batch + batchSize, numBlocks );
+		ParallelFor( batch, batchEnd, [&]( unsigned int begin, unsigned int end ) {
+			for ( unsigned int b=begin; b<end; b++ ) {
+				std::vector<char> &buf = buffer[b-batch];
+				unsigned int const first = b * blockSize;
+				unsigned int const last  = (std::min)( first + blockSize, count );
+				buf.resize( size_t(last-first) * maxLineSize );
+				char *s = buf.data();
+				for ( unsigned int i=first; i<last; i++ ) s = lineFunc( s, i );
+				length[b-batch] = size_t( s - buf.data() );
+			}
+		} );
+		for ( unsigned int b=batch; b<batchEnd; b++ ) {
+			if ( fwrite( buffer[b-batch].data(), 1, length[b-batch], fp ) != length[b-batch] ) return false;
+		}
+	}
+	return true;
+}
+
+inline bool TriMesh::SaveToFileObj( char const *filename, std::ostream *outStream, int precision )
 {
 	FILE *fp = fopen(filename,"w");
 	if ( !fp ) {
@@ -557,44 +1208,264 @@ inline bool TriMesh::SaveToFileObj( char const *filename, std::ostream *outStrea
 		return false;
 	}
 
-	for ( unsigned int i=0; i<nv; i++ ) {
-		fprintf(fp,"v %f %f %f\n",v[i].x, v[i].y, v[i].z);
+	size_t const floatSize = 48 + ( precision > 0 ? precision : 0 );	// the longest value is FLT_MAX with all decimals
+	size_t const vertexLineSize = 3 + 3*(floatSize+1);
+	size_t const faceLineSize   = 3 + 3*(3*11+3);
+	Vec3f const *vertexArray = nullptr;
+	auto writeVertex = [&]( char *s, unsigned int i ) {
+		for ( int j=0; j<3; j++ ) {
+			*s++ = ' ';
+			s = WriteObjFloat( s, vertexArray[i][j], precision );
+		}
+		*s++ = '\n';
+		return s;
+	};
+	bool ok = true;
+	vertexArray = v;
+	ok = ok && WriteObjLines( fp, nv, vertexLineSize, [&]( char *s, unsigned int i ) { *s++='v'; return writeVertex(s,i); } );
+	vertexArray = vt;
+	ok = ok && WriteObjLines( fp, nvt, vertexLineSize, [&]( char *s, unsigned int i ) { *s++='v'; *s++='t'; return writeVertex(s,i); } );
+	vertexArray = vn;
+	ok = ok && WriteObjLines( fp, nvn, vertexLineSize, [&]( char *s, unsigned int i ) { *s++='v'; *s++='n'; return writeVertex(s,i); } );
+
+	int faceFormat = ((nvn>0)<<1) | (nvt>0);
+	ok = ok && WriteObjLines( fp, nf, faceLineSize, [&]( char *s, unsigned int i ) {
+		*s++ = 'f';
+		for ( int j=0; j<3; j++ ) {
+			*s++ = ' ';
+			s = WriteObjInt( s, int(f[i].v[j]+1) );
+			if ( faceFormat ) {
+				*s++ = '/';
+				if ( faceFormat & 1 ) s = WriteObjInt( s, int(ft[i].v[j]+1) );
+				if ( faceFormat & 2 ) {
+					*s++ = '/';
+					s = WriteObjInt( s, int(fn[i].v[j]+1) );
+				}
+			}
+		}
+		*s++ = '\n';
+		return s;
+	} );
+
+	if ( fclose(fp) != 0 ) ok = false;
+	if ( !ok && outStream ) *outStream << "ERROR: Cannot write file " << filename << std::endl;
+	return ok;
+}
+
+//-------------------------------------------------------------------------------
+
+inline bool TriMesh::LoadFromFileBinary( char const *filename, std::ostream *outStream )
+{
+	return LoadBinary( filename, outStream, -1 );
+}
+
+inline bool TriMesh::SaveToFileBinary( char const *filename, std::ostream *outStream )
+{
+	return SaveBinary( filename, outStream, 0 );
+}
+
+inline bool TriMesh::LoadFromFileObjCached( char const *filename, char const *cacheFilename, bool loadMtl, std::ostream *outStream )
+{
+	std::string cacheName = cacheFilename ? std::string(cacheFilename) : std::string(filename) + ".cymesh";
+	auto getModifiedTime = []( char const *name ) -> int64_t {
+#ifdef _WIN32
+		struct _stat64 s;
+		return _stat64( name, &s ) == 0 ? (int64_t) s.st_mtime : -1;
+#else
+		struct stat s;
+		return stat( name, &s ) == 0 ? (int64_t) s.st_mtime : -1;
+#endif
+	};
+	uint32_t flags = loadMtl ? 0 : BINARY_NO_MTL;
+	int64_t objTime = getModifiedTime( filename );
+	if ( objTime >= 0 && getModifiedTime( cacheName.c_str() ) > objTime ) {
+		if ( LoadBinary( cacheName.c_str(), nullptr, flags ) ) return true;
 	}
-	for ( unsigned int i=0; i<nvt; i++ ) {
-		fprintf(fp,"vt %f %f %f\n",vt[i].x, vt[i].y, vt[i].z);
+	if ( ! LoadFromFileObj( filename, loadMtl, outStream ) ) return false;
+	SaveBinary( cacheName.c_str(), outStream, flags );
+	return true;
+}
+
+inline bool TriMesh::LoadBinary( char const *filename, std::ostream *outStream, int requiredFlags )
+{
+	MappedFile *file = new MappedFile;
+	if ( ! file->Open( filename, true ) ) {
+		delete file;
+		if ( outStream ) *outStream << "ERROR: Cannot open file " << filename << std::endl;
+		return false;
 	}
-	for ( unsigned int i=0; i<nvn; i++ ) {
-		fprintf(fp,"vn %f %f %f\n",vn[i].x, vn[i].y, vn[i].z);
+	char const *data = (char const *) file->GetData();
+	uint64_t size = file->GetSize();
+
+	// Check the header and the array sizes before modifying the mesh
+	BinaryHeader h;
+	bool valid = size >= sizeof(BinaryHeader);
+	if ( valid ) {
+		memcpy( &h, data, sizeof(BinaryHeader) );
+		valid = memcmp( h.signature, "CYTM", 4 ) == 0 && h.version == BINARY_VERSION && h.headerSize == sizeof(BinaryHeader) && h.byteOrder == 0x01020304 && h.fileSize == size;
+		if ( requiredFlags >= 0 && h.flags != (uint32_t) requiredFlags ) valid = false;
 	}
-	int faceFormat = ((nvn>0)<<1) | (nvt>0);
-	switch ( faceFormat ) {
-	case 0:
-		for ( unsigned int i=0; i<nf; i++ ) {
-			fprintf(fp,"f %d %d %d\n", f[i].v[0]+1, f[i].v[1]+1, f[i].v[2]+1);
-		}
-		break;
-	case 1:
-		for ( unsigned int i=0; i<nf; i++ ) {
-			fprintf(fp,"f %d/%d %d/%d %d/%d\n", f[i].v[0]+1, ft[i].v[0]+1, f[i].v[1]+1, ft[i].v[1]+1, f[i].v[2]+1, ft[i].v[2]+1);
+	if ( valid ) {
+		uint64_t const count[7] = { h.nv, h.nf, h.nvn, h.nf, h.nvt, h.nf, h.nm };
+		uint64_t const elemSize[7] = { sizeof(Vec3f), sizeof(TriFace), sizeof(Vec3f), sizeof(TriFace), sizeof(Vec3f), sizeof(TriFace), sizeof(int) };
+		bool const optional[7] = { false, false, false, true, false, true, false };
+		for ( int i=0; i<7 && valid; i++ ) {
+			if ( h.offset[i] == 0 ) valid = count[i] == 0 || optional[i];
+			else valid = count[i] > 0 && h.offset[i] % 16 == 0 && h.offset[i] >= sizeof(BinaryHeader) && h.offset[i] <= size && count[i]*elemSize[i] <= size - h.offset[i];
 		}
-		break;
-	case 2:
-		for ( unsigned int i=0; i<nf; i++ ) {
-			fprintf(fp,"f %d//%d %d//%d %d//%d\n", f[i].v[0]+1, fn[i].v[0]+1, f[i].v[1]+1, fn[i].v[1]+1, f[i].v[2]+1, fn[i].v[2]+1);
-		}
-		break;
-	case 3:
-		for ( unsigned int i=0; i<nf; i++ ) {
-			fprintf(fp,"f %d/%d/%d %d/%d/%d %d/%d/%d\n", f[i].v[0]+1, ft[i].v[0]+1, fn[i].v[0]+1, f[i].v[1]+1, ft[i].v[1]+1, fn[i].v[1]+1, f[i].v[2]+1, ft[i].v[2]+1, fn[i].v[2]+1);
+		if ( h.nm > 0 ) valid = valid && h.offset[7] >= sizeof(BinaryHeader) && h.offset[7] <= size;
+	}
+
+	// Read the materials
+	std::vector<Mtl> mtl( valid ? h.nm : 0 );
+	if ( valid && h.nm > 0 ) {
+		char const *p = data + h.offset[7];
+		char const *end = data + size;
+		auto read = [&]( void *d, size_t n ) { if ( valid && size_t(end-p) >= n ) { memcpy(d,p,n); p+=n; } else valid=false; };
+		auto readStr = [&]( Str &s ) {
+			uint32_t n = 0;
+			read( &n, sizeof(n) );
+			if ( valid && n > 0 ) {
+				if ( size_t(end-p) < n || p[n-1] != '\0' ) valid = false;
+				else { s = p; p += n; }
+			}
+		};
+		for ( unsigned int i=0; i<h.nm && valid; i++ ) {
+			Mtl &mi = mtl[i];
+			read( mi.Ka, sizeof(mi.Ka) );
+			read( mi.Kd, sizeof(mi.Kd) );
+			read( mi.Ks, sizeof(mi.Ks) );
+			read( mi.Tf, sizeof(mi.Tf) );
+			read( &mi.Ns, sizeof(mi.Ns) );
+			read( &mi.Ni, sizeof(mi.Ni) );
+			read( &mi.illum, sizeof(mi.illum) );
+			readStr( mi.name     );
+			readStr( mi.map_Ka   );
+			readStr( mi.map_Kd   );
+			readStr( mi.map_Ks   );
+			readStr( mi.map_Ns   );
+			readStr( mi.map_d    );
+			readStr( mi.map_bump );
+			readStr( mi.map_disp );
 		}
-		break;
 	}
 
-	fclose(fp);
+	if ( !valid ) {
+		delete file;
+		if ( outStream ) *outStream << "ERROR: Invalid binary mesh file " << filename << std::endl;
+		return false;
+	}
 
+	Clear();
+	mappedFile = file;
+	char *d = (char *) file->GetData();
+	auto array = [&]( int i ) { return h.offset[i] ? d + h.offset[i] : nullptr; };
+	v    = (Vec3f  *) array(0);
+	f    = (TriFace*) array(1);
+	vn   = (Vec3f  *) array(2);
+	fn   = (TriFace*) array(3);
+	vt   = (Vec3f  *) array(4);
+	ft   = (TriFace*) array(5);
+	mcfc = (int    *) array(6);
+	nv  = h.nv;
+	nf  = h.nf;
+	nvn = h.nvn;
+	nvt = h.nvt;
+	if ( h.nm > 0 ) {
+		m  = new Mtl[h.nm];
+		nm = h.nm;
+		for ( unsigned int i=0; i<nm; i++ ) m[i] = mtl[i];
+	}
+	boundMin.Set( h.boundMin[0], h.boundMin[1], h.boundMin[2] );
+	boundMax.Set( h.boundMax[0], h.boundMax[1], h.boundMax[2] );
 	return true;
 }
 
+inline bool TriMesh::SaveBinary( char const *filename, std::ostream *outStream, uint32_t flags )
+{
+	// Serialize the materials
+	std::vector<char> mtlData;
+	auto write = [&]( void const *d, size_t n ) { mtlData.insert( mtlData.end(), (char const *) d, (char const *) d + n ); };
+	auto writeStr = [&]( Str const &s ) {
+		uint32_t n = s.data ? (uint32_t) strlen(s.data) + 1 : 0;
+		write( &n, sizeof(n) );
+		if ( n > 0 ) write( s.data, n );
+	};
+	for ( unsigned int i=0; i<nm; i++ ) {
+		Mtl const &mi = m[i];
+		write( mi.Ka, sizeof(mi.Ka) );
+		write( mi.Kd, sizeof(mi.Kd) );
+		write( mi.Ks, sizeof(mi.Ks) );
+		write( mi.Tf, sizeof(mi.Tf) );
+		write( &mi.Ns, sizeof(mi.Ns) );
+		write( &mi.Ni, sizeof(mi.Ni) );
+		write( &mi.illum, sizeof(mi.illum) );
+		writeStr( mi.name     );
+		writeStr( mi.map_Ka   );
+		writeStr( mi.map_Kd   );
+		writeStr( mi.map_Ks   );
+		writeStr( mi.map_Ns   );
+		writeStr( mi.map_d    );
+		writeStr( mi.map_bump );
+		writeStr( mi.map_disp );
+	}
+
+	// Compute the file layout
+	BinaryHeader h;
+	memset( &h, 0, sizeof(h) );
+	memcpy( h.signature, "CYTM", 4 );
+	h.version    = BINARY_VERSION;
+	h.headerSize = sizeof(BinaryHeader);
+	h.byteOrder  = 0x01020304;
+	h.flags      = flags;
+	h.nv  = nv;
+	h.nf  = nf;
+	h.nvn = nvn;
+	h.nvt = nvt;
+	h.nm  = nm;
+	h.boundMin[0] = boundMin.x;  h.boundMin[1] = boundMin.y;  h.boundMin[2] = boundMin.z;
+	h.boundMax[0] = boundMax.x;  h.boundMax[1] = boundMax.y;  h.boundMax[2] = boundMax.z;
+	void const *arrays[8] = { v, f, vn, fn, vt, ft, mcfc, mtlData.data() };
+	uint64_t const bytes[8] = { nv*sizeof(Vec3f), nf*sizeof(TriFace), nvn*sizeof(Vec3f), nf*sizeof(TriFace), nvt*sizeof(Vec3f), nf*sizeof(TriFace), nm*sizeof(int), mtlData.size() };
+	auto align = []( uint64_t n ) { return ( n + 15 ) & ~uint64_t(15); };
+	uint64_t fileSize = align( sizeof(BinaryHeader) );
+	for ( int i=0; i<8; i++ ) {
+		if ( arrays[i] && bytes[i] > 0 ) {
+			h.offset[i] = fileSize;
+			fileSize = align( fileSize + bytes[i] );
+		}
+	}
+	h.fileSize = fileSize;
+
+	// Write to a temporary file that replaces the given file at the end, so that the meshes that have
+	// mapped the previous version of the file (including this mesh) keep their data.
+	std::string tempFilename = std::string(filename) + ".tmp";
+	FILE *fp = fopen(tempFilename.c_str(),"wb");
+	if ( !fp ) {
+		if ( outStream ) *outStream << "ERROR: Cannot create file " << filename << std::endl;
+		return false;
+	}
+	char const zeros[16] = {};
+	uint64_t pos = sizeof(BinaryHeader);
+	bool ok = fwrite( &h, sizeof(BinaryHeader), 1, fp ) == 1;
+	for ( int i=0; i<8 && ok; i++ ) {
+		if ( h.offset[i] == 0 ) continue;
+		ok = fwrite( zeros, 1, size_t(h.offset[i]-pos), fp ) == size_t(h.offset[i]-pos) && fwrite( arrays[i], 1, size_t(bytes[i]), fp ) == size_t(bytes[i]);
+		pos = h.offset[i] + bytes[i];
+	}
+	if ( ok ) ok = fwrite( zeros, 1, size_t(fileSize-pos), fp ) == size_t(fileSize-pos);
+	if ( fclose(fp) != 0 ) ok = false;
+#ifdef _WIN32
+	if ( ok ) remove( filename );
+#endif
+	ok = ok && rename( tempFilename.c_str(), filename ) == 0;
+	if ( !ok ) {
+		remove( tempFilename.c_str() );
+		if ( outStream ) *outStream << "ERROR: Cannot write file " << filename << std::endl;
+	}
+	return ok;
+}
+
 //-------------------------------------------------------------------------------
 } // namespace cy
 //-------------------------------------------------------------------------------
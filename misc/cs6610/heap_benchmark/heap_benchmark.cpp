@@ -0,0 +1,156 @@
+// Compares the priority queues of cyHeap.h when they order the samples of
+// weighted sample elimination (cySampleElim.h) on 2D, 3D and 6D inputs.
+//
+// Usage: heap_benchmark [input size] [repeats]
+//
+// For each dimension, random input samples in the unit cube are reduced to a
+// fifth of their count, once with the default MaxDaryHeap and once with
+// MaxBucketQueue. The best total time of the repeats is printed with the time
+// spent in the queue operations of that run, followed by the smallest and the
+// average nearest-neighbor distance of the output samples relative to the
+// maximum Poisson disk radius, so that the quality lost to the approximate
+// order of the bucket queue can be checked as well.
+
+// immintrin.h does not compile on ARM machines
+#ifdef __aarch64__
+#define CY_NO_IMMINTRIN_H
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cyHeap.h>
+#include <cySampleElim.h>
+#include <cyVector.h>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+// Definitions
+#define OUTPUT_FRACTION 5
+#define HIGH_DIMENSIONS 6
+
+template <int D> using Point = cy::Vec<float, D>;
+
+// Adds up the time spent in building the queue, popping the top sample and
+// moving down the neighbors with decreased weights
+template <typename QUEUE_TYPE> class TimedQueue : public QUEUE_TYPE {
+public:
+  void Build() {
+    auto start = std::chrono::steady_clock::now();
+    QUEUE_TYPE::Build();
+    add_time(start);
+  }
+  uint32_t Pop() {
+    auto start = std::chrono::steady_clock::now();
+    uint32_t id = QUEUE_TYPE::Pop();
+    add_time(start);
+    return id;
+  }
+  void MoveItemsDown(uint32_t count, const uint32_t *ids) {
+    auto start = std::chrono::steady_clock::now();
+    QUEUE_TYPE::MoveItemsDown(count, ids);
+    add_time(start);
+  }
+  static double time;
+
+private:
+  static void add_time(std::chrono::steady_clock::time_point start) {
+    time += std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          start)
+                .count();
+  }
+};
+template <typename QUEUE_TYPE> double TimedQueue<QUEUE_TYPE>::time = 0;
+
+// Reports the nearest-neighbor distances of the given samples
+template <int D>
+static void print_quality(const std::vector<Point<D>> &samples,
+                          float max_radius) {
+  cy::PointCloud<Point<D>, float, D, uint32_t> cloud;
+  cloud.Build(uint32_t(samples.size()), samples.data());
+  double min_dist = max_radius * 2, avg_dist = 0;
+  for (size_t i = 0; i < samples.size(); i++) {
+    // The nearest point is the sample itself
+    uint32_t index[2];
+    float dist2[2];
+    cloud.template GetKNearestPoints<2>(samples[i], index, dist2);
+    double dist = std::sqrt(dist2[1]);
+    min_dist = std::min(min_dist, dist);
+    avg_dist += dist;
+  }
+  avg_dist /= samples.size();
+  printf("    min %.3f  avg %.3f", min_dist / max_radius, avg_dist / max_radius);
+}
+
+// Runs sample elimination with the given queue type and returns the time spent
+// in the queue during the run with the best total time
+template <int D, typename QUEUE_TYPE>
+static double run(const char *name, const std::vector<Point<D>> &input,
+                  int repeats) {
+  uint32_t output_size = uint32_t(input.size() / OUTPUT_FRACTION);
+  std::vector<Point<D>> output(output_size);
+  cy::WeightedSampleElimination<Point<D>, float, D, uint32_t,
+                                TimedQueue<QUEUE_TYPE>>
+      wse;
+  double best = 0, best_queue = 0;
+  for (int r = 0; r < repeats; r++) {
+    TimedQueue<QUEUE_TYPE>::time = 0;
+    auto start = std::chrono::steady_clock::now();
+    wse.Eliminate(input.data(), uint32_t(input.size()), output.data(),
+                  output_size);
+    double time = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    if (r == 0 || time < best) {
+      best = time;
+      best_queue = TimedQueue<QUEUE_TYPE>::time;
+    }
+  }
+  printf("  %-14s total %8.3f s  queue %7.3f s", name, best, best_queue);
+  print_quality<D>(output, wse.GetMaxPoissonDiskRadius(D, output_size));
+  printf("\n");
+  return best_queue;
+}
+
+// Compares the queues on random samples in the D-dimensional unit cube
+template <int D> static void compare(size_t input_size, int repeats) {
+  std::mt19937 rng(D);
+  std::uniform_real_distribution<float> uniform(0, 1);
+  std::vector<Point<D>> input(input_size);
+  for (size_t i = 0; i < input_size; i++)
+    for (int d = 0; d < D; d++)
+      input[i][d] = uniform(rng);
+
+  printf("%dD, %zu -> %zu samples\n", D, input_size,
+         input_size / OUTPUT_FRACTION);
+  double heap_time =
+      run<D, cy::MaxDaryHeap<float, uint32_t>>("MaxDaryHeap", input, repeats);
+  double bucket_time = run<D, cy::MaxBucketQueue<float, uint32_t>>(
+      "MaxBucketQueue", input, repeats);
+  printf("  queue time of the bucket queue / heap: %.2f\n\n",
+         bucket_time / heap_time);
+}
+
+int main(int argc, char **argv) {
+  // Check arg count
+  if (argc > 3) {
+    fprintf(stderr, "Expected at most two arguments, the input size and the "
+                    "number of repeats. Terminating.\n");
+    exit(EXIT_FAILURE);
+  }
+  long input_size = argc > 1 ? atol(argv[1]) : 500000;
+  int repeats = argc > 2 ? atoi(argv[2]) : 3;
+  if (input_size < OUTPUT_FRACTION * 2 || repeats < 1) {
+    fprintf(stderr, "Invalid input size or number of repeats. Terminating.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  compare<2>(size_t(input_size), repeats);
+  compare<3>(size_t(input_size), repeats);
+  // Fewer samples in high dimensions, where each sample has many neighbors
+  compare<HIGH_DIMENSIONS>(size_t(input_size) / 4, repeats);
+  return EXIT_SUCCESS;
+}